@@ -48,6 +48,23 @@
   #define ST04          "%04llu"
 #endif
 
+/** Hot kernels are inlined into the drivers that run them over the tiles */
+#ifdef __GNUC__
+  #define KERNEL        static inline __attribute__((always_inline))
+#else
+  #define KERNEL        static
+#endif
+
+/** Storage type of the static parameter fields and of the maximum fields.
+   With -DFLOAT_FIELDS they are kept in single precision, which halves their
+   memory and bandwidth; the conserved fields and the arithmetic remain in
+   double precision. */
+#ifdef FLOAT_FIELDS
+  typedef float   real_s;
+#else
+  typedef double  real_s;
+#endif
+
 /** Code version */
 #define VERSION         "2025-05-20"
 #define INPUT_VERSION   "2024-09-10"
@@ -59,18 +76,35 @@
 #include <ctype.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include <locale.h>
 #include <libgen.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <errno.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /** General constants and simple functions */
 
+#define PI          3.14159265358979323846
 #define SQ(A)       ((A) * (A))
 #define MAX(a,b)    ((a) > (b) ? (a) : (b))
 #define MIN(a,b)    ((a) < (b) ? (a) : (b))
+#define WINDOW(F,i,j)  ((size_t) (i) >= wi0/rfac                           \
+                        && (size_t) (i) < wi0/rfac + m                    \
+                        && (size_t) (j) >= wj0/rfac                       \
+                        && (size_t) (j) < wj0/rfac + n                    \
+                        ? F[(size_t) (i) - wi0/rfac][(size_t) (j) - wj0/rfac] \
+                        : 0.0)
+                                    /**< Field at cell (i, j) of the output
+                                         rasters, 0 outside of the window */
 
 #define TRIES_MAX   30              /**< Max. # attempts at memory allocation */
 #define TRY_WAIT    3               /**< Wait (s) between allocation attempts */
@@ -94,6 +128,9 @@ char mu_s_fn[512];                  /**< Name of bed frict. coeff. raster file *
 char mu_fn[512];                    /**< Name of dry-friction-coefficient file */
 char k_fn[512];                     /**< Name of drag-coefficient file */
 char nD_fn[512];                    /**< Name of file with forest density nD */
+char obst_fn[512];                  /**< Name of obstacle raster file */
+char zone_fn[512];                  /**< Name of parameter-zone raster file */
+char zone_tab_fn[512];              /**< Name of file with zone parameters */
 char tD_fn[512];                    /**< Name of file with tree diameter tD */
 char erod_tab_fn[512];              /**< Name of file with IsPa erosion table */
 char out_fn[512];                   /**< Name of output file */
@@ -118,6 +155,15 @@ double t_dump = 0.0;                /**< Next time for writing field values */
 double dt_dump = 1.0;               /**< Write interval for results (s) */
 double cfl = 0.7;                   /**< Courant-Friedrichs-Levy number */
 double mov_vol;                     /**< Total volume in motion */
+double tot_vol;                     /**< Total volume in the domain, kept
+                                         up to date from the fluxes */
+double vol_rel;                     /**< Released volume */
+double vol_ero = 0.0;               /**< Volume entrained so far */
+double vol_dep = 0.0;               /**< Volume deposited so far */
+double vol_out = 0.0;               /**< Volume that has left the domain */
+double dv_ero, dv_dep, dv_out;      /**< The same in the current time step */
+int    mass_interval = 100;         /**< Time steps between exact recounts of
+                                         tot_vol, 0: never */
 double h_lim = 5.0;                 /**< Max. effective flow depth for drag term,
                                        reasonable range is 5–10 m. */
 double h_min = 0.05;                /**< Minimum flow height in active cells */
@@ -141,10 +187,176 @@ size_t j_max;                       /**< N boundary of active grid domain */
 double xllcorner;                   /**< x-coord. lower left corner of grid */
 double yllcorner;                   /**< y-coord. lower left corner of grid */
 double cellsize;                    /**< Projected size of square cell */
+size_t m_all, n_all;                /**< Size of the input rasters */
+size_t wi0 = 0, wj0 = 0;            /**< Computational window [wi0, wi1) × */
+size_t wi1 = 0, wj1 = 0;            /**< [wj0, wj1) in the input rasters,
+                                         wi1 = 0: entire rasters */
+size_t rfac = 1;                    /**< Input rasters are averaged over
+                                         rfac × rfac cells */
+double xll_all, yll_all, cs_all;    /**< Georeference of the input rasters */
+int    grid_fac = 1;                /**< Coarsening factor of the grid */
+int    crop_fac = 1;                /**< Coarsening factor of pre-run */
+double crop_margin = 0.0;           /**< Safety margin around footprint (m) */
+double el_alpha = 0.0;              /**< Energy-line angle of the pre-screen
+                                         (deg), 0: no pre-screen */
+double el_margin = 0.0;             /**< Safety margin around its reach (m) */
 double **dx;                        /**< Oblique W-E length of a cell */
 double **dy;                        /**< Oblique S-N length of a cell */
 double **dA;                        /**< Oblique area of a cell */
 
+/** Domain decomposition (compiled with -DUSE_MPI). The computational window
+   is split into strips of rows, one per process. A process holds the
+   fields of its own rows plus HALO_ROWS rows of each neighbor, which it
+   computes along with its own ones and which are overwritten by the
+   neighbor's values after every time step. Sums over cells only count the
+   own rows. */
+
+#define HALO_ROWS   2               /**< The fluxes into a cell reach one row
+                                         out, the slopes and curvatures that
+                                         determine them one more */
+int    mpi_rank = 0;                /**< Rank of this process */
+int    mpi_size = 1;                /**< Number of subdomains */
+#ifdef USE_MPI
+  #define OWN_ROW(j)    ((j) >= sub_j0 && (j) < sub_j1)
+size_t sub_j0 = 0;                  /**< Own rows [sub_j0, sub_j1), all */
+size_t sub_j1 = (size_t) -1;        /**< rows before mpi_split() */
+size_t sub_off;                     /**< Row of the whole window that is
+                                         row 0 of the subdomain */
+size_t gj_min, gj_max;              /**< Active rows of the whole window */
+double *halo_buf;                   /**< Send and receive buffers */
+#else
+  #define OWN_ROW(j)    1
+#endif
+
+/** Tiles for multithreading (compiled with -fopenmp). The active region is
+   cut into tiles of tile_size × tile_size cells on a grid anchored at the
+   origin of the window, and the hot kernels are run tile by tile. Every
+   tile has an owner thread: the rows of tiles are dealt out to the threads
+   in pairs, cyclically. The grid rows of the fields are allocated and first
+   written by the owner of their tiles (first touch), so that on a machine
+   with several sockets (NUMA) they are placed in the memory of the owner's
+   socket. Each thread starts with its own tiles in its deque and, once that
+   is empty, steals tiles from the tail of the other deques, which balances
+   the load when the flow covers the tiles unevenly. The transport
+   step of flux_sweep() runs in four phases, one per colour of a 2×2 pattern
+   of tiles; as a tile is at least 2 cells wide, the tiles of one phase never
+   write to the same cell. The results therefore do not depend on the number
+   of threads, but a single thread, like a build without OpenMP, works on
+   the active region as one tile unless deterministic reductions (see
+   det_on) are on, and then sums the fluxes across tile edges in another
+   order. With mesh refinement, the active region is
+   always a single tile. */
+
+#define TILE_DEF        32              /**< Default edge of a tile (cells) */
+#define TILE_PHASES     5               /**< All tiles, then 4 colours */
+#define TILE_ALL        0               /**< Phase containing all tiles */
+#define TILE_OWNER(ti)  ((int) ((ti) / 2 % (size_t) n_threads))
+                                        /**< Thread owning the row ti of tiles */
+#define ROW_CHUNK       ((int) (2 * tile_size))
+                                        /**< Grid rows dealt out at a time */
+
+struct tile {                           /**< Rectangle of cells */
+  size_t i0, i1, j0, j1;                /**< Cells [i0, i1) × [j0, j1) */
+  int    neg;                           /**< flux_sweep() found h < 0 */
+  double dt;                            /**< Time step of the tile */
+  double dv[3];                         /**< Eroded, deposited, outflowing
+                                             volume of the tile */
+  double mov, mom;                      /**< Moving volume and momentum of
+                                             the tile (update_boundaries()) */
+  int    box[4];                        /**< W, E, S, N edges of its moving
+                                             cells */
+};
+
+struct tile_deque {                     /**< Tiles of a thread in a phase */
+  size_t head, tail;                    /**< Range [head, tail) of tile_q */
+};
+
+size_t tile_size = TILE_DEF;        /**< Edge of a tile (cells) */
+int    tile_on = 0;                 /**< Several tiles (OpenMP, no AMR) */
+int    n_threads = 1;               /**< Threads running the tiles */
+size_t n_tiles = 0;                 /**< Tiles of the current plan */
+size_t tile_cap;                    /**< Allocated tiles */
+size_t tile_box[6];                 /**< m, n, i_min, i_max, j_min, j_max of
+                                         the current plan */
+struct tile *tiles;                 /**< Tiles of the active region */
+size_t *tile_q;                     /**< Tile indices by phase and thread */
+struct tile_deque *tile_dq;         /**< Deque of each phase and thread */
+struct tile_deque *tile_dq0;        /**< Initial deques of the plan */
+#ifdef _OPENMP
+  #define TILE_PARALLEL _Pragma("omp parallel if (tile_on && n_threads > 1)")
+  #define TILE_BARRIER  _Pragma("omp barrier")
+  #define CACHE_LINE    64
+
+struct thread_stat {                    /**< Work of a thread, padded to a
+                                             cache line */
+  double busy;                          /**< Time spent in tiles (s) */
+  double t0;                            /**< Start of the current tile */
+  size_t tiles;                         /**< Tiles computed */
+  size_t stolen;                        /**< Tiles taken from other threads */
+  char   pad[CACHE_LINE - 2*sizeof(double) - 2*sizeof(size_t)];
+};
+
+omp_lock_t *tile_lock;              /**< Lock of the deques of each thread */
+struct thread_stat *tile_stat;      /**< Statistics of each thread */
+double tile_wall = 0.0;             /**< Wall time in the tiled kernels (s) */
+double tile_t0;                     /**< Start of the current tiled kernel */
+#else
+  #define TILE_PARALLEL
+  #define TILE_BARRIER
+#endif
+
+/** Sleeping cells. A cell is still if, over the last step, it kept its
+   volume and zero momentum, its geometry was not recomputed, and it lay
+   inside the active region, away from its edge, so that the earth pressure
+   on its faces was not a repeated one. Nothing moved it and static
+   friction held, so the same happens in the next step as long as the
+   earth pressure on its faces and its geometry do not change, i.e., as
+   long as its eight neighbors were still, too; as these start the step
+   without momentum, no inflow reaches it either. Such a cell sleeps: its
+   fields stay the same over the step, and source_terms(), find_dt(),
+   flux_sweep(), arrest_cells(), primivar() and update_boundaries() pass
+   over it. A neighbor that gains volume or momentum wakes it for the next
+   step, a geometry update at once. start_step() flags the still cells and
+   sleep_cells() the sleeping ones; a grid line i is only searched if lines
+   i-1, i and i+1 each hold three still cells in a row. Most sleeping
+   cells are empty cells inside the active region. Apart from the time
+   step, which sleeping cells no longer limit, the results are the same as
+   without sleeping cells. */
+
+#define SLP_STILL       1               /**< Cell was still in the last step */
+#define SLP_ROW         2               /**< Cell and its j-neighbors still */
+#define SLP_SLEEP       4               /**< Cell is skipped in this step */
+#define SLP_GEO         8               /**< Geometry recomputed (wakes it) */
+#define SLEEPING(i,j)   (slp != NULL && (slp[i][j] & SLP_SLEEP))
+
+int    slp_on = 0;                  /**< Sleeping cells switched on */
+unsigned char **slp = NULL;         /**< Sleep flags of the cells, NULL: off */
+unsigned char *slp_line;            /**< Line i holds an SLP_ROW cell */
+size_t slp_box[4];                  /**< Active region of the last step */
+double slp_cells;                   /**< Sleeping cells summed over steps */
+double slp_all;                     /**< All cells of the active regions */
+
+/** Reproducible reductions. With det_on, the results are bitwise the same
+   for any number of threads and in builds with and without OpenMP: the
+   active region is cut into tiles in all of them, also for a single
+   thread, the fluxes across the tile edges thus arrive in the order of the
+   2×2 phases, and the sums over the tiles (volume changes, moving volume
+   and momentum) are formed by a pairwise tree in the order of the plan
+   (tree_sum()). With MPI, the sums of the subdomains are gathered and
+   added in the order of the ranks. Minima and maxima, e.g. of the time
+   step, do not depend on the order anyway. In the fast mode (det_on = 0),
+   a single thread works on the active region as one tile, the tiles are
+   summed one after the other, and MPI adds up the subdomains in the order
+   chosen by the library, so that the last bits may depend on the number
+   of threads, the build and the MPI library. With repro_on, a pre-run on
+   one thread precedes the run, and the hashes of the result fields of the
+   two are compared at the end (repro_prerun(), repro_report()). */
+
+int    det_on = 0;                  /**< Deterministic reductions */
+int    repro_on = 0;                /**< Self-check against one thread */
+unsigned long long repro_ref;       /**< Hash of the pre-run on one thread */
+double *tile_red;                   /**< Values of the tiles to be summed */
+
 /** Physical constants and material properties */
 
 double g = 9.81;                    /**< Gravitational acceleration (m/s^2) */
@@ -153,9 +365,13 @@ double **gy;                        /**< y-comp. of gravitat. acceleration */
 double **gz0;                       /**< z-comp. of gravitat. acceleration */
 double **gz;                        /**< Bed-normal gravitational acceleration
                                          incl. centrifugal acceleration */
-double **kxx;
-double **kxy;                       /**< Components of curvature tensor*/
-double **kyy;
+real_s **kxx;
+real_s **kxy;                       /**< Components of curvature tensor*/
+double **px;                        /**< Earth pressure on the W face of a
+                                         cell, (m+1)×n */
+double **py;                        /**< Earth pressure on the S face of a
+                                         cell, m×(n+1) */
+real_s **kyy;
 double **G_xy;                      /**< Rescaled off-diagonal metric tensor */
 double rho   = 250.0;               /**< Flow density (kg/m^3) */
 double rho_b = 200.0;               /**< Bed (snow cover) density */
@@ -179,6 +395,8 @@ char   params[9];                   /**< Friction parameters can be "constant"
 int    restart = 0;                 /**< Flag for non-zero initial velocity */
 int    para = 0;                    /**< Const./variable friction param. (0/1) */
 int    curve = 0;                   /**< Curvature effects (1/0) */
+int    fric_exact = 0;              /**< Friction integrated exactly after the
+                                         transport step (1/0) */
 int    forest = 0;                  /**< Drag in forest (0/1/2) */
 int    dyn_surf = 0;                /**< Dynamic surface flag (1/0) */
 int    dep = 0;                     /**< Deposition flag (1/0) */
@@ -196,55 +414,292 @@ double **s;                         /**< Speed field */
 double **p_imp;                     /**< Impact pressure field */
 double ***f_old;                    /**< Old values of conserved fields */
 double ***f_new;                    /**< Time-stepped values of conserv. flds */
-double ***src;                      /**< Area-integrated source terms */
+double ***src;                      /**< Area-integrated source terms; with
+                                         fric_exact, [3] holds the dry
+                                         friction per unit mass and [4]
+                                         the turbulent friction coeff. k */
 double **d;                         /**< Field of deposition depth (m) */
 double **z0;                        /**< Terrain surface elevation */
 double **z;                         /**< Surface elevation incl. snow/deposit */
+double **bd_geo;                    /**< b + d at the last geometry update */
+unsigned char **geo_flag;           /**< Cell in dirty list or recomputed */
+size_t *geo_dirty;                  /**< Dirty cells (i·n + j) whose b + d
+                                         changed by more than geo_tol or
+                                         whose bed normal turned, room for
+                                         those of two updates */
+size_t n_dirty = 0;                 /**< Number of dirty cells */
+double geo_tol = 0.0;               /**< Change of b + d (m) that triggers
+                                         a geometry update */
 double **b;                         /**< Snow-cover (bed) depth (m) */
-double **tau_c;                     /**< Bed shear strength (Pa) */
-double **mu;                        /**< Dry-friction coefficient */
-double **k;                         /**< Drag-friction coefficient */
-double **mu_s;                      /**< Bed friction coefficient */
-double **h_max;                     /**< Field of max. attained flow depths */
-double **s_max;                     /**< Field of max. attained flow speeds */
-double **p_max;                     /**< Field of max. attained impact press. */
-double **u_max;                     /**< Field of max. attained u-velocity */
-double **v_max;                     /**< Field of max. attained v-velocity */
-double **b_min;                     /**< Minimum bed depth (due to erosion) */
-double **d_max;                     /**< Max. deposition depth */
-double **nD;                        /**< Field of forest opacity (n·D) */
-double **tD;                        /**< Field of avg. tree diameter */
-double **decay_const;               /**< Coeff. in tree fall-down rate */
+double **bgx, **bgy;                /**< Gradient of b along x, y (GOEM) */
+unsigned char **bg_stale;           /**< b changed near cell since bgx, bgy
+                                         were computed */
+real_s **tau_c;                     /**< Bed shear strength (Pa) */
+real_s **mu;                        /**< Dry-friction coefficient */
+real_s **k;                         /**< Drag-friction coefficient */
+real_s **mu_s;                      /**< Bed friction coefficient */
+real_s **h_max;                     /**< Field of max. attained flow depths */
+real_s **s_max;                     /**< Field of max. attained flow speeds */
+real_s **p_max;                     /**< Field of max. attained impact press. */
+real_s **u_max;                     /**< Field of max. attained u-velocity */
+real_s **v_max;                     /**< Field of max. attained v-velocity */
+real_s **b_min;                     /**< Minimum bed depth (due to erosion) */
+real_s **d_max;                     /**< Max. deposition depth */
 float  *data;                       /**< Array holding data to be written */
 
+/** Forest. Only a small part of the domain is usually forested, so the
+   forested cells (n·D > 0) are kept in a compact list in row-major order
+   together with their parameters and state. fc_row[i] is the first entry
+   of row i, and fc_idx gives the entry of a cell or -1 outside forest. */
+
+struct forest_cell {                /**< One forested cell */
+  size_t j;                         /**< Column; the row follows from fc_row */
+  real_s nD;                        /**< Forest opacity (n·D) */
+  real_s tD;                        /**< Average tree diameter */
+  real_s decay_const;               /**< Coeff. in tree fall-down rate */
+};
+struct forest_cell *fc = NULL;      /**< List of forested cells */
+size_t n_fc = 0;                    /**< Number of forested cells */
+size_t *fc_row;                     /**< First entry of each row (m+1) */
+int    *fc_idx;                     /**< Entry of cell i·n + j or -1 */
+#define FC_AT(i,j)      fc_idx[(i)*n + (j)]
+
+/** Parameter zones. Instead of the rasters of mu, k, tau_c and mu_s, a raster
+   of zone codes and a table with the parameters of each zone can be given.
+   The friction parameters of a cell are then looked up in the small table,
+   and the parameter rasters are not allocated. */
+
+#define ZONES_MAX   256             /**< Zone codes are 0, ..., ZONES_MAX-1 */
+#define MU_AT(i,j)      (zone != NULL ? zone_tab[zone[i][j]].mu : mu[i][j])
+#define K_AT(i,j)       (zone != NULL ? zone_tab[zone[i][j]].k : k[i][j])
+#define TAU_C_AT(i,j)   (zone != NULL ? zone_tab[zone[i][j]].tau_c      \
+                                      : tau_c[i][j])
+#define MU_S_AT(i,j)    (zone != NULL ? zone_tab[zone[i][j]].mu_s       \
+                                      : mu_s[i][j])
+                                    /**< Parameters of cell (i, j) */
+
+struct zone_par {                   /**< Parameters of one zone */
+  double mu, k;                     /**< Dry-friction and drag coefficients */
+  double tau_c, mu_s;               /**< Bed shear strength (scaled by rho,
+                                         m²/s²) and bed friction coeff. */
+  int    defined;                   /**< Zone is listed in the table */
+};
+
+unsigned char **zone = NULL;        /**< Zone of each cell, NULL: no zones */
+struct zone_par zone_tab[ZONES_MAX];    /**< Parameters of the zones */
+
+/** Tabulated (IsPa) erosion law. The table in erod_tab_fn gives the erosion
+   rate on a rectilinear grid in flow speed, flow depth and bed strength. At
+   start-up, it is resampled onto a uniform grid, so that source_terms()
+   finds the enclosing grid cell by a multiplication instead of a search.
+   Bed strength and erosion rate are stored scaled by rho, like tau_c. */
+
+#define ETAB_N_MAX  64              /**< Max. lookup nodes per axis */
+size_t etab_n[3];                   /**< Lookup nodes along u, h and tau_c */
+double etab_x0[3];                  /**< First node along each axis */
+double etab_idx[3];                 /**< Inverse node spacing on each axis */
+double *etab = NULL;                /**< Rates, index (a·n_h + b)·n_tau + c */
+
+/** Tangent-linear (forward-mode) sensitivity fields. For each selected
+   parameter p, the tl_ fields hold the derivatives of the corresponding
+   primal fields with respect to that parameter. */
+
+#define N_SENS_MAX  4               /**< Max. # of sensitivity parameters */
+#define SENS_MU     0               /**< Codes of the parameters for which */
+#define SENS_K      1               /**< derivatives can be computed, cf.  */
+#define SENS_KP     2               /**< sens_names[]                      */
+#define SENS_KERO   3
+#define TL_DP_MIN   0.01            /**< Regularization of GOEM derivative */
+#define TL_SW_UMIN  0               /**< Kinds of switching events: speed */
+#define TL_SW_STOP  1               /**< passing u_min, arrest, depth     */
+#define TL_SW_HMIN  2               /**< passing h_min, cf. tl_event()    */
+#define TL_SW_KINDS 3
+
+char   *sens_names[N_SENS_MAX] = {"mu", "k", "kp", "k_erod"};
+int    n_sens = 0;                  /**< Number of sensitivity parameters */
+int    sens_par[N_SENS_MAX];        /**< Parameter codes, SENS_MU etc. */
+double ***tl_f_old[N_SENS_MAX];     /**< Derivatives of f_old */
+double ***tl_f_new[N_SENS_MAX];     /**< Derivatives of f_new */
+double ***tl_src[N_SENS_MAX];       /**< Derivatives of unlimited src */
+double **tl_h[N_SENS_MAX];          /**< Derivatives of h */
+double **tl_u[N_SENS_MAX];          /**< Derivatives of u */
+double **tl_v[N_SENS_MAX];          /**< Derivatives of v */
+double **tl_s[N_SENS_MAX];          /**< Derivatives of s */
+double **tl_b[N_SENS_MAX];          /**< Derivatives of b */
+double **tl_d[N_SENS_MAX];          /**< Derivatives of d */
+double **tl_h_max[N_SENS_MAX];      /**< Derivatives of h_max */
+double **tl_s_max[N_SENS_MAX];      /**< Derivatives of s_max */
+double **tl_sw;                     /**< Switching events in each cell */
+double tl_n_sw[TL_SW_KINDS];        /**< Switching events of each kind */
+double **src_raw;                   /**< Mass source before rate limiting */
+
+/** Quadtree adaptive mesh refinement (AMR). Level 0 is the input grid, the
+   cells of level l are 2^l times larger. Every level holds full-size fields,
+   but only its leaf cells are computed; the other cells are skipped by the
+   kernels through cmask. The globals describing the grid and the fields
+   (m, n, cellsize, h, f_new, ...) always refer to the level lev, which is
+   switched by amr_switch(). */
+
+#define AMR_LEVELS_MAX  4               /**< Max. # of refinement levels */
+#define CELL_ON         1               /**< Cell is computed (quadtree leaf) */
+#define AMR_REFINED     2               /**< Cell is covered by finer leaves */
+#define AMR_COVERED     4               /**< Cell lies in a coarser leaf */
+#define AMR_EDGE        8               /**< Leaf next to another level */
+#define CELL_WALL       16              /**< No data or obstacle, reflects */
+#define SKIP_CELL(i,j)  (cmask != NULL && !(cmask[i][j] & CELL_ON))
+#define WALL(i,j)       (cmask != NULL && (cmask[i][j] & CELL_WALL))
+
+struct amr_level {                      /**< Grid and fields of one level */
+  size_t m, n, i_min, i_max, j_min, j_max;
+  double cellsize;
+  double **dx, **dy, **dA, **gx, **gy, **gz0, **gz, **G_xy;
+  double **h, **u, **v, **s, **p_imp, **d, **z0, **px, **py;
+  real_s **kxx, **kxy, **kyy, **mu, **k;
+  real_s **h_max, **s_max, **p_max, **u_max, **v_max;
+  double ***f_old, ***f_new, ***src;
+  float  *data;
+  unsigned char **cmask;
+};
+
+int    amr_levels = 1;              /**< # of levels, 1: uniform grid */
+int    amr_interval = 10;           /**< Time steps between regriddings */
+double amr_tol = 0.3;               /**< Relative depth jump for refinement */
+int    lev = 0;                     /**< Level currently loaded in globals */
+struct amr_level amr[AMR_LEVELS_MAX];
+unsigned char **cmask = NULL;       /**< Cell flags, NULL: compute all cells */
+unsigned char **amr_want;           /**< Desired level on the input grid */
+unsigned char **amr_lam;            /**< Resulting leaf level on input grid */
+unsigned char **amr_minw[AMR_LEVELS_MAX];   /**< Min. of amr_want per cell of
+                                                 the coarser levels */
+
 /** Subroutines */
 
 double **allocate2(size_t, size_t); /**< Dynamically allocate 2D array */
 double ***allocate3(size_t, size_t, size_t);            /**<  3D array */
 void   deallocate2(double **, size_t);          /**< Deallocate 2D array */
 void   deallocate3(double ***, size_t, size_t); /**< Deallocate 3D array */
+real_s **allocate2s(size_t, size_t);            /**< 2D array of type real_s */
+void   deallocate2s(real_s **, size_t);         /**< Deallocate real_s array */
 void   allocate(void);              /**< Dynamically allocate arrays */
 void   deallocate(void);            /**< Deallocate dynamic arrays*/
 void   read_command_file(char *);   /**< Does what it says! */
+void   read_grid_header(void);      /**< Reads raster geometry of the DTM */
 void   read_grid_file(void);        /**< Reads DTM into array */
 void   update_surface(double **);   /**< Adapts surface to erosion/deposition,
                                          (re-)calculates slope and curvature */
+void   surface_cell(double **, size_t, size_t);
+                                    /**< Slope and curvature of one cell */
+void   mark_dirty(size_t, size_t);  /**< Note a change of b or d in a cell */
+void   mark_bed_grad(size_t, size_t); /**< b or geometry of a cell changed */
+void   update_geometry(void);       /**< Geometry of the dirty cells */
 void   read_init_file(void);        /**< Set initial conditions from input */
+int    time_loop(char *, int);      /**< Integrate until the run stops */
+void   energy_line(void);           /**< Reach of an energy-line model */
+void   footprint(void);             /**< Coarse pre-run to crop the domain */
+int    window_edge(void);           /**< Flow reached the cropped boundary? */
 int    read_raster(char *, double **, double, double, double,  double, int);
                                     /**< Read data from AAIGrid file to array */
+int    read_raster_s(char *, real_s **, double);
+                                    /**< The same for a real_s field */
+double **fine_area_factor(void);    /**< Inclination factors of the DEM cells
+                                         at full resolution in the window */
+void   resample_raster(FILE *, char *, double **, size_t, size_t, double,
+                       double, double, double, int);
+                                    /**< Resample raster data onto the grid */
 void   write_data(double, double **, double **, double **, double **,
-                  double **, double **, double **, double **, double **,
+                  double **, double **, double **, double **,
                   size_t, size_t, size_t, size_t, int, char *);
                                     /**< Handles output from a time slice */
 void   writeout(double **, char *, char *, size_t, size_t, size_t, size_t,
                 char *, char *, char *);    /**< Writes output data to files */
-void   primivar(double ***);        /**< Computes primitive variables h,u,v,s
+void   writeout_s(real_s **, char *, char *, size_t, size_t, size_t, size_t,
+                  char *, char *, char *);  /**< The same for a real_s field */
+KERNEL void primivar(double ***, struct tile *);
+                                    /**< Computes primitive variables h,u,v,s
                                          from conserved fields h, hu, hv */
-double ***source_terms(void);       /**< Computes source terms mass, momentum */
-double find_dt(void);               /**< New time step from CFL condition */
+KERNEL void source_terms(struct tile *);
+                                    /**< Computes source terms mass, momentum */
+KERNEL double find_dt(struct tile *);   /**< New time step from CFL
+                                             condition */
 double update_boundaries(double ***);   /**< Determine new active region and
                                              quantity of movement */
+KERNEL void tile_bounds(double ***, struct tile *);
+                                    /**< The same within one tile */
+KERNEL void cell_maxima(size_t, size_t);
+                                    /**< Update the maximum fields of a cell */
+void   mass_recount(void);          /**< Exact tot_vol and mass balance */
+void   mpi_split(void);             /**< Strip of rows of this process */
+void   halo_exchange(void);         /**< Halo rows from the neighbors */
+void   all_sum(double *, int);      /**< Sums over all subdomains */
+double all_min(double);             /**< Minimum over all subdomains */
+double all_max(double);             /**< Maximum over all subdomains */
+void   thread_init(void);           /**< Threads and their pinning */
+void   tile_init(void);             /**< Allocate the tiles and deques */
+void   tile_free(void);             /**< Free them */
+void   tile_plan(void);             /**< Cut the active region into tiles */
+void   tile_start(void);            /**< Fill the deques for a kernel */
+struct tile *tile_next(int);        /**< Next tile of a phase for a thread */
+void   tile_done(void);             /**< The thread finished its tile */
+void   tile_stop(void);             /**< All tiles of a kernel are done */
+int    tile_failed(int);            /**< h < 0 in a tile of earlier phases? */
+int    tile_sum(void);              /**< Volume changes summed over tiles */
+double tree_sum(double *, size_t);  /**< Sum in a fixed order */
+double tile_min_dt(void);           /**< Time step, minimum over tiles */
+void   tile_report(void);           /**< Work and utilisation per thread */
+void   run_source_terms(void);      /**< The kernels on all tiles */
+int    run_flux_sweep(void);
+void   run_primivar(double ***);
+void   run_bounds(double ***);
+double run_find_dt(void);
+void   run_friction_step(void);
+void   sleep_cells(void);           /**< Flag the cells that sleep */
+void   sleep_report(void);          /**< Cell updates skipped by sleeping */
+unsigned long long field_hash(void);    /**< Hash of the result fields */
+void   repro_prerun(void);          /**< Pre-run on one thread */
+int    repro_report(void);          /**< Compare the run with the pre-run */
 void   create_dir(char *, char *);  /**< Create output directories as needed */
+double bed_grad_x(double **, size_t, size_t);   /**< Centred x- and y-deriv. */
+double bed_grad_y(double **, size_t, size_t);   /**< of a bed-depth field */
+double erod_rate(double, double, double, double *);
+                                    /**< Rate from the IsPa erosion table */
+double tl_gz(int, size_t, size_t);  /**< Derivative of curvature-corrected gz */
+double tl_press(int, size_t, size_t, size_t, size_t, double, double *);
+                                    /**< Earth-pressure force and derivative */
+void   tl_source_terms(void);       /**< Derivatives of source terms */
+void   tl_flux(void);               /**< Derivatives of the flux update */
+void   tl_primivar(void);           /**< Derivatives of primitive variables */
+void   tl_maxima(void);             /**< Derivatives of maximum fields */
+void   tl_event(int, size_t, size_t);   /**< Count a switching event */
+void   tl_report(void);             /**< Switching events of the run */
+void   start_step(size_t, size_t, size_t, size_t);
+                                    /**< Save f_old, curvature-corrected gz */
+KERNEL void face_pressure(struct tile *);   /**< Earth pressure on all
+                                                 faces of the cells */
+KERNEL int flux_sweep(struct tile *);   /**< Transport and pressure step,
+                                             returns 1 if a flow height
+                                             became negative */
+KERNEL void friction_step(struct tile *);   /**< Exact friction update of
+                                                 the moving cells */
+void   restore_step(void);          /**< Reset f_new to f_old for a repeat */
+double arrest_cells(size_t, size_t, size_t, size_t);
+                                    /**< Stop cells with reversed momentum */
+unsigned char **allocate2c(size_t, size_t); /**< 2D array of flag bytes */
+void   deallocate2c(unsigned char **, size_t);  /**< Free 2D flag array */
+void   amr_switch(int);             /**< Load grid and fields of a level */
+void   amr_init(void);              /**< Build coarse levels and first tree */
+void   amr_regrid(int);             /**< Adapt the quadtree to the flow */
+void   amr_transfer(size_t, size_t, int, int, double, double, double);
+                                    /**< Flux into a cell of another level */
+void   wall_reflect(size_t, size_t, int, int, double, double, double);
+                                    /**< Flux towards a wall cell reflected */
+void   set_wall(size_t, size_t);    /**< Remove a cell from the computation */
+void   fill_nodata(void);           /**< Walls where the DEM has no data */
+void   read_zones(void);            /**< Zone raster and parameter table */
+void   read_erod_table(void);       /**< IsPa table and its lookup grid */
+void   amr_ghosts(void);            /**< h, gz of neighbors on other levels */
+void   amr_boxes(void);             /**< Common active region of all levels */
+void   amr_composite(int);          /**< Copy leaf values to the input grid */
+void   amr_finish(void);            /**< Report and free the coarse levels */
 
 
 /*******************/
@@ -258,23 +713,21 @@ int main(int argc, char *argv[])
 {
 
   char   reason[80];
-  size_t i, j, p, q;
-  int   di, dj;
-  int    n_step = 0;
-  int    repeat_flag;                   /**< Time step needs to be repeated */
-  int    stop_code = 0;                 /**< Reason why simulation terminated */
-  double aux, auy;                      /**< Auxiliary quantities */
-  double U, V;                          /**< Local velocity components */
-  double dAx, dAy, dAd;                 /**< Area fluxes to neighboring cells */
-  double qhx, qhy, qhd;                 /**< Mass fluxes between cells */
-  double qxx, qxy, qxd, qyx, qyy, qyd;  /**< Momentum fluxes to neighbor cells */
-  double pWx, pEx, pSy, pNy;            /**< Earth pressure at cell boundaries */
-  double F_drive_x, F_drive_y;          /**< Gravity and earth-pressure grad. */
-  double F_drive_2, F_fric_2;           /**< Driving & retarding forces squared */
-  double dir_cos, dir_sin;
-  double mom_tot;                       /**< Approx. total avalanche momentum */
-  double t_dmpp = 0.0;                  /**< Time of last write-out */
+  int    stop_code;                     /**< Reason why simulation terminated */
+#if defined(USE_MPI) && defined(_OPENMP)
+  int    thr_level;                     /**< Thread support of the MPI library */
+#endif
 
+#ifdef USE_MPI
+#ifdef _OPENMP
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thr_level);
+#else
+  MPI_Init(&argc, &argv);
+#endif
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  if (mpi_rank > 0 && freopen("/dev/null", "w", stdout) == NULL)
+    exit(3);                    /* Only rank 0 reports */
+#endif
 
   printf("\n");
   printf("*****************************************************************\n");
@@ -300,9 +753,76 @@ int main(int argc, char *argv[])
   /* Set up the calculation. */
 
   read_command_file(argv[1]);
+  thread_init();                /* Threads and their CPUs (OpenMP) */
+  if (el_alpha > 0.0)
+    energy_line();              /* Conservative reach sets the window */
+  if (crop_fac > 1)
+    footprint();                /* Coarse pre-run sets the window */
+  mpi_split();                  /* Strip of the window (MPI) */
+  if (repro_on)
+    repro_prerun();             /* The same run on one thread */
   read_grid_file();             /* Load z0 and reference raster header. */
   read_init_file();             /* Initializes all field variables, too. */
   printf("   main:  read_init_file completed.\n");
+  tile_init();                  /* Tiles for the threads (OpenMP) */
+  if (amr_levels > 1)
+    amr_init();                 /* Coarse levels and initial quadtree */
+
+  stop_code = time_loop(reason, 1);
+  if (repro_on && repro_report())
+    stop_code = 120;            /* Compared before write_data() fills d */
+  if (window_edge())
+    printf("   main:  Flow reached the edge of the cropped domain,"
+           " increase the margin!\n");
+
+  /* Write maximum fields over entire simulation (incl. deposit depth). */
+  write_data(t, d, h, b, d, s, u, v, p_imp, 0, m, 0, n, 2, fmt);
+
+  tile_report();                /* Load balance of the threads */
+  sleep_report();               /* Cell updates skipped by sleeping */
+  tl_report();                  /* Switching events (sensitivities) */
+  if (amr_levels > 1)
+    amr_finish();               /* Also frees the coarse levels */
+  tile_free();
+  deallocate();
+  printf("\n   Simulation terminated because %s.\n\n", reason);
+
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
+  exit(stop_code);
+
+}
+
+/**********************/
+/*  End of main(...)  */
+/**********************/
+
+
+/********************/
+/*                  */
+/*  time_loop(...)  */
+/*                  */
+/********************/
+
+/** Integrates from the initial conditions until t_max is reached, the
+    avalanche stops or the time step becomes too small. The reason is
+    copied to reason[] and the stop code returned. With out == 0, no time
+    slices are written. */
+
+int time_loop(char *reason, int out)
+
+{
+  size_t i, j;
+  int    l;                             /**< Refinement level */
+  int    n_step = 0;
+  int    repeat_flag;                   /**< Time step needs to be repeated */
+  int    stop_code = 0;                 /**< Reason why simulation terminated */
+  double aux;                           /**< Auxiliary quantity */
+  double mom_tot;                       /**< Approx. total avalanche momentum */
+  double vol_mov;                       /**< Moving volume */
+  double t_dmpp = 0.0;                  /**< Time of last write-out */
+  double dv[3];                         /**< Volume changes to be summed */
 
   t = 0.0;
   t_dump = -dt_dump;
@@ -312,11 +832,24 @@ int main(int argc, char *argv[])
   j_max = n;
   strncpy(reason, "time limit was reached", 23);
   repeat_flag = 0;              /* repeat initially false   */
+  slp_box[0] = slp_box[1] = slp_box[2] = slp_box[3] = 0;
+  slp_cells = slp_all = 0.0;            /* No cell was still before */
 
-  if (dyn_surf) {
-    for (i = i_min; i < i_max; i++)
-      for (j = j_min; j < j_max; j++)
-        z[i][j] = z0[i][j];
+  if (dyn_surf) {                       /* Bed and deposit on the terrain */
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++) {
+        bd_geo[i][j] = b[i][j] + d[i][j];
+        z[i][j] = z0[i][j] + bd_geo[i][j] * g / gz0[i][j];
+        geo_flag[i][j] = 0;
+      }
+    n_dirty = 0;
+    update_surface(z);
+    for (i = 0; i < m; i++)             /* z along the new bed normals */
+      for (j = 0; j < n; j++)
+        if (bd_geo[i][j] != 0.0) {
+          geo_flag[i][j] = 1;
+          geo_dirty[n_dirty++] = i*n + j;
+        }
   }
 
 
@@ -324,235 +857,140 @@ int main(int argc, char *argv[])
 
   while (t < t_max) {
 
-    printf("   main:  Step %5d,  t = %8.4f s,  %7.0f m^3,  ["ST","ST"]x["ST","ST"]\n",
+    printf("   time_loop:  Step %5d,  t = %8.4f s,  %7.0f m^3,  "
+           "["ST","ST"]x["ST","ST"]\n",
            n_step, t, mov_vol, i_min, i_max, j_min, j_max);
-    if (t >= t_dump + dt_dump && t_max >= dt_dump) {
-      printf("   main:  Calling write_data()...\n");
-      write_data(t, h, h, b, d, s, u, v, p_imp, nD,
+    if (out && t >= t_dump + dt_dump && t_max >= dt_dump) {
+      printf("   time_loop:  Calling write_data()...\n");
+      if (amr_levels > 1)
+        amr_composite(0);
+      write_data(t, h, h, b, d, s, u, v, p_imp,
                  i_min, i_max, j_min, j_max, 1, fmt);
       t_dmpp = t;
       t_dump += dt_dump;
       n_dump++;
-      printf("   main:  write_data() has returned.\n");
-    }
-
-    if (curve == 0)                     /* Without curvature effects */
-      for (i = i_min; i < i_max; i++)
-        for (j = j_min; j < j_max; j++)
-          memcpy(f_old[i][j], f_new[i][j], 3*sizeof(double));
-          /**< NB. f_old is needed in case the timestep needs to be repeated. */
-
-    else if (curve == 1) {              /* With curvature effects */
-      for (i = i_min; i < i_max; i++) {
-        for (j = j_min; j < j_max; j++) {
-          /**< NB. f_old is needed in case the timestep needs to be repeated. */
-          memcpy(f_old[i][j], f_new[i][j], 3*sizeof(double));
-
-          /* Normal force corrected for curvature effects, with gz limited to
-             non-negative values to prevent lift-off on convex terrain.
-             Contributed by Hervé Vicari, 2023. */
-          U = u[i][j]; V = v[i][j];
-          gz[i][j] = MAX(0.0, gz0[i][j] + kxx[i][j]*U*U + kyy[i][j]*V*V
-                              + 2.0*kxy[i][j]*U*V);
-        }
-      }
+      printf("   time_loop:  write_data() has returned.\n");
     }
 
-    if ((dt = find_dt()) < dt_min) {
+    /* Save the old field values (needed if the time step has to be
+       repeated) and correct gz for curvature. With mesh refinement, this
+       and the following steps are done level by level; the loops end with
+       level 0 loaded. Cells that stayed still sleep in this step. */
+    for (l = amr_levels-1; l >= 0; l--) {
+      amr_switch(l);
+      start_step(i_min, i_max, j_min, j_max);
+    }
+    if (slp != NULL)
+      sleep_cells();
+    if (amr_levels > 1)
+      amr_ghosts();                     /* h, gz across level boundaries */
+
+    for (l = amr_levels-1, aux = dt_max; l >= 0; l--) {
+      amr_switch(l);
+      dt = run_find_dt();
+      aux = MIN(aux, dt);
+    }
+    if ((dt = all_min(aux)) < dt_min) {
       strncpy(reason, "timestep fell below lower bound", 32);
       stop_code = 2;
-      printf("   main:  dt set to %.5f s.\n", dt);
+      printf("   time_loop:  dt set to %.5f s.\n", dt);
       break;                            /* Leave time loop to shut down. */
     }
 
-    src = source_terms();
-
-    for (i = i_min; i < i_max; i++) {
-
-      if (repeat_flag == 1) {
-        printf(".");
-        for (p = i_min; p < i_max; p++) /* Restore old field values */
-          for (q = j_min; q < j_max; q++)
-            memcpy(f_new[p][q], f_old[p][q], 3*sizeof(double));
-        repeat_flag = 0;                /* Start i-loop again with reduced   */
-        i = i_min - 1;                  /* timestep and f_new reset to f_old */
-        dt *= 0.8;                      /* by resetting i and `continue'.    */
-        if (dt < dt_min) {
-          strncpy(reason, "timestep fell below lower bound", 32);
-          repeat_flag = -1;             /* Signals failure by setting flag. */
-          stop_code = 2;		        /* Use as exit code at shut-down. */
-          break;                        /* Break out of i-loop; flag triggers*/
-                                        /* break statement below i-loop. */
-        }
-        continue;                       /* Start the i-loop over again; i is */
-                                        /* incremented from i_min-1 to i_min */
-      }
-
-      for (j = j_min; j < j_max; j++) {
-
-        /* Quantities used in all field components: */
-        di = (u[i][j] >= 0.0 ? 1 : -1);
-        dj = (v[i][j] >= 0.0 ? 1 : -1);
-        aux = fabs(u[i][j]) * dt;
-        auy = fabs(v[i][j]) * dt;
-        dAx = aux * (dy[i][j] - auy);   /* Area flowing out in x-direction */
-        dAy = auy * (dx[i][j] - aux);   /* Area flowing out in y-direction */
-        dAd = aux * auy;                /* Outflow in diagonal direction */
-
-        /* Bed depth limits erosion, flow depth limits deposition: */
-        if (eromod > 0 && src[i][j][0] > 0.0) {     /* Erosion */
-          /* Check erosion rate limit: */
-          src[i][j][0] = MIN( src[i][j][0], b[i][j]*dA[i][j]/(rrb*dt) );
-          /* Update erosion reservoir: */
-          b[i][j] = MAX(0.0, b[i][j] - src[i][j][0]*rrb*dt/dA[i][j]);
-          /* MAX(...) used to prevent spurious −0.0 rounding errors.
-             Contributed by Hervé Vicari and Callum Tregaskis. */
-        }
-        else if (dep > 0 && src[i][j][0] < 0) {     /* Deposition */
-          /* Check deposition rate limit: */
-          src[i][j][0] = MAX( src[i][j][0], -f_old[i][j][0]/dt );
-          /* Update deposit reservoir: */
-          d[i][j] -= src[i][j][0] * rrd * dt / dA[i][j];
-        }
-        else src[i][j][0] = 0.0;
-
-        /* Advective mass fluxes: */
-        qhx = h[i][j] * dAx;
-        qhy = h[i][j] * dAy;
-        qhd = h[i][j] * dAd;
-
-        /* Advective momentum fluxes: */
-        qxx = qhx * u[i][j];
-        qxy = qhy * u[i][j];
-        qxd = qhd * u[i][j];
-        qyx = qhx * v[i][j];
-        qyy = qhy * v[i][j];
-        qyd = qhd * v[i][j];
-
-        f_new[i][j][0] -= (qhx + qhy + qhd - src[i][j][0]*dt);
-        f_new[i][j][1] -= qxx + qxy + qxd;      /* Flowing out of cell (i,j) */
-        f_new[i][j][2] -= qyx + qyy + qyd;
-
-        if ((int) i + di >= 0 && (int) i + di < (int) m) {
-          f_new[(size_t) ((int)i+di)][j][0] += qhx; /* Can be ahead or behind */
-          f_new[(size_t) ((int)i+di)][j][1] += qxx; /* (i,j) depending on di  */
-          f_new[(size_t) ((int)i+di)][j][2] += qyx;
-        }
-        if ((int) j + dj >= 0 && (int) j + dj < (int) n) {
-          f_new[i][(size_t) ((int)j+dj)][0] += qhy;
-          f_new[i][(size_t) ((int)j+dj)][1] += qxy;
-          f_new[i][(size_t) ((int)j+dj)][2] += qyy;
-        }
-        if ((int) i + di >= 0 && (int) i + di < (int) m
-            && (int) j + dj >= 0 && (int) j + dj < (int) n) {
-          f_new[(size_t) ((int)i+di)][(size_t) ((int)j+dj)][0] += qhd;
-          f_new[(size_t) ((int)i+di)][(size_t) ((int)j+dj)][1] += qxd;
-          f_new[(size_t) ((int)i+di)][(size_t) ((int)j+dj)][2] += qyd;
-        }
-
-        /* Test for negative flow heights: */
-        if (f_new[i][j][0] < 0.0) {
-          repeat_flag = 1;
-          break;                        /* Break out of j-loop, start next */
-        }                               /* iteration of i-loop. */
-
-        /* Momentum fluxes due to pressure gradients:
-           Need to distinguish between empty cells (no pressure transmission),
-           non-empty cells in movement (friction forces fully activated), and
-           non-empty cells at rest, where the static friction force may or may
-           not be fully activated. */
-
-        /* Pressure gradient in x-direction */
-        if (i > i_min && i < i_max-1) {
-          pEx = 0.25 * kp * dy[i+1][j]
-                * (gz[i][j]+gz[i+1][j]) * h[i][j]*h[i+1][j];
-          pWx = 0.25 * kp * dy[i][j]
-                * (gz[i-1][j]+gz[i][j]) * h[i-1][j]*h[i][j];
-        }
-        /* Von Neumann boundary conditions for outermost cells: */
-        else if (i == i_min)
-          pWx = pEx = 0.25 * kp * dy[i+1][j]
-                      * (gz[i][j]+gz[i+1][j]) * h[i][j]*h[i+1][j];
-        else if (i == i_max-1)
-          pEx = pWx = 0.25 * kp * dy[i][j]
-                      * (gz[i-1][j]+gz[i][j]) * h[i-1][j]*h[i][j];
-        /* Include (superfluous) ELSE for sake of some compilers. */
-        else
-          pEx = pWx = 0.0;
-
-        /* Pressure gradient in y-direction */
-        if (j > j_min && j < j_max-1) {
-          pNy = 0.25 * kp * dx[i][j+1]
-                * (gz[i][j]+gz[i][j+1]) * h[i][j]*h[i][j+1];
-          pSy = 0.25 * kp * dx[i][j]
-                  * (gz[i][j-1]+gz[i][j]) * h[i][j-1]*h[i][j];
-        }
-        /* Von Neumann boundary conditions for outermost cells: */
-        else if (j == j_min)
-          pSy = pNy = 0.25 * kp * dx[i][j+1]
-                      * (gz[i][j]+gz[i][j+1]) * h[i][j]*h[i][j+1];
-        else if (j == j_max-1)
-          pNy = pSy = 0.25 * kp * dx[i][j]
-                      * (gz[i][j-1]+gz[i][j]) * h[i][j-1]*h[i][j];
-        /* Include (superfluous) ELSE for sake of some compilers. */
-        else
-          pNy = pSy = 0.0;
-
-        /* Test whether non-empty cells at rest will start moving. */
-
-        if (s[i][j] <= u_min) {
-          /* Gravity and pressure gradient combined: */
-          F_drive_x = gx[i][j] * f_old[i][j][0] + pWx - pEx;
-          F_drive_y = gy[i][j] * f_old[i][j][0] + pSy - pNy;
-          F_drive_2 = SQ(F_drive_x) + SQ(F_drive_y)
-                      + 2.0 * G_xy[i][j] * F_drive_x * F_drive_y;
-
-          /* Is dry friction fully activated? If not, the driving and
-             resisting forces cancel and there is no need to add to f_new. */
-          F_fric_2 = SQ(mu[i][j] * gz[i][j] * f_old[i][j][0]);
-          if (F_drive_2 > F_fric_2) {
-            dir_cos = F_drive_x / sqrt(F_drive_2);
-			dir_sin = F_drive_y / sqrt(F_drive_2);
-			f_new[i][j][1] += (F_drive_x - dir_cos*sqrt(F_fric_2)) * dt;
-            f_new[i][j][2] += (F_drive_y - dir_sin*sqrt(F_fric_2)) * dt;
-          }
-        }
-        else {
-          f_new[i][j][1] += (pWx - pEx + src[i][j][1]) * dt;
-          f_new[i][j][2] += (pSy - pNy + src[i][j][2]) * dt;
-        }
+    for (l = amr_levels-1; l >= 0; l--) {
+      amr_switch(l);
+      run_source_terms();
+    }
+    if (n_sens > 0)
+      tl_source_terms();                /* Before src is rate-limited below */
+
+    /* Transport step. If a flow height becomes negative, the old field
+       values are restored and the step is repeated with reduced dt. */
+    for (;;) {
+      dv_ero = dv_dep = dv_out = 0.0;
+      for (l = amr_levels-1, repeat_flag = 0; l >= 0 && !repeat_flag; l--) {
+        amr_switch(l);
+        repeat_flag = run_flux_sweep();
+      }
+      if ((repeat_flag = (int) all_max(repeat_flag)) == 0)
+        break;
+      printf(".");
+      for (l = amr_levels-1; l >= 0; l--) {
+        amr_switch(l);
+        restore_step();
+      }
+      dt *= 0.8;
+      if (dt < dt_min) {
+        strncpy(reason, "timestep fell below lower bound", 32);
+        repeat_flag = -1;               /* Signals failure by setting flag. */
+        stop_code = 2;                  /* Use as exit code at shut-down. */
+        break;
       }
     }
 
     if (repeat_flag == -1) break;       /* Break out of time loop. */
 
-    /* If the momentum vector in a cell reverses direction, arrest
-       the cell unless the new direction is downhill: */
-    for (i = i_min; i < i_max; i++)
-      for (j = j_min; j < j_max; j++)
-        if (f_old[i][j][1]*f_new[i][j][1]
-                  + f_old[i][j][2]*f_new[i][j][2] < 0.0
-            && f_new[i][j][1]*gx[i][j] + f_new[i][j][2]*gy[i][j] < 0.0) {
-          if (dep == 1) {
-            d[i][j] += f_new[i][j][0] / dA[i][j];
-            f_new[i][j][0] = 0.0;
-          }
-          f_new[i][j][1] = 0.0;
-          f_new[i][j][2] = 0.0;
-        }
+    /* Friction on the momentum of the accepted step: */
+    for (l = amr_levels-1; l >= 0 && fric_exact; l--) {
+      amr_switch(l);
+      run_friction_step();
+    }
+    dv[0] = dv_ero;                     /* Own rows of all subdomains */
+    dv[1] = dv_dep;
+    dv[2] = dv_out;
+    all_sum(dv, 3);
+    dv_ero = dv[0];
+    dv_dep = dv[1];
+    dv_out = dv[2];
+    vol_ero += dv_ero;                  /* Mass balance of the accepted step */
+    vol_dep += dv_dep;
+    vol_out += dv_out;
+    tot_vol += dv_ero - dv_dep - dv_out;
+
+    /* Tangent-linear step with the accepted dt, including the arrest test
+       below, which needs f_new before the arrest: */
+    if (n_sens > 0)
+      tl_flux();
+
+    for (l = amr_levels-1, dv[1] = 0.0; l >= 0; l--) {
+      amr_switch(l);
+      dv[1] += arrest_cells(i_min, i_max, j_min, j_max);
+    }
+    if (dep == 1) {
+      all_sum(&dv[1], 1);
+      vol_dep += dv[1];
+      tot_vol -= dv[1];
+    }
+    halo_exchange();                    /* Subdomain edges (MPI) */
 
     /* Update surface elevation for dynamic bed computation: */
-    if (dyn_surf) {
-      for (i = i_min; i <= i_max; i++)
-        for (j = j_min; j <= j_max; j++)
-          /* Add bed layer and deposited layer to surface. */
-          z[i][j] = z0[i][j] + (b[i][j] + d[i][j]) * g / gz0[i][j];
-      update_surface(z);
-    }
+    if (dyn_surf)
+      update_geometry();
+
+    /* Adapt the quadtree to the moving front: */
+    if (amr_levels > 1 && n_step % amr_interval == amr_interval-1)
+      amr_regrid(0);
 
     /* Update boundaries and test if avalanche still moves: */
-    primivar(f_new);
-    mom_tot = update_boundaries(f_new);
+    mom_tot = vol_mov = 0.0;
+    for (l = amr_levels-1; l >= 0; l--) {
+      amr_switch(l);
+      run_primivar(f_new);
+      if (n_sens > 0) {
+        tl_primivar();
+        tl_maxima();                    /* Needs h_max, s_max before update */
+      }
+      mom_tot += update_boundaries(f_new);
+      vol_mov += mov_vol;
+    }
+    if (amr_levels > 1) {
+      mov_vol = vol_mov;
+      printf("      V_tot = %7.0f m³  V_mov = %7.0f m³  J_tot = %6.0f t m/s\n",
+             tot_vol, vol_mov, 0.001*rho*mom_tot);
+      amr_boxes();
+    }
+    if (mass_interval > 0 && n_step % mass_interval == mass_interval-1)
+      mass_recount();                   /* Guards against drift */
     if (mom_tot < mom_thr && n_step > 10) {
       strncpy(reason, "avalanche has stopped or left the domain", 43);
       stop_code = 1;
@@ -563,30 +1001,280 @@ int main(int argc, char *argv[])
     t += dt;
     n_step++;
   }
-  printf("   main:  Finished time loop.\n");
+  printf("   time_loop:  Finished time loop.\n");
+  mass_recount();
 
   /* End of time loop */
 
+  /* Transfer the solution from the quadtree to the input grid: */
+  if (amr_levels > 1)
+    amr_composite(1);
+
   /* Write out last time step only if there is new data! */
-  if (t > t_dmpp && t_max >= dt_dump)
-    write_data(t, d, h, b, d, s, u, v, p_imp, nD, 0, m, 0, n,
+  if (out && t > t_dmpp && t_max >= dt_dump)
+    write_data(t, d, h, b, d, s, u, v, p_imp, 0, m, 0, n,
                1, fmt);
 
-  /* Write maximum fields over entire simulation (incl. deposit depth). */
-  write_data(t, d, h_max, b_min, d_max, s_max, u_max, v_max, p_max, nD,
-             0, m, 0, n, 2, fmt);
+  return(stop_code);
+}
 
-  deallocate();
-  printf("\n   Simulation terminated because %s.\n\n", reason);
+/***************************/
+/*  End of time_loop(...)  */
+/***************************/
 
-  exit(stop_code);
 
+/**********************/
+/*                    */
+/*  energy_line(...)  */
+/*                    */
+/**********************/
+
+/** Conservative reach of the avalanche from a mass-point model without
+    drag: starting at rest on top of the release, the energy line drops by
+    tan(el_alpha) per unit of horizontal path length, and every cell where
+    it is still above the terrain can be reached. The energy height is
+    propagated to the 8 neighbours of a cell in order of decreasing height,
+    so each cell is finished when it is taken from the queue. Grid paths are
+    up to 8.24 % longer than straight lines; the slope of the energy line is
+    reduced accordingly. The computational window is set to the bounding
+    box of the reached cells plus el_margin. Only the DEM and the release
+    depth are held in memory. */
+
+void energy_line(void)
+
+{
+  size_t i, j, a, bb, c, l, q, mc, nq = 0, nq_max = 1024, n_reach = 0;
+  size_t a0, a1, b0, b1;                /**< Reach on the input rasters */
+  int    da, db;
+  double **Z, **E;                      /**< Terrain and energy height */
+  double *qe, e, e_last, tan_a;         /**< Heap of energy heights */
+  size_t *qc, c_last;                   /**< and of cell indices */
+
+#define EL_PUSH(EH, CI)                                                     \
+  {                                                                         \
+    if (nq == nq_max) {                                                     \
+      nq_max *= 2;                                                          \
+      qe = (double*) realloc(qe, nq_max * sizeof(double));                  \
+      qc = (size_t*) realloc(qc, nq_max * sizeof(size_t));                  \
+      if (qe == NULL || qc == NULL) {                                       \
+        printf("   energy_line:  Memory allocation failed. STOP!\n\n");     \
+        exit(8);                                                            \
+      }                                                                     \
+    }                                                                       \
+    for (q = nq++; q > 0 && qe[(q-1)/2] < (EH); q = (q-1)/2) {              \
+      qe[q] = qe[(q-1)/2];                                                  \
+      qc[q] = qc[(q-1)/2];                                                  \
+    }                                                                       \
+    qe[q] = (EH);                                                           \
+    qc[q] = (CI);                                                           \
+  }
+
+  rfac = 1;                             /* m, n etc. describe the entire */
+  read_grid_header();                   /* DEM at full resolution now */
+  Z = allocate2(m, n);
+  E = allocate2(m, n);
+  read_raster(grid_fn, Z, xll_all, yll_all, cs_all, -9998.9, 0);
+  if (read_raster(h_fn, E, xll_all, yll_all, cs_all, 0.0, 2) == 1) {
+    printf("   energy_line:  No file for release depth. STOP!\n");
+    exit(40);
+  }
+  if ((qe = (double*) malloc(nq_max * sizeof(double))) == NULL
+      || (qc = (size_t*) malloc(nq_max * sizeof(size_t))) == NULL) {
+    printf("   energy_line:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+
+  /* The DEM includes the release, so the mass starts at z: */
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++) {
+      E[i][j] = (E[i][j] > 0.0 ? Z[i][j] : -DBL_MAX);
+      if (E[i][j] > -DBL_MAX)
+        EL_PUSH(E[i][j], i*n + j);
+    }
+
+  tan_a = tan(el_alpha * atan(1.0) / 45.0) / 1.0824;
+  while (nq > 0) {
+    e = qe[0];                          /* Take the highest cell */
+    c = qc[0];
+    e_last = qe[--nq];
+    c_last = qc[nq];
+    for (q = 0; (l = 2*q + 1) < nq; q = l) {
+      if (l+1 < nq && qe[l+1] > qe[l])
+        l++;
+      if (qe[l] <= e_last)
+        break;
+      qe[q] = qe[l];
+      qc[q] = qc[l];
+    }
+    qe[q] = e_last;
+    qc[q] = c_last;
+
+    i = c / n;
+    j = c % n;
+    if (e < E[i][j])                    /* Superseded entry */
+      continue;
+    for (da = -1; da <= 1; da++)
+      for (db = -1; db <= 1; db++) {
+        if ((da == 0 && db == 0) || (da < 0 && i == 0) || (db < 0 && j == 0)
+            || (da > 0 && i == m-1) || (db > 0 && j == n-1))
+          continue;
+        a = (size_t) ((int) i + da);
+        bb = (size_t) ((int) j + db);
+        e = E[i][j] - tan_a * cs_all * (da && db ? sqrt(2.0) : 1.0);
+        if (e >= Z[a][bb] && e > E[a][bb] && Z[a][bb] > -HUGE_VAL) {
+          E[a][bb] = e;
+          EL_PUSH(e, a*n + bb);
+        }
+      }
+  }
+
+  a0 = m;
+  b0 = n;
+  a1 = b1 = 0;
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (E[i][j] > -DBL_MAX) {
+        n_reach++;
+        a0 = MIN(a0, i);
+        a1 = MAX(a1, i+1);
+        b0 = MIN(b0, j);
+        b1 = MAX(b1, j+1);
+      }
+  if (n_reach == 0) {
+    printf("   energy_line:  No release cells found. STOP!\n\n");
+    exit(40);
+  }
+
+  mc = (size_t) ceil(el_margin / cs_all);
+  wi0 = (a0 > mc ? a0 - mc : 0);
+  wj0 = (b0 > mc ? b0 - mc : 0);
+  wi0 -= wi0 % (size_t) grid_fac;       /* Align with the coarsened grid */
+  wj0 -= wj0 % (size_t) grid_fac;
+  wi1 = MIN(m_all, a1 + mc);
+  wj1 = MIN(n_all, b1 + mc);
+
+  free(qc);
+  free(qe);
+  deallocate2(E, m);
+  deallocate2(Z, m);
+  rfac = (size_t) grid_fac;
+  printf("   energy_line:  "ST" cells reached at alpha = %.1f°.\n",
+         n_reach, el_alpha);
+  printf("   energy_line:  Window ["ST", "ST")x["ST", "ST") of "ST"x"ST" cells"
+         " (%.1f %%).\n\n", wi0, wi1, wj0, wj1, m_all, n_all,
+         100.0 * (double) ((wi1-wi0) * (wj1-wj0))
+         / (double) (m_all * n_all));
+#undef EL_PUSH
+}
+
+/*****************************/
+/*  End of energy_line(...)  */
+/*****************************/
+
+
+/********************/
+/*                  */
+/*  footprint(...)  */
+/*                  */
+/********************/
+
+/** Pre-run on the input rasters coarsened by crop_fac, without output. The
+    computational window of the main run is set to the cells reached by the
+    flow plus crop_margin on every side. Mesh refinement and sensitivities
+    are not needed for this and are switched off. */
+
+void footprint(void)
+
+{
+  char   reason[80];
+  size_t i, j, mc;
+  size_t a0, a1, b0, b1;                /**< Footprint on the coarse grid */
+  int    levels = amr_levels, sens = n_sens;
+
+  printf("   footprint:  Pre-run on rasters coarsened by a factor %d.\n\n",
+         crop_fac);
+  amr_levels = 1;
+  n_sens = 0;
+  rfac = (size_t) (crop_fac * grid_fac);
+  read_grid_file();
+  read_init_file();
+  tile_init();
+  time_loop(reason, 0);
+  printf("\n   footprint:  Pre-run terminated because %s.\n", reason);
+
+  a0 = m;
+  b0 = n;
+  a1 = b1 = 0;
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (h_max[i][j] > h_min) {
+        a0 = MIN(a0, i);
+        a1 = MAX(a1, i+1);
+        b0 = MIN(b0, j);
+        b1 = MAX(b1, j+1);
+      }
+
+  /* Window on the input rasters, within the one set by energy_line(); the
+     cells left over by the coarsening belong to the last coarse row or
+     column: */
+  mc = (size_t) ceil(crop_margin / cs_all);
+  if (a0 < a1) {
+    wi1 = (a1 == m ? wi1 : MIN(wi1, wi0 + a1*rfac + mc));
+    wj1 = (b1 == n ? wj1 : MIN(wj1, wj0 + b1*rfac + mc));
+    wi0 += (a0*rfac > mc ? a0*rfac - mc : 0);
+    wj0 += (b0*rfac > mc ? b0*rfac - mc : 0);
+    wi0 -= wi0 % (size_t) grid_fac;     /* Align with the coarsened grid */
+    wj0 -= wj0 % (size_t) grid_fac;
+  }
+  else
+    printf("   footprint:  No flow in the pre-run, use the entire grid.\n");
+
+  tile_free();
+  deallocate();
+  amr_levels = levels;
+  n_sens = sens;
+  rfac = (size_t) grid_fac;
+  printf("   footprint:  Window ["ST", "ST")x["ST", "ST") of "ST"x"ST" cells"
+         " (%.1f %%).\n\n", wi0, wi1, wj0, wj1, m_all, n_all,
+         100.0 * (double) ((wi1-wi0) * (wj1-wj0))
+         / (double) (m_all * n_all));
 }
 
+/***************************/
+/*  End of footprint(...)  */
+/***************************/
+
+
 /**********************/
-/*  End of main(...)  */
+/*                    */
+/*  window_edge(...)  */
+/*                    */
 /**********************/
 
+/** Returns 1 if the flow reached a boundary of the cropped window that is
+    not a boundary of the input rasters, 0 otherwise. The S and N edges of
+    a subdomain are only tested on the outermost strips. */
+
+int window_edge(void)
+
+{
+  size_t i, j;
+  int    edge = 0;
+
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (h_max[i][j] > h_min
+          && ((i == 0 && wi0 > 0) || (i == m-1 && wi1 < m_all)
+              || (j == 0 && wj0 > 0 && mpi_rank == 0)
+              || (j == n-1 && wj1 < n_all && mpi_rank == mpi_size-1)))
+        edge = 1;
+  return (int) all_max(edge);
+}
+
+/*****************************/
+/*  End of window_edge(...)  */
+/*****************************/
+
 
 /*******************/
 /*                 */
@@ -596,16 +1284,19 @@ int main(int argc, char *argv[])
 
 /** Computes the primitive variables h, u, v from the conservative quantities
    h dA, h u dA, h v dA. Also, the speed s is computed for a non-orthogonal
-   coordinate system. */
+   coordinate system. Like the other hot kernels, it works on the cells of
+   the tile tp. */
 
-void primivar(double ***f)
+KERNEL void primivar(double ***f, struct tile *tp)
 
 {
   size_t i, j;
   double aux1, aux2;
 
-  for (i = i_min; i < i_max; i++) {
-    for (j = j_min; j < j_max; j++) {
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+      if (SKIP_CELL(i, j) || SLEEPING(i, j))
+        continue;
       aux1 = 1.0 / dA[i][j];
       aux2 = (f[i][j][0] > 0.0 ? 1.0 / MAX(f[i][j][0], h_min*dA[i][j]) : 0.0);
       h[i][j] = f[i][j][0] * aux1;
@@ -631,17 +1322,20 @@ void primivar(double ***f)
 
 /** Computes source terms in the equations for the conservative fields.
    For the erosion rate in the TJEM model, note that tau_c is scaled with
-   the flow density in read_init_file(). */
+   the flow density in read_init_file(). Sleeping cells keep their source
+   terms, which flux_sweep() does not look at; the fate of the forest is
+   followed in all cells. */
 
-double ***source_terms(void)
+KERNEL void source_terms(struct tile *tp)
 
 {
-  size_t i, j;
-  int    variant;
+  size_t i, j, c;
+  int    variant, f;
   double speed, dir_cos, dir_sin, cos_th;
   double tau_b, tau_c_loc;              /* Bed shear stress over density,
                                            local bed shear strength */
   double mu_loc, k_loc;                 /* Including forest effects */
+  struct forest_cell *fp;               /* Forested cell */
   double hs = 0.0;                      /* Snow cover depth for torque */
   double bend_mom;                      /* Bending moment on tree */
   double dp;                            /* Pressure à la Grigorian–Ostroumov */
@@ -655,8 +1349,11 @@ double ***source_terms(void)
                                            2: variable, no forest
                                            3: variable, with forest */
 
-  for (i = i_min; i < i_max; i++) {
-    for (j = j_min; j < j_max; j++) {
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+
+      if (SKIP_CELL(i, j) || SLEEPING(i, j))
+        continue;
 
       /* Local values that will come in handy: */
       speed = s[i][j];
@@ -675,18 +1372,26 @@ double ***source_terms(void)
           break;
 
         case 1 :
-          mu_loc = mu_g + 1.25 * cos_th * nD[i][j]*h[i][j];
-          k_loc = k_g + 0.5*cD*cos_th*nD[i][j]*h[i][j];
+          mu_loc = mu_g;
+          k_loc = k_g;
+          if ((f = FC_AT(i, j)) >= 0) {
+            mu_loc += 1.25 * cos_th * fc[f].nD*h[i][j];
+            k_loc += 0.5*cD*cos_th*fc[f].nD*h[i][j];
+          }
           break;
 
         case 2 :
-          mu_loc = mu[i][j];
-          k_loc = k[i][j];
+          mu_loc = MU_AT(i, j);
+          k_loc = K_AT(i, j);
           break;
 
         case 3 :
-          mu_loc = mu[i][j] + 1.25 * cos_th * nD[i][j]*h[i][j];
-          k_loc = k[i][j] + 0.5*cD*cos_th*nD[i][j]*h[i][j];
+          mu_loc = MU_AT(i, j);
+          k_loc = K_AT(i, j);
+          if ((f = FC_AT(i, j)) >= 0) {
+            mu_loc += 1.25 * cos_th * fc[f].nD*h[i][j];
+            k_loc += 0.5*cD*cos_th*fc[f].nD*h[i][j];
+          }
           break;
 
         default:                /* Cannot be reached, for compiler's sake. */
@@ -727,8 +1432,8 @@ double ***source_terms(void)
           /* grad = 0 if snow-cover strength assumed constant with depth,
              grad = 1 if vertical strength gradient is spatially constant,
              grad = 2 if vertical strength gradient is read from file. */
-          tau_c_loc = (grad < 2 ? tau_c[i][j] + mu_s0*gz[i][j]*h[i][j] \
-                                : tau_c[i][j] + mu_s[i][j]*gz[i][j]*h[i][j]);
+          tau_c_loc = TAU_C_AT(i, j)
+                      + (grad < 2 ? mu_s0 : MU_S_AT(i, j))*gz[i][j]*h[i][j];
           /* Erosion rate prop. to the excess of rheological stress over bed
              shear strength: */
           src[i][j][0] = (speed > 10.0*u_min && h[i][j] > 10.0*h_min ? \
@@ -748,37 +1453,46 @@ double ***source_terms(void)
              assume that e_b is roughly 100 times larger than typical values
              of μ·g_z·h + k·u², i.e., in the range 300–3000 m²/s². */
           if (h[i][j] > h_min && speed > 1.0)
-            src[i][j][0] = speed * dA[i][j] / tau_c[i][j] \
-                           * (mu[i][j]*gz[i][j]*h[i][j] + k[i][j]*SQ(speed));
+            src[i][j][0] = speed * dA[i][j] / TAU_C_AT(i, j) \
+                           * (MU_AT(i, j)*gz[i][j]*h[i][j]
+                              + K_AT(i, j)*SQ(speed));
           else
             src[i][j][0] = 0.0;
           break;
 
         case 4 :                        /* Grigorian–Ostroumov  (GOEM) */
-          /* Gradient of snow surface relative to terrain: */
-          dbdx = (i > 0 && i < m-1 ? 0.5 * (b[i+1][j]-b[i-1][j]) / dx[i][j] \
-                                   : (i == 0 ? (b[1][j]-b[0][j]) / dx[0][j] \
-                                             : (b[m-1][j]-b[m-2][j])/dx[m-2][j]
-                                     )
-                 );
-          dbdy = (j > 0 && j < n-1 ? 0.5 * (b[i][j+1]-b[i][j-1]) / dy[i][j] \
-                                   : (j == 0 ? (b[i][1]-b[i][0]) / dy[i][0] \
-                                             : (b[i][n-1]-b[i][n-2])/dy[i][n-2]
-                                     )
-                 );
+          /* Gradient of snow surface relative to terrain, recomputed only
+             where b or the geometry changed nearby (see mark_bed_grad()): */
+          if (bg_stale[i][j]) {
+            bgx[i][j] = bed_grad_x(b, i, j);
+            bgy[i][j] = bed_grad_y(b, i, j);
+            bg_stale[i][j] = 0;
+          }
+          dbdx = bgx[i][j];
+          dbdy = bgy[i][j];
           /* Slope angle of snow surface rel. to terrain in flow direction: */
           talpha = ((U + V*gxy)*dbdx + (V + U*gxy)*dbdy) / MAX(0.01, speed);
           calpha = 1.0 / sqrt(1.0 + SQ(talpha));
           salpha = talpha * calpha;
           /* Excess pressure dp and strength τ_c are scaled by ρ! Include
              depth-dependent bed strength as in TJEM */
-          tau_c_loc = (grad < 2 ? tau_c[i][j] + mu_s0*gz[i][j]*h[i][j] \
-                                : tau_c[i][j] + mu_s[i][j]*gz[i][j]*h[i][j]);
+          tau_c_loc = TAU_C_AT(i, j)
+                      + (grad < 2 ? mu_s0 : MU_S_AT(i, j))*gz[i][j]*h[i][j];
           dp = MAX(0.0, gz[i][j]*h[i][j]*calpha + k_erod*SQ(speed)*salpha \
-                        - tau_c[i][j]);
+                        - TAU_C_AT(i, j));
           src[i][j][0] = sigma * sqrt(dp) * dA[i][j] * calpha;
           break;
 
+        case 5 :                        /* Tabulated erosion law (IsPa) */
+          /* Depth-dependent bed strength as in TJEM; the table gives the
+             erosion rate as a function of speed, depth and bed strength: */
+          tau_c_loc = TAU_C_AT(i, j)
+                      + (grad < 2 ? mu_s0 : MU_S_AT(i, j))*gz[i][j]*h[i][j];
+          src[i][j][0] = (speed > u_min && h[i][j] > h_min ? \
+                          erod_rate(speed, h[i][j], tau_c_loc, NULL) \
+                          * dA[i][j] : 0.0);
+          break;
+
         default :                       /* To satisfy purists... */
           printf("\n   Erosion model #%d not implemented. STOP!\n\n", eromod);
           exit(29);
@@ -786,41 +1500,63 @@ double ***source_terms(void)
 
 
       /* Momentum sources (gravity and friction): */
-      if (speed > u_min) {              /* Friction opposing flow direction */
+      if (speed > u_min && fric_exact) {  /* Friction in friction_step() */
+        src[i][j][1] = gx[i][j]*h[i][j] * dA[i][j];
+        src[i][j][2] = gy[i][j]*h[i][j] * dA[i][j];
+        if (tau_b < mu_loc*gz[i][j]*h[i][j] + k_loc*SQ(speed)) {
+          src[i][j][3] = tau_b / h[i][j];   /* Capped by the TJEM */
+          src[i][j][4] = 0.0;
+        }
+        else {
+          src[i][j][3] = mu_loc*gz[i][j];
+          src[i][j][4] = k_loc;
+        }
+      }
+      else if (speed > u_min) {         /* Friction opposing flow direction */
         dir_cos = u[i][j] / speed;
         dir_sin = v[i][j] / speed;
         src[i][j][1] = (gx[i][j]*h[i][j] - dir_cos*tau_b) * dA[i][j];
         src[i][j][2] = (gy[i][j]*h[i][j] - dir_sin*tau_b) * dA[i][j];
       }
+    }
+  }
 
 
-      /* What is the fate of the forest?
-         forest=0: no forest; forest=1: braking effect, can be destroyed
-         If forest density is below residual value, do nothing. Otherwise: */
-      if ((forest == 1) && (nD[i][j] > nD_min)) {
+  /* What is the fate of the forest?
+     forest=0: no forest; forest=1: braking effect, can be destroyed
+     Only the forested cells in the rows of the tile are visited. If forest
+     density is below residual value, do nothing. Otherwise: */
+  if (forest == 1) {
+    for (i = tp->i0; i < tp->i1; i++) {
+      for (c = fc_row[i]; c < fc_row[i+1]; c++) {
+        fp = &fc[c];
+        j = fp->j;
+        if (j < tp->j0 || j >= tp->j1 || SKIP_CELL(i, j) || fp->nD <= nD_min)
+          continue;
+
         /* If no erosion, assume 1.0 m snow depth for moment calculation: */
         hs = (eromod > 0 ? b[i][j] : 1.0);
+        speed = s[i][j];
+        cos_th = SQ(cellsize) / dA[i][j];
 
         /* Check whether the forest in the cell is still intact: */
-        if (decay_const[i][j] == 0.0) {         /* No destruction yet */
+        if (fp->decay_const == 0.0) {           /* No destruction yet */
           /* Compare bending moment on average tree to its strength: */
           bend_mom = 0.25 * cD * rho * (SQ(speed) + 5.0*g*h[i][j]*cos_th)
-                     * tD[i][j] * h[i][j] * (h[i][j] + 2.0*hs);
-          if (bend_mom > MoR * tD[i][j]*tD[i][j]*tD[i][j])
+                     * fp->tD * h[i][j] * (h[i][j] + 2.0*hs);
+          if (bend_mom > MoR * fp->tD*fp->tD*fp->tD)
             /* Tree breaks or is uprooted. Estimate time for it to fall and
                lose braking effect on avalanche: */
-            decay_const[i][j] = decay_coeff / tD[i][j];
+            fp->decay_const = (real_s) (decay_coeff / fp->tD);
         }
 
         else {                                  /* Destruction ongoing */
           /* Approximate an exponential decay by first two terms: */
-          nD[i][j] *= MAX(0.0, 1.0 - decay_const[i][j]*dt);
+          fp->nD = (real_s) (fp->nD * MAX(0.0, 1.0 - fp->decay_const*dt));
         }
       }
     }
   }
-
-  return(src);
 }
 
 /******************************/
@@ -828,6 +1564,114 @@ double ***source_terms(void)
 /******************************/
 
 
+/*********************/
+/*                   */
+/*  bed_grad_x(...)  */
+/*  bed_grad_y(...)  */
+/*                   */
+/*********************/
+
+/** Gradient of a bed-depth field B (snow cover b or its derivative) along
+   the oblique cell sides, with one-sided differences at the grid edges. */
+
+double bed_grad_x(double **B, size_t i, size_t j)
+
+{
+  return (i > 0 && i < m-1 ? 0.5 * (B[i+1][j]-B[i-1][j]) / dx[i][j] \
+                           : (i == 0 ? (B[1][j]-B[0][j]) / dx[0][j] \
+                                     : (B[m-1][j]-B[m-2][j])/dx[m-2][j]
+                             )
+         );
+}
+
+double bed_grad_y(double **B, size_t i, size_t j)
+
+{
+  return (j > 0 && j < n-1 ? 0.5 * (B[i][j+1]-B[i][j-1]) / dy[i][j] \
+                           : (j == 0 ? (B[i][1]-B[i][0]) / dy[i][0] \
+                                     : (B[i][n-1]-B[i][n-2])/dy[i][n-2]
+                             )
+         );
+}
+
+/****************************/
+/*  End of bed_grad_x/y()   */
+/****************************/
+
+
+/********************/
+/*                  */
+/*  erod_rate(...)  */
+/*                  */
+/********************/
+
+/** Erosion rate over flow density (m/s) at flow speed us, flow depth hs
+   and scaled bed strength ts, by trilinear interpolation in the uniform
+   lookup grid built by read_erod_table(). Values outside the table range
+   are taken at the nearest edge. If dr is not NULL, the derivatives with
+   respect to us, hs and ts are returned in dr[0..2] (zero beyond the edges),
+   for the tangent-linear code. */
+
+double erod_rate(double us, double hs, double ts, double *dr)
+
+{
+  int    a, in[3];
+  size_t l[3], s0, s1;
+  double x[3], w[3], p, *e;
+  double c00, c01, c10, c11, c0, c1;    /* Partial interpolants */
+  double d00, d01, d10, d11;            /* Differences along tau_c */
+
+  x[0] = us;
+  x[1] = hs;
+  x[2] = ts;
+  for (a = 0; a < 3; a++) {
+    p = (x[a] - etab_x0[a]) * etab_idx[a];
+    in[a] = (p > 0.0 && p < (double) (etab_n[a]-1));
+    if (p <= 0.0) {
+      l[a] = 0;
+      w[a] = 0.0;
+    }
+    else if (p >= (double) (etab_n[a]-1)) {
+      l[a] = etab_n[a] - 2;
+      w[a] = 1.0;
+    }
+    else {
+      l[a] = MIN((size_t) p, etab_n[a]-2);
+      w[a] = p - (double) l[a];
+    }
+  }
+
+  s1 = etab_n[2];
+  s0 = etab_n[1] * s1;
+  e = etab + (l[0]*etab_n[1] + l[1])*s1 + l[2];
+  d00 = e[1] - e[0];
+  d01 = e[s1+1] - e[s1];
+  d10 = e[s0+1] - e[s0];
+  d11 = e[s0+s1+1] - e[s0+s1];
+  c00 = e[0] + w[2]*d00;
+  c01 = e[s1] + w[2]*d01;
+  c10 = e[s0] + w[2]*d10;
+  c11 = e[s0+s1] + w[2]*d11;
+  c0 = c00 + w[1]*(c01-c00);
+  c1 = c10 + w[1]*(c11-c10);
+
+  if (dr != NULL) {
+    dr[0] = (in[0] ? (c1-c0) * etab_idx[0] : 0.0);
+    dr[1] = (in[1] ? ((1.0-w[0])*(c01-c00) + w[0]*(c11-c10)) * etab_idx[1]
+                   : 0.0);
+    dr[2] = (in[2] ? ((1.0-w[0])*((1.0-w[1])*d00 + w[1]*d01)
+                      + w[0]*((1.0-w[1])*d10 + w[1]*d11)) * etab_idx[2]
+                   : 0.0);
+  }
+
+  return (c0 + w[0]*(c1-c0));
+}
+
+/***************************/
+/*  End of erod_rate(...)  */
+/***************************/
+
+
 /******************/
 /*                */
 /*  find_dt(...)  */
@@ -837,25 +1681,29 @@ double ***source_terms(void)
 /** The time step is computed on the basis of the maximum velocity of the
    forward "acoustic" wave. Note that source terms have the potential to
    "empty" a cell more quickly; the main routine checks for this and repeats
-   a time step with reduced dt if necessary. */
+   a time step with reduced dt if necessary. The outermost halo rows of a
+   subdomain have one-sided slopes and are left to their owner, and
+   sleeping cells, which stay at rest during the step, do not limit the
+   time step. The value for the tile tp is returned;
+   tile_min_dt() takes the minimum over the tiles and limits it to
+   dt_max. */
 
-double find_dt(void)
+KERNEL double find_dt(struct tile *tp)
 
 {
   size_t i, j;
-  double aux;
-
-  dt = 1000.0;
+  double aux, dt_t = 1000.0;
 
-  for (i = i_min; i < i_max; i++) {
-    for (j = j_min; j < j_max; j++) {
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+      if (SKIP_CELL(i, j) || SLEEPING(i, j) || !OWN_ROW(j))
+        continue;
       aux = MAX(sqrt(SQ(u[i][j])+SQ(v[i][j])) + sqrt(gz[i][j]*h[i][j]), u_min);
-      dt = MIN(cfl * MIN(dx[i][j], dy[i][j]) / aux,  dt);
+      dt_t = MIN(cfl * MIN(dx[i][j], dy[i][j]) / aux,  dt_t);
     }
   }
-  dt = MIN(dt, dt_max);
 
-  return(dt);
+  return(dt_t);
 }
 
 /*************************/
@@ -874,76 +1722,2769 @@ double find_dt(void)
    "active" region of the computational domain, i.e., the smallest rectangle
    outside of which the flow height or the speed are below user-specified
    thresholds. (One row of cells is added in every direction to prevent
-   spurious effects.) */
+   spurious effects.) With domain decomposition, the active region of the
+   whole window is determined and intersected with the subdomain. The
+   cells are gone through tile by tile (tile_bounds()), and the moving
+   volume and momentum of the tiles are added up by tree_sum(). */
 
 double update_boundaries(double ***f)
 
 {
-  size_t i, j;
+  size_t kt;
   int    west = (int) m, east = 0, south = (int) n, north = 0;
-  double mom = 0.0, speed, vol_min, tot_vol = 0.0;
+  double mom, sum[2];
+#ifdef USE_MPI
+  int    box[4];
+#endif
 
-  mov_vol = 0.0;
-  for (i = i_min; i < i_max; i++) {
+  run_bounds(f);
+  for (kt = 0; kt < n_tiles; kt++) {
+    west  = MIN(west,  tiles[kt].box[0]);
+    east  = MAX(east,  tiles[kt].box[1]);
+    south = MIN(south, tiles[kt].box[2]);
+    north = MAX(north, tiles[kt].box[3]);
+    tile_red[kt] = tiles[kt].mov;
+  }
+  mov_vol = tree_sum(tile_red, n_tiles);
+  for (kt = 0; kt < n_tiles; kt++)
+    tile_red[kt] = tiles[kt].mom;
+  mom = tree_sum(tile_red, n_tiles);
+
+#ifdef USE_MPI
+  if (mpi_size > 1) {                   /* Rows of the whole window, the */
+    box[0] = west;                      /* maxima as minima of negatives, */
+    box[1] = -east;                     /* north = 0: no active cell */
+    box[2] = (north > 0 ? south + (int) sub_off : INT_MAX);
+    box[3] = (north > 0 ? -north - (int) sub_off : INT_MAX);
+    MPI_Allreduce(MPI_IN_PLACE, box, 4, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    west  = box[0];
+    east  = -box[1];
+    if (box[3] < INT_MAX) {
+      gj_min = (size_t) MAX(0, box[2]);
+      gj_max = (size_t) (1 - box[3]);
+      south = MIN((int) n, box[2] - (int) sub_off);
+      north = MAX(-1, -box[3] - (int) sub_off);
+    }
+    else
+      gj_min = gj_max = 0;
+  }
+#endif
+  i_min = (size_t) MAX(0, west);
+  i_max = MIN(m, (size_t) east + 1);    /* m×n nodes, (m−1)×(n−1) cells */
+  j_min = (size_t) MAX(0, south);
+  j_max = MIN(n, (size_t) north + 1);
+  sum[0] = mov_vol;
+  sum[1] = mom;
+  all_sum(sum, 2);
+  mov_vol = sum[0];
+  mom = sum[1];
+
+  if (amr_levels == 1)                  /* With AMR, main() prints the sums */
+    printf("      V_tot = %7.0f m³  V_mov = %7.0f m³  J_tot = %6.0f t m/s\n",
+           tot_vol, mov_vol, 0.001*rho*mom);
+
+  return(mom);
+}
+
+/***********************************/
+/*  End of update_boundaries(...)  */
+/***********************************/
+
+
+/**********************/
+/*                    */
+/*  tile_bounds(...)  */
+/*                    */
+/**********************/
+
+/** The work of update_boundaries() on the cells of the tile tp: updates
+   their maximum fields and stores the edges of the moving cells, their
+   volume and the momentum in the tile. */
+
+KERNEL void tile_bounds(double ***f, struct tile *tp)
+
+{
+  size_t i, j;
+  int    west = (int) m, east = 0, south = (int) n, north = 0;
+  double mov = 0.0, mom = 0.0, speed, vol_min;
+
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+      if (SKIP_CELL(i, j) || SLEEPING(i, j))
+        continue;
+      vol_min = h_min * dA[i][j];
+      speed = s[i][j];
+
+      /* Boundaries of active domain (halo rows are left to their owner, as
+         their speed derives from one-sided metric terms) */
+      if (f[i][j][0] > vol_min && speed > u_min && OWN_ROW(j)) {
+        west  = MIN(west, ( int) i-1);
+        east  = MAX(east,  (int) i+1);
+        south = MIN(south, (int) j-1);
+        north = MAX(north, (int) j+1);
+        mov += f[i][j][0];
+      }
+
+      cell_maxima(i, j);
+      if (OWN_ROW(j))
+        mom += speed * f[i][j][0];
+    }
+  }
+  tp->box[0] = west;
+  tp->box[1] = east;
+  tp->box[2] = south;
+  tp->box[3] = north;
+  tp->mov = mov;
+  tp->mom = mom;
+}
+
+/*****************************/
+/*  End of tile_bounds(...)  */
+/*****************************/
+
+
+/**********************/
+/*                    */
+/*  cell_maxima(...)  */
+/*                    */
+/**********************/
+
+/** Updates the maximum fields of cell (i,j), which are written to file(s)
+   at the end of the run. Note u_max, v_max are components of max. speed
+   and not actual max(u) and max(v). */
+
+KERNEL void cell_maxima(size_t i, size_t j)
+
+{
+  double speed = s[i][j];
+
+  h_max[i][j] = (real_s) MAX(h_max[i][j], h[i][j]);
+  if (speed > s_max[i][j]) {
+    s_max[i][j] = (real_s) speed;
+    u_max[i][j] = (real_s) u[i][j];
+    v_max[i][j] = (real_s) v[i][j];
+    p_max[i][j] = (real_s) (0.001 * rho * SQ(speed));
+  }
+
+  if (eromod > 0)                       /* Update erodible snow depth */
+    b_min[i][j] = (real_s) MIN(b[i][j], b_min[i][j]);
+  if (dep > 0)
+    d_max[i][j] = (real_s) MAX(d[i][j], d_max[i][j]);
+}
+
+/*****************************/
+/*  End of cell_maxima(...)  */
+/*****************************/
+
+
+/***********************/
+/*                     */
+/*  mass_recount(...)  */
+/*                     */
+/***********************/
+
+/** The total volume tot_vol is updated in every time step from the
+   entrained, deposited and outflowing volumes. This function sums the
+   volume of all cells (leaves of all levels with mesh refinement) to reset
+   tot_vol to its exact value, and prints the mass balance together with
+   the round-off drift of the running total. Returns with level 0 loaded. */
+
+void mass_recount(void)
+
+{
+  size_t i, j;
+  int    l;
+  double vol = 0.0;
+
+  for (l = amr_levels-1; l >= 0; l--) {
+    amr_switch(l);
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        if (!SKIP_CELL(i, j) && OWN_ROW(j))
+          vol += f_new[i][j][0];
+  }
+  all_sum(&vol, 1);
+  printf("   mass_recount:  V_rel = %.0f  + V_ero = %.0f  - V_dep = %.0f"
+         "  - V_out = %.0f  = %.0f m³ (drift %.2e m³)\n",
+         vol_rel, vol_ero, vol_dep, vol_out, vol, tot_vol - vol);
+  tot_vol = vol;
+}
+
+/******************************/
+/*  End of mass_recount(...)  */
+/******************************/
+
+
+/********************/
+/*                  */
+/*  mpi_split(...)  */
+/*                  */
+/********************/
+
+/** Restricts the computational window of this process to its strip of
+    rows plus the halo rows; without MPI or with a single process, the
+    window is left as it is. The strips have nearly equal numbers of rows
+    and are numbered from S to N. Called after the pre-runs, which every
+    process does for the whole window. */
+
+void mpi_split(void)
+
+{
+#ifdef USE_MPI
+  size_t nw, j0, j1, l0, l1;            /**< Rows of the window, own rows */
+
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  if (mpi_size == 1)
+    return;
+  if (amr_levels > 1 || n_sens > 0 || dyn_surf) {
+    printf("   mpi_split:  Mesh refinement, sensitivities and evolving"
+           " geometry are not\n");
+    printf("               available with domain decomposition."
+           " STOP!\n\n");
+    exit(124);
+  }
+
+  read_grid_header();
+  if (wi1 == 0) {
+    wi1 = m_all;
+    wj1 = n_all;
+  }
+  nw = (wj1 - wj0) / rfac;
+  if (nw < (size_t) mpi_size * HALO_ROWS) {
+    printf("   mpi_split:  "ST" rows cannot be split into %d strips. STOP!\n\n",
+           nw, mpi_size);
+    exit(125);
+  }
+  j0 = nw * (size_t) mpi_rank / (size_t) mpi_size;
+  j1 = nw * (size_t) (mpi_rank+1) / (size_t) mpi_size;
+  l0 = (j0 > HALO_ROWS ? j0 - HALO_ROWS : 0);
+  l1 = MIN(nw, j1 + HALO_ROWS);
+  sub_off = l0;
+  sub_j0 = j0 - l0;
+  sub_j1 = j1 - l0;
+  gj_min = 0;
+  gj_max = nw;
+  if (mpi_rank < mpi_size-1)            /* The last strip keeps the rows */
+    wj1 = wj0 + l1 * rfac;              /* left over by the coarsening */
+  wj0 += l0 * rfac;
+  printf("   mpi_split:  %d strips of about "ST" rows, %d halo rows.\n\n",
+         mpi_size, nw / (size_t) mpi_size, HALO_ROWS);
+#endif
+}
+
+/***************************/
+/*  End of mpi_split(...)  */
+/***************************/
+
+
+/************************/
+/*                      */
+/*  halo_exchange(...)  */
+/*                      */
+/************************/
+
+/** Replaces the halo rows by the values of the neighbor subdomains after a
+    time step: f_new, b and d of the columns in which the flow may have
+    changed them. The N halo is exchanged first, then the S halo. If the
+    active region is far from the edge between two strips, nothing is
+    sent across it, so that idle subdomains hardly communicate. */
+
+void halo_exchange(void)
+
+{
+#ifdef USE_MPI
+  size_t i, j, l, ia, ib, nf, cnt, js, jr, edge;
+  int    dir, to, from;
+  double *rbuf;
+
+  if (mpi_size == 1)
+    return;
+  ia = (i_min > 0 ? i_min-1 : 0);       /* Fluxes reach one cell beyond */
+  ib = MIN(m, i_max+1);                 /* the active region */
+  if (ia >= ib)
+    return;
+  nf = (size_t) (3 + (eromod > 0) + (dep > 0));
+  cnt = HALO_ROWS * (ib-ia) * nf;
+  rbuf = halo_buf + HALO_ROWS * m * 5;
+
+  for (dir = 0; dir < 2; dir++) {
+    /* Own rows next to the edge towards the receiving neighbor, and halo
+       rows on the opposite side: */
+    js = (dir == 0 ? sub_j1 - HALO_ROWS : sub_j0);
+    jr = (dir == 0 ? sub_j0 - HALO_ROWS : sub_j1);
+    to = (dir == 0 ? mpi_rank + 1 : mpi_rank - 1);
+    from = (dir == 0 ? mpi_rank - 1 : mpi_rank + 1);
+    edge = sub_off + (dir == 0 ? sub_j1 : sub_j0);
+    if (to < 0 || to >= mpi_size
+        || gj_min >= edge + HALO_ROWS + 1 || gj_max + 1 + HALO_ROWS <= edge)
+      to = MPI_PROC_NULL;
+    edge = sub_off + (dir == 0 ? sub_j0 : sub_j1);
+    if (from < 0 || from >= mpi_size
+        || gj_min >= edge + HALO_ROWS + 1 || gj_max + 1 + HALO_ROWS <= edge)
+      from = MPI_PROC_NULL;
+
+    if (to != MPI_PROC_NULL)
+      for (j = js, l = 0; j < js + HALO_ROWS; j++)
+        for (i = ia; i < ib; i++) {
+          memcpy(halo_buf+l, f_new[i][j], 3*sizeof(double));
+          l += 3;
+          if (eromod > 0)
+            halo_buf[l++] = b[i][j];
+          if (dep > 0)
+            halo_buf[l++] = d[i][j];
+        }
+    MPI_Sendrecv(halo_buf, (int) cnt, MPI_DOUBLE, to, dir, rbuf, (int) cnt,
+                 MPI_DOUBLE, from, dir, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if (from != MPI_PROC_NULL)
+      for (j = jr, l = 0; j < jr + HALO_ROWS; j++)
+        for (i = ia; i < ib; i++) {
+          memcpy(f_new[i][j], rbuf+l, 3*sizeof(double));
+          l += 3;
+          if (eromod > 0)
+            b[i][j] = rbuf[l++];
+          if (dep > 0)
+            d[i][j] = rbuf[l++];
+          if (eromod == 4)
+            mark_bed_grad(i, j);
+        }
+  }
+#endif
+}
+
+/*******************************/
+/*  End of halo_exchange(...)  */
+/*******************************/
+
+
+/******************/
+/*                */
+/*  all_sum(...)  */
+/*                */
+/******************/
+
+/** Replaces the n values x[] by their sums over all subdomains. With
+   det_on, the values of all subdomains are gathered and added by
+   tree_sum() in the order of the ranks. */
+
+void all_sum(double *x, int n_x)
+
+{
+#ifdef USE_MPI
+  int    c, r;
+  double *buf, *y;
+
+  if (mpi_size > 1 && det_on) {
+    buf = (double *) malloc((size_t) (mpi_size * (n_x+1)) * sizeof(double));
+    if (buf == NULL) {
+      printf("   all_sum:  Memory allocation failed. STOP!\n\n");
+      exit(8);
+    }
+    y = buf + mpi_size*n_x;             /* Value c of every rank */
+    MPI_Allgather(x, n_x, MPI_DOUBLE, buf, n_x, MPI_DOUBLE, MPI_COMM_WORLD);
+    for (c = 0; c < n_x; c++) {
+      for (r = 0; r < mpi_size; r++)
+        y[r] = buf[r*n_x + c];
+      x[c] = tree_sum(y, (size_t) mpi_size);
+    }
+    free(buf);
+  }
+  else if (mpi_size > 1)
+    MPI_Allreduce(MPI_IN_PLACE, x, n_x, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#else
+  (void) x;
+  (void) n_x;
+#endif
+}
+
+/*************************/
+/*  End of all_sum(...)  */
+/*************************/
+
+
+/********************************/
+/*                              */
+/*  all_min(...), all_max(...)  */
+/*                              */
+/********************************/
+
+/** Minimum and maximum of x over all subdomains. */
+
+double all_min(double x)
+
+{
+#ifdef USE_MPI
+  if (mpi_size > 1)
+    MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+#endif
+  return x;
+}
+
+double all_max(double x)
+
+{
+#ifdef USE_MPI
+  if (mpi_size > 1)
+    MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+  return x;
+}
+
+/***************************************/
+/*  End of all_min(...), all_max(...)  */
+/***************************************/
+
+
+/*******************/
+/*                 */
+/*  thread_init()  */
+/*                 */
+/*******************/
+
+/** Number of threads from OMP_NUM_THREADS, and the CPUs they are pinned to
+   by OMP_PROC_BIND and OMP_PLACES. Called before any field is allocated,
+   as the threads place the rows of the fields in memory (see allocate2()).
+   On NUMA machines, the threads should be pinned, e.g. by
+   OMP_PROC_BIND=spread OMP_PLACES=cores, so that they stay on the socket
+   holding their rows. */
+
+void thread_init(void)
+
+{
+#ifdef _OPENMP
+  const char *bind[] = {"false", "true", "master", "close", "spread"};
+  int    th, c, pb, n_p, *cpu, *ids;
+
+  n_threads = omp_get_max_threads();
+  pb = (int) omp_get_proc_bind();
+  printf("   thread_init:  %d threads, OMP_PROC_BIND=%s\n", n_threads,
+         (pb >= 0 && pb <= 4 ? bind[pb] : "?"));
+  if (pb == (int) omp_proc_bind_false) {
+    if (n_threads > 1)
+      printf("   thread_init:  Threads are not pinned; on NUMA machines, set"
+             " OMP_PROC_BIND=spread\n                 and OMP_PLACES=cores.\n");
+    return;
+  }
+
+  if ((cpu = (int *) malloc((size_t) n_threads * sizeof(int))) == NULL) {
+    printf("   thread_init:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  #pragma omp parallel private(th, n_p, ids)
+  {
+    th = omp_get_thread_num();
+    cpu[th] = -1;                       /* First CPU of the thread's place */
+    if (omp_get_place_num() >= 0
+        && (n_p = omp_get_place_num_procs(omp_get_place_num())) > 0
+        && (ids = (int *) malloc((size_t) n_p * sizeof(int))) != NULL) {
+      omp_get_place_proc_ids(omp_get_place_num(), ids);
+      cpu[th] = ids[0];
+      free(ids);
+    }
+  }
+  for (th = 0; th < n_threads; th += 8) {
+    printf("   thread_init:  Threads %d-%d on CPUs", th,
+           MIN(th+8, n_threads) - 1);
+    for (c = th; c < MIN(th+8, n_threads); c++)
+      printf(" %4d", cpu[c]);
+    printf("\n");
+  }
+  free(cpu);
+#endif
+}
+
+/**************************/
+/*  End of thread_init()  */
+/**************************/
+
+
+/******************************/
+/*                            */
+/*  tile_init(), tile_free()  */
+/*                            */
+/******************************/
+
+/** Allocates the tiles for the grid of m × n cells (level 0), the queue of tile
+   indices with the deques of all phases and threads, and the locks and
+   statistics of the threads. The active region is cut into several tiles
+   only with several threads or deterministic reductions, and without mesh
+   refinement. */
+
+void tile_init(void)
+
+{
+#ifdef _OPENMP
+  int th;
+#endif
+
+  tile_on = (amr_levels == 1 && (n_threads > 1 || det_on));
+  tile_cap = ((m + tile_size-1) / tile_size) * ((n + tile_size-1) / tile_size);
+  tile_cap = MAX(tile_cap, 1);
+  n_tiles = 0;
+  tile_box[0] = 0;                      /* Forces a new plan */
+  tiles = (struct tile *) malloc(tile_cap * sizeof(struct tile));
+  tile_q = (size_t *) malloc(2 * tile_cap * sizeof(size_t));
+  tile_dq = (struct tile_deque *)
+            malloc((size_t) (TILE_PHASES * n_threads)
+                   * sizeof(struct tile_deque));
+  tile_dq0 = (struct tile_deque *)
+             malloc((size_t) (TILE_PHASES * n_threads)
+                    * sizeof(struct tile_deque));
+  tile_red = (double *) malloc(tile_cap * sizeof(double));
+  if (tiles == NULL || tile_q == NULL || tile_dq == NULL || tile_dq0 == NULL
+      || tile_red == NULL) {
+    printf("   tile_init:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+#ifdef _OPENMP
+  tile_lock = (omp_lock_t *) malloc((size_t) n_threads * sizeof(omp_lock_t));
+  tile_stat = (struct thread_stat *)
+              calloc((size_t) n_threads, sizeof(struct thread_stat));
+  if (tile_lock == NULL || tile_stat == NULL) {
+    printf("   tile_init:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  for (th = 0; th < n_threads; th++)
+    omp_init_lock(&tile_lock[th]);
+  tile_wall = 0.0;
+#endif
+}
+
+void tile_free(void)
+
+{
+#ifdef _OPENMP
+  int th;
+
+  for (th = 0; th < n_threads; th++)
+    omp_destroy_lock(&tile_lock[th]);
+  free(tile_lock);
+  free(tile_stat);
+#endif
+  free(tile_red);
+  free(tile_dq0);
+  free(tile_dq);
+  free(tile_q);
+  free(tiles);
+}
+
+/*************************************/
+/*  End of tile_init(), tile_free()  */
+/*************************************/
+
+
+/*****************/
+/*               */
+/*  tile_plan()  */
+/*               */
+/*****************/
+
+/** Cuts the active region into the tiles of the fixed grid and fills the
+   queue: phase TILE_ALL holds all tiles, phases 1–4 the tiles of colour
+   0–3 of the 2×2 pattern. Within a phase, the tiles are sorted by their
+   owner, whose deque then covers its own tiles. As every owner has rows of
+   tiles of both parities, each of them has tiles in all phases. */
+
+void tile_plan(void)
+
+{
+  size_t ti, tj, kt, q, T = tile_size;
+  int    p, th;
+  struct tile *tp;
+  struct tile_deque *dq;
+
+  tile_box[0] = m;
+  tile_box[1] = n;
+  tile_box[2] = i_min;
+  tile_box[3] = i_max;
+  tile_box[4] = j_min;
+  tile_box[5] = j_max;
+
+  n_tiles = 0;
+  if (!tile_on) {                       /* The whole active region */
+    tiles[0].i0 = i_min;
+    tiles[0].i1 = i_max;
+    tiles[0].j0 = j_min;
+    tiles[0].j1 = j_max;
+    n_tiles = 1;
+  }
+  else if (i_max > i_min && j_max > j_min)
+    for (ti = i_min / T; ti*T < i_max; ti++)
+      for (tj = j_min / T; tj*T < j_max; tj++) {
+        tp = &tiles[n_tiles++];
+        tp->i0 = MAX(ti*T, i_min);
+        tp->i1 = MIN((ti+1)*T, i_max);
+        tp->j0 = MAX(tj*T, j_min);
+        tp->j1 = MIN((tj+1)*T, j_max);
+      }
+
+  /* Count the tiles of each owner (in tail), then place them: */
+#define IN_PHASE(k)  (p == TILE_ALL \
+                      || (int) (tiles[k].i0/T % 2 * 2 + tiles[k].j0/T % 2) \
+                         == p-1)
+  for (p = 0, q = 0; p < TILE_PHASES; p++) {
+    dq = &tile_dq0[p*n_threads];
+    for (th = 0; th < n_threads; th++)
+      dq[th].tail = 0;
+    for (kt = 0; kt < n_tiles; kt++)
+      if (IN_PHASE(kt))
+        dq[TILE_OWNER(tiles[kt].i0/T)].tail++;
+    for (th = 0; th < n_threads; th++) {
+      dq[th].head = q;
+      q += dq[th].tail;
+      dq[th].tail = dq[th].head;
+    }
+    for (kt = 0; kt < n_tiles; kt++)
+      if (IN_PHASE(kt))
+        tile_q[dq[TILE_OWNER(tiles[kt].i0/T)].tail++] = kt;
+  }
+#undef IN_PHASE
+}
+
+/************************/
+/*  End of tile_plan()  */
+/************************/
+
+
+/************************************************/
+/*                                              */
+/*  tile_start(), tile_next(...), tile_done(),  */
+/*  tile_stop()                                 */
+/*                                              */
+/************************************************/
+
+/** A tiled kernel calls tile_start() before its parallel region, which
+   renews the plan if the active region has changed, refills the deques
+   and clears the results of the tiles; tile 0 starts from the volume
+   changes accumulated so far. In the parallel region, each thread takes
+   tiles of phase ph from tile_next() until it returns NULL, and calls
+   tile_done() after each. A thread first pops from the head of its own
+   deque and then steals from the tail of the others, beginning with the
+   next thread; inactive tiles are passed over. tile_stop() ends the
+   kernel. */
+
+void tile_start(void)
+
+{
+  size_t kt;
+
+  if (tile_box[0] != m || tile_box[1] != n || tile_box[2] != i_min
+      || tile_box[3] != i_max || tile_box[4] != j_min || tile_box[5] != j_max)
+    tile_plan();
+  memcpy(tile_dq, tile_dq0,
+         (size_t) (TILE_PHASES * n_threads) * sizeof(struct tile_deque));
+  for (kt = 0; kt < n_tiles; kt++) {
+    tiles[kt].neg = 0;
+    tiles[kt].dv[0] = tiles[kt].dv[1] = tiles[kt].dv[2] = 0.0;
+    tiles[kt].mov = tiles[kt].mom = 0.0;
+    tiles[kt].box[0] = (int) m;         /* No moving cell */
+    tiles[kt].box[1] = 0;
+    tiles[kt].box[2] = (int) n;
+    tiles[kt].box[3] = 0;
+  }
+  if (n_tiles > 0) {
+    tiles[0].dv[0] = dv_ero;
+    tiles[0].dv[1] = dv_dep;
+    tiles[0].dv[2] = dv_out;
+  }
+#ifdef _OPENMP
+  tile_t0 = omp_get_wtime();
+#endif
+}
+
+struct tile *tile_next(int ph)
+
+{
+  int    th = 0, c, w;
+  size_t q = (size_t) -1;
+  struct tile_deque *dq;
+
+#ifdef _OPENMP
+  th = omp_get_thread_num() % n_threads;
+#endif
+  for (c = 0; c < n_threads && q == (size_t) -1; c++) {
+    w = (th + c) % n_threads;
+    dq = &tile_dq[ph*n_threads + w];
+#ifdef _OPENMP
+    omp_set_lock(&tile_lock[w]);
+#endif
+    if (dq->head < dq->tail)
+      q = (c == 0 ? dq->head++ : --dq->tail);
+#ifdef _OPENMP
+    omp_unset_lock(&tile_lock[w]);
+#endif
+  }
+  if (q == (size_t) -1)
+    return NULL;
+
+#ifdef _OPENMP
+  tile_stat[th].tiles++;
+  if (c > 1)
+    tile_stat[th].stolen++;
+  tile_stat[th].t0 = omp_get_wtime();
+#endif
+  return &tiles[tile_q[q]];
+}
+
+void tile_done(void)
+
+{
+#ifdef _OPENMP
+  int th = omp_get_thread_num() % n_threads;
+
+  tile_stat[th].busy += omp_get_wtime() - tile_stat[th].t0;
+#endif
+}
+
+void tile_stop(void)
+
+{
+#ifdef _OPENMP
+  tile_wall += omp_get_wtime() - tile_t0;
+#endif
+}
+
+/*******************************************************************/
+/*  End of tile_start(), tile_next(...), tile_done(), tile_stop()  */
+/*******************************************************************/
+
+
+/**************************************************/
+/*                                                */
+/*  tile_failed(...), tile_sum(), tile_min_dt(),  */
+/*  tree_sum(...)                                 */
+/*                                                */
+/**************************************************/
+
+/** Results of the tiles. tile_failed(ph) tells whether flux_sweep() found a
+   negative flow height in a tile of the phases before ph; the tiles of
+   phase ph are not looked at, as they may still be running. tile_sum()
+   sets dv_ero, dv_dep and dv_out to the sums over the tiles and returns 1
+   if a tile failed. tile_min_dt() returns the smallest time step of the
+   tiles, but at most dt_max, and sets dt to it. tree_sum(x, n_x) returns
+   the sum of the values x[] of n_x tiles (or subdomains), overwriting x[]:
+   with det_on pairwise, i.e., x[r] += x[r+w] for w = 1, 2, 4, … and
+   r = 0, 2w, 4w, …, otherwise one after the other; both orders are fixed
+   by the plan. */
+
+int tile_failed(int ph)
+
+{
+  size_t q;
+
+  if (ph <= TILE_ALL+1)
+    return 0;
+  for (q = tile_dq0[(TILE_ALL+1)*n_threads].head;
+       q < tile_dq0[ph*n_threads].head; q++)
+    if (tiles[tile_q[q]].neg)
+      return 1;
+  return 0;
+}
+
+int tile_sum(void)
+
+{
+  size_t kt;
+  int    c, neg = 0;
+  double *sum[3];
+
+  if (n_tiles == 0)
+    return 0;
+  for (kt = 0; kt < n_tiles; kt++)
+    neg |= tiles[kt].neg;
+  sum[0] = &dv_ero;
+  sum[1] = &dv_dep;
+  sum[2] = &dv_out;
+  for (c = 0; c < 3; c++) {
+    for (kt = 0; kt < n_tiles; kt++)
+      tile_red[kt] = tiles[kt].dv[c];
+    *sum[c] = tree_sum(tile_red, n_tiles);
+  }
+  return neg;
+}
+
+double tile_min_dt(void)
+
+{
+  size_t kt;
+
+  dt = 1000.0;
+  for (kt = 0; kt < n_tiles; kt++)
+    dt = MIN(tiles[kt].dt, dt);
+  dt = MIN(dt, dt_max);
+
+  return(dt);
+}
+
+double tree_sum(double *x, size_t n_x)
+
+{
+  size_t r, w;
+
+  if (n_x == 0)
+    return 0.0;
+  if (!det_on)
+    for (r = 1; r < n_x; r++)
+      x[0] += x[r];
+  else
+    for (w = 1; w < n_x; w *= 2)
+      for (r = 0; r + w < n_x; r += 2*w)
+        x[r] += x[r+w];
+  return x[0];
+}
+
+/***********************************************************************/
+/*  End of tile_failed(...), tile_sum(), tile_min_dt(), tree_sum(...)  */
+/***********************************************************************/
+
+
+/*******************/
+/*                 */
+/*  tile_report()  */
+/*                 */
+/*******************/
+
+/** Prints the tiles computed and stolen by each thread, its busy time and
+   its utilisation, i.e. the busy time over the wall time spent in the
+   tiled kernels. */
+
+void tile_report(void)
+
+{
+#ifdef _OPENMP
+  int th;
+
+  if (!tile_on)
+    return;
+  printf("\n   tile_report:  %d threads, tiles of "ST" × "ST" cells, "
+         "%.3f s in the tiled kernels\n", n_threads, tile_size, tile_size,
+         tile_wall);
+  printf("      Thread      Tiles     Stolen   Busy (s)   Utilisation\n");
+  for (th = 0; th < n_threads; th++)
+    printf("      %6d %10lu %10lu %10.3f %11.1f %%\n", th,
+           (unsigned long) tile_stat[th].tiles,
+           (unsigned long) tile_stat[th].stolen, tile_stat[th].busy,
+           (tile_wall > 0.0 ? 100.0 * tile_stat[th].busy / tile_wall : 0.0));
+#endif
+}
+
+/**************************/
+/*  End of tile_report()  */
+/**************************/
+
+
+/***********************************/
+/*                                 */
+/*  sleep_cells(), sleep_report()  */
+/*                                 */
+/***********************************/
+
+/** sleep_cells() is called after start_step(), which has flagged the still
+   cells of the active region (see slp), and flags the cells whose 3×3
+   cells are all still as sleeping. The flags outside the active region
+   are left as they are, as the kernels do not look at them. The active
+   region is saved for start_step() in the next step. sleep_report()
+   prints the share of the cell updates that were skipped. */
+
+void sleep_cells(void)
+
+{
+  size_t i, j;
+  unsigned char *c, *w, *e;             /* Flags of lines i, i-1, i+1 */
+  double n_slp = 0.0, n_own = 0.0;      /* Own cells sleeping, per line */
+
+  for (i = i_min; i < i_max; i++) {
+    c = slp[i];
+    slp_line[i] = 0;
+    for (j = j_min+1; j+1 < j_max; j++)
+      if (c[j-1] & c[j] & c[j+1] & SLP_STILL) {
+        c[j] |= SLP_ROW;
+        slp_line[i] = 1;
+      }
+  }
+
+  for (i = i_min+1; i+1 < i_max; i++) {
+    if (!slp_line[i-1] || !slp_line[i] || !slp_line[i+1])
+      continue;                         /* No three still cells in a row */
+    w = slp[i-1];
+    c = slp[i];
+    e = slp[i+1];
+    for (j = j_min+1; j+1 < j_max; j++)
+      if (w[j] & c[j] & e[j] & SLP_ROW) {
+        c[j] |= SLP_SLEEP;
+        if (OWN_ROW(j))
+          n_slp += 1.0;
+      }
+  }
+
+  for (j = j_min; j < j_max; j++)
+    if (OWN_ROW(j))
+      n_own += 1.0;
+  slp_box[0] = i_min;
+  slp_box[1] = i_max;
+  slp_box[2] = j_min;
+  slp_box[3] = j_max;
+  slp_cells += n_slp;
+  slp_all += n_own * (double) (i_max - i_min);
+}
+
+void sleep_report(void)
+
+{
+  double sum[2];
+
+  if (slp == NULL)
+    return;
+  sum[0] = slp_cells;
+  sum[1] = slp_all;
+  all_sum(sum, 2);
+  printf("\n   sleep_report:  %.4g of %.4g cell updates in the active region"
+         " skipped (%.1f %%)\n", sum[0], sum[1],
+         (sum[1] > 0.0 ? 100.0 * sum[0] / sum[1] : 0.0));
+}
+
+/******************************************/
+/*  End of sleep_cells(), sleep_report()  */
+/******************************************/
+
+
+/**************************************************/
+/*                                                */
+/*  field_hash(), repro_prerun(), repro_report()  */
+/*                                                */
+/**************************************************/
+
+/** Reproducibility check (see repro_on). field_hash() returns the FNV-1a
+   hash of the bytes of the result fields h, u, v, s, d and b and of the
+   maximum fields in the own rows. repro_prerun() repeats the run on one
+   thread before the actual run, like footprint() without output, and keeps
+   the hash of its results in repro_ref. repro_report() compares it with
+   the hash of the run, taken before write_data() may set d to the deposit
+   of the maximum flow depths; the check fails if they differ in any
+   subdomain, and the run then still writes its output but exits with
+   code 120. */
+
+unsigned long long field_hash(void)
+
+{
+  const unsigned long long fnv_prime = 1099511628211ULL;
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char *p;
+  size_t i, j, c;
+  int    q, n_d = 0, n_s = 0;
+  double **fd[6];                       /* Fields of type double */
+  real_s **fs[7];                       /* Fields of type real_s */
+
+  fd[n_d++] = h;
+  fd[n_d++] = u;
+  fd[n_d++] = v;
+  fd[n_d++] = s;
+  fd[n_d++] = d;
+  fs[n_s++] = h_max;
+  fs[n_s++] = s_max;
+  fs[n_s++] = u_max;
+  fs[n_s++] = v_max;
+  fs[n_s++] = p_max;
+  if (eromod > 0) {
+    fd[n_d++] = b;
+    fs[n_s++] = b_min;
+  }
+  if (dep > 0)
+    fs[n_s++] = d_max;
+
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++) {
+      if (!OWN_ROW(j))
+        continue;
+      for (q = 0; q < n_d; q++)
+        for (c = 0, p = (const unsigned char *) &fd[q][i][j];
+             c < sizeof(double); c++)
+          hash = (hash ^ p[c]) * fnv_prime;
+      for (q = 0; q < n_s; q++)
+        for (c = 0, p = (const unsigned char *) &fs[q][i][j];
+             c < sizeof(real_s); c++)
+          hash = (hash ^ p[c]) * fnv_prime;
+    }
+  return hash;
+}
+
+void repro_prerun(void)
+
+{
+  char   reason[80];
+  int    threads = n_threads;
+
+  printf("   repro_prerun:  Pre-run on one thread for the reproducibility"
+         " check.\n\n");
+  n_threads = 1;
+  read_grid_file();
+  read_init_file();
+  tile_init();
+  if (amr_levels > 1)
+    amr_init();
+  time_loop(reason, 0);
+  repro_ref = field_hash();
+  printf("\n   repro_prerun:  Pre-run terminated because %s.\n", reason);
+  if (amr_levels > 1)
+    amr_finish();
+  tile_free();
+  deallocate();
+  n_threads = threads;
+  printf("   repro_prerun:  Hash of the result fields %016llx.\n\n",
+         repro_ref);
+}
+
+int repro_report(void)
+
+{
+  unsigned long long hash;
+  int    differ;
+
+  hash = field_hash();
+  differ = (int) all_max((double) (hash != repro_ref));
+  printf("\n   repro_report:  Hash of the result fields %016llx on %d"
+         " thread(s),\n                  %016llx on one thread: %s.\n",
+         hash, n_threads, repro_ref,
+         (differ ? "the results DIFFER" : "bitwise identical"));
+  return differ;
+}
+
+/*********************************************************/
+/*  End of field_hash(), repro_prerun(), repro_report()  */
+/*********************************************************/
+
+
+/*********************/
+/*                   */
+/*  start_step(...)  */
+/*                   */
+/*********************/
+
+/** Saves the conserved fields of the cells [i0, i1) × [j0, j1) in f_old,
+   which is needed in case the time step has to be repeated, and computes
+   the bed-normal gravity corrected for curvature effects. With sleeping
+   cells, it first compares f_new with f_old to flag the still cells, which
+   lay inside the last active region, away from its edge (see slp). */
+
+void start_step(size_t i0, size_t i1, size_t j0, size_t j1)
+
+{
+  size_t i, j;
+  int    in;                            /* Line inside the last region */
+  double U, V;                          /* Local velocity components */
+
+  for (i = i0; i < i1; i++) {
+    in = (slp != NULL && i > slp_box[0] && i+1 < slp_box[1]);
+    for (j = j0; j < j1; j++) {
+      if (SKIP_CELL(i, j)) {
+        if (slp != NULL)
+          slp[i][j] = SLP_STILL;        /* Walls never change */
+        continue;
+      }
+      if (slp != NULL)                  /* Before f_old is overwritten, */
+        slp[i][j] = (unsigned char)     /* without branches */
+                    (in & (j > slp_box[2]) & (j+1 < slp_box[3])
+                     & !(slp[i][j] & SLP_GEO)
+                     & (f_old[i][j][1] == 0.0) & (f_old[i][j][2] == 0.0)
+                     & (f_new[i][j][1] == 0.0) & (f_new[i][j][2] == 0.0)
+                     & (f_new[i][j][0] == f_old[i][j][0]));
+      memcpy(f_old[i][j], f_new[i][j], 3*sizeof(double));
+
+      if (curve == 1) {
+        /* Normal force corrected for curvature effects, with gz limited to
+           non-negative values to prevent lift-off on convex terrain.
+           Contributed by Hervé Vicari, 2023. */
+        U = u[i][j]; V = v[i][j];
+        gz[i][j] = MAX(0.0, gz0[i][j] + kxx[i][j]*U*U + kyy[i][j]*V*V
+                            + 2.0*kxy[i][j]*U*V);
+      }
+    }
+  }
+}
+
+/****************************/
+/*  End of start_step(...)  */
+/****************************/
+
+
+/************************/
+/*                      */
+/*  face_pressure(...)  */
+/*                      */
+/************************/
+
+/** Computes the earth pressure 0.25·kp·(gz_a+gz_b)·h_a·h_b times the face
+   length once for every face inside the active region, px[i][j] between
+   cells i-1 and i, py[i][j] between cells j-1 and j, so that flux_sweep()
+   only needs to look up the faces of each cell. On the outer faces of the
+   active region, the pressure of the opposite face is repeated (von Neumann
+   boundary condition), which makes the pressure gradient of the outermost
+   cells vanish. A wall mirrors the flow depth of the cell on the other side
+   of the face. A tile sets the W and S faces of its cells, and the E and N
+   faces where it borders on the edge of the active region; the repeated
+   faces are evaluated anew so that the tiles do not depend on each other. */
+
+KERNEL void face_pressure(struct tile *tp)
+
+{
+  size_t i, j;
+
+  /* Flow depth at a face, a wall mirrors its neighbor across the face: */
+#define HMIR(a, b, c, e)  (WALL(a, b) ? h[c][e] : h[a][b])
+#define PX(a, b)    (0.25 * kp * dy[a][b] * (gz[a-1][b]+gz[a][b]) \
+                     * HMIR(a-1, b, a, b)*HMIR(a, b, a-1, b))
+#define PY(a, b)    (0.25 * kp * dx[a][b] * (gz[a][b-1]+gz[a][b]) \
+                     * HMIR(a, b-1, a, b)*HMIR(a, b, a, b-1))
+
+  for (i = MAX(tp->i0, i_min+1); i < tp->i1; i++)
+    for (j = tp->j0; j < tp->j1; j++)
+      px[i][j] = PX(i, j);
+  for (j = tp->j0; j < tp->j1; j++) {
+    if (tp->i0 == i_min)
+      px[i_min][j] = (i_max > i_min+1 ? PX(i_min+1, j) : 0.0);
+    if (tp->i1 == i_max)
+      px[i_max][j] = (i_max > i_min+1 ? PX(i_max-1, j) : 0.0);
+  }
+
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = MAX(tp->j0, j_min+1); j < tp->j1; j++)
+      py[i][j] = PY(i, j);
+    if (tp->j0 == j_min)
+      py[i][j_min] = (j_max > j_min+1 ? PY(i, j_min+1) : 0.0);
+    if (tp->j1 == j_max)
+      py[i][j_max] = (j_max > j_min+1 ? PY(i, j_max-1) : 0.0);
+  }
+#undef PY
+#undef PX
+#undef HMIR
+}
+
+/*******************************/
+/*  End of face_pressure(...)  */
+/*******************************/
+
+
+/*********************/
+/*                   */
+/*  flux_sweep(...)  */
+/*                   */
+/*********************/
+
+/** Advances the conserved fields over one time step by the advective fluxes
+   to the neighbor cells, the source terms and the earth-pressure gradients.
+   The sweep stops and returns 1 as soon as a flow height becomes negative;
+   main() then restores f_new from f_old and repeats the step with a reduced
+   time step. With mesh refinement, fluxes into a cell that is not a leaf
+   are handed to the cell(s) of the neighboring level by amr_transfer().
+   Fluxes towards wall cells are reflected. The earth pressure on the cell
+   faces is computed beforehand by face_pressure(). The cells of the tile tp
+   are swept and the volume changes are added to tp->dv. Sleeping cells
+   (see slp) are passed over. */
+
+KERNEL int flux_sweep(struct tile *tp)
+
+{
+  size_t i, j, ie, je;
+  int    di, dj;
+  double aux, auy;                      /* Auxiliary quantities */
+  double dAx, dAy, dAd;                 /* Area fluxes to neighboring cells */
+  double qhx, qhy, qhd;                 /* Mass fluxes between cells */
+  double qxx, qxy, qxd, qyx, qyy, qyd;  /* Momentum fluxes to neighbor cells */
+  double pWx, pEx, pSy, pNy;            /* Earth pressure at cell boundaries */
+  double F_drive_x, F_drive_y;          /* Gravity and earth-pressure grad. */
+  double F_drive_2, F_fric_2;           /* Driving & retarding forces squared */
+  double dir_cos, dir_sin;
+
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+
+      if (SKIP_CELL(i, j) || SLEEPING(i, j))
+        continue;
+
+      /* Quantities used in all field components: */
+      di = (u[i][j] >= 0.0 ? 1 : -1);
+      dj = (v[i][j] >= 0.0 ? 1 : -1);
+      aux = fabs(u[i][j]) * dt;
+      auy = fabs(v[i][j]) * dt;
+      dAx = aux * (dy[i][j] - auy);     /* Area flowing out in x-direction */
+      dAy = auy * (dx[i][j] - aux);     /* Area flowing out in y-direction */
+      dAd = aux * auy;                  /* Outflow in diagonal direction */
+
+      /* Bed depth limits erosion, flow depth limits deposition: */
+      if (eromod > 0 && src[i][j][0] > 0.0) {       /* Erosion */
+        /* Check erosion rate limit: */
+        src[i][j][0] = MIN( src[i][j][0], b[i][j]*dA[i][j]/(rrb*dt) );
+        /* Update erosion reservoir: */
+        b[i][j] = MAX(0.0, b[i][j] - src[i][j][0]*rrb*dt/dA[i][j]);
+        /* MAX(...) used to prevent spurious −0.0 rounding errors.
+           Contributed by Hervé Vicari and Callum Tregaskis. */
+        if (OWN_ROW(j))
+          tp->dv[0] += src[i][j][0] * dt;
+        if (dyn_surf)
+          mark_dirty(i, j);
+        if (eromod == 4)
+          mark_bed_grad(i, j);
+      }
+      else if (dep > 0 && src[i][j][0] < 0) {       /* Deposition */
+        /* Check deposition rate limit: */
+        src[i][j][0] = MAX( src[i][j][0], -f_old[i][j][0]/dt );
+        /* Update deposit reservoir: */
+        d[i][j] -= src[i][j][0] * rrd * dt / dA[i][j];
+        if (OWN_ROW(j))
+          tp->dv[1] -= src[i][j][0] * dt;
+        if (dyn_surf)
+          mark_dirty(i, j);
+      }
+      else src[i][j][0] = 0.0;
+
+      /* Advective mass fluxes: */
+      qhx = h[i][j] * dAx;
+      qhy = h[i][j] * dAy;
+      qhd = h[i][j] * dAd;
+
+      /* Advective momentum fluxes: */
+      qxx = qhx * u[i][j];
+      qxy = qhy * u[i][j];
+      qxd = qhd * u[i][j];
+      qyx = qhx * v[i][j];
+      qyy = qhy * v[i][j];
+      qyd = qhd * v[i][j];
+
+      f_new[i][j][0] -= (qhx + qhy + qhd - src[i][j][0]*dt);
+      f_new[i][j][1] -= qxx + qxy + qxd;        /* Flowing out of cell (i,j) */
+      f_new[i][j][2] -= qyx + qyy + qyd;
+
+      /* Neighbor cells, can be ahead or behind (i,j) depending on di, dj: */
+      ie = (size_t) ((int)i+di);
+      je = (size_t) ((int)j+dj);
+      if ((int) i + di >= 0 && (int) i + di < (int) m) {
+        if (cmask == NULL || cmask[ie][j] & CELL_ON) {
+          f_new[ie][j][0] += qhx;
+          f_new[ie][j][1] += qxx;
+          f_new[ie][j][2] += qyx;
+        }
+        else if (cmask[ie][j] & CELL_WALL)
+          wall_reflect(i, j, di, 0, qhx, qxx, qyx);
+        else
+          amr_transfer(ie, j, di, 0, qhx, qxx, qyx);
+      }
+      else if (OWN_ROW(j))
+        tp->dv[2] += qhx;               /* Leaves the domain */
+      if ((int) j + dj >= 0 && (int) j + dj < (int) n) {
+        if (cmask == NULL || cmask[i][je] & CELL_ON) {
+          f_new[i][je][0] += qhy;
+          f_new[i][je][1] += qxy;
+          f_new[i][je][2] += qyy;
+        }
+        else if (cmask[i][je] & CELL_WALL)
+          wall_reflect(i, j, 0, dj, qhy, qxy, qyy);
+        else
+          amr_transfer(i, je, 0, dj, qhy, qxy, qyy);
+      }
+      else if (OWN_ROW(j))
+        tp->dv[2] += qhy;
+      if ((int) i + di >= 0 && (int) i + di < (int) m
+          && (int) j + dj >= 0 && (int) j + dj < (int) n) {
+        if (cmask == NULL || cmask[ie][je] & CELL_ON) {
+          f_new[ie][je][0] += qhd;
+          f_new[ie][je][1] += qxd;
+          f_new[ie][je][2] += qyd;
+        }
+        else if (cmask[ie][je] & CELL_WALL)
+          wall_reflect(i, j, di, dj, qhd, qxd, qyd);
+        else
+          amr_transfer(ie, je, di, dj, qhd, qxd, qyd);
+      }
+      else if (OWN_ROW(j))
+        tp->dv[2] += qhd;
+
+      /* Test for negative flow heights (in the halo rows, the inflow from
+         the neighbor subdomain is missing): */
+      if (f_new[i][j][0] < 0.0 && OWN_ROW(j))
+        return 1;
+
+      /* Momentum fluxes due to pressure gradients:
+         Need to distinguish between empty cells (no pressure transmission),
+         non-empty cells in movement (friction forces fully activated), and
+         non-empty cells at rest, where the static friction force may or may
+         not be fully activated. */
+
+      /* Earth pressure on the cell faces, from face_pressure(): */
+      pWx = px[i][j];
+      pEx = px[i+1][j];
+      pSy = py[i][j];
+      pNy = py[i][j+1];
+
+      /* Test whether non-empty cells at rest will start moving. */
+
+      if (s[i][j] <= u_min) {
+        /* Gravity and pressure gradient combined: */
+        F_drive_x = gx[i][j] * f_old[i][j][0] + pWx - pEx;
+        F_drive_y = gy[i][j] * f_old[i][j][0] + pSy - pNy;
+        F_drive_2 = SQ(F_drive_x) + SQ(F_drive_y)
+                    + 2.0 * G_xy[i][j] * F_drive_x * F_drive_y;
+
+        /* Is dry friction fully activated? If not, the driving and
+           resisting forces cancel and there is no need to add to f_new. */
+        F_fric_2 = SQ(MU_AT(i, j) * gz[i][j] * f_old[i][j][0]);
+        if (F_drive_2 > F_fric_2) {
+          dir_cos = F_drive_x / sqrt(F_drive_2);
+          dir_sin = F_drive_y / sqrt(F_drive_2);
+          f_new[i][j][1] += (F_drive_x - dir_cos*sqrt(F_fric_2)) * dt;
+          f_new[i][j][2] += (F_drive_y - dir_sin*sqrt(F_fric_2)) * dt;
+        }
+      }
+      else {
+        f_new[i][j][1] += (pWx - pEx + src[i][j][1]) * dt;
+        f_new[i][j][2] += (pSy - pNy + src[i][j][2]) * dt;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/****************************/
+/*  End of flux_sweep(...)  */
+/****************************/
+
+
+/************************/
+/*                      */
+/*  friction_step(...)  */
+/*                      */
+/************************/
+
+/** With the exact friction scheme, flux_sweep() moves the cells without
+   friction, and this kernel then applies the Voellmy friction to the new
+   momentum of the cells that were moving at the start of the step. The
+   speed obeys ds/dt = -(fa + fb·s²). source_terms() stored the
+   coefficients per unit mass, mu·gz (or tau_b/h where the TJEM caps the
+   stress) in src[3] and k in src[4]. As in the explicit scheme, the dry
+   friction force is that of the load h·dA at the start of the step, so
+   fa is src[3] times h·dA/V for the transported volume V, while fb = k/h
+   is taken at the new flow depth V/dA. The speed is integrated
+   exactly over dt: s(dt) = c·tan(atan(s/c) - fb·c·dt), c = sqrt(fa/fb),
+   until the cell stops. By the subtraction theorem, this needs a single
+   tangent, which is summed from its series (relative error < 1e-12) for
+   the small arguments of most cells. The momentum keeps its direction, so
+   friction can slow a cell down and stop it, but never reverse it. */
+
+KERNEL void friction_step(struct tile *tp)
+
+{
+  size_t i, j;
+  double M1, M2, V;                     /* Momentum and volume of the cell */
+  double s0, s1, fa, fb, c, x, tb;      /* Speeds, friction coefficients */
+
+  for (i = tp->i0; i < tp->i1; i++) {
+    for (j = tp->j0; j < tp->j1; j++) {
+      if (SKIP_CELL(i, j) || s[i][j] <= u_min || f_new[i][j][0] <= 0.0)
+        continue;
+      V = f_new[i][j][0];
+      M1 = f_new[i][j][1];
+      M2 = f_new[i][j][2];
+      s0 = sqrt(MAX(0.0, SQ(M1) + SQ(M2) + 2.0*G_xy[i][j]*M1*M2)) / V;
+      if (s0 <= 0.0)
+        continue;
+      fa = src[i][j][3] * h[i][j] * dA[i][j] / V;
+      fb = src[i][j][4] * dA[i][j] / V;
+      if (fb <= 0.0)                    /* Dry friction only */
+        s1 = MAX(0.0, s0 - fa*dt);
+      else if (fa <= 0.0)               /* Turbulent drag only */
+        s1 = s0 / (1.0 + fb*s0*dt);
+      else if ((x = fb * (c = sqrt(fa / fb)) * dt) >= 0.5 * PI)
+        s1 = 0.0;                       /* Stops within the step */
+      else {
+        tb = (x < 0.1 ? x * (1.0 + SQ(x) * (1.0/3.0 + SQ(x) * (2.0/15.0
+                                 + SQ(x) * (17.0/315.0 + SQ(x) * 62.0/2835.0))))
+                      : tan(x));
+        s1 = (s0 > c*tb ? (s0 - c*tb) / (1.0 + s0*tb/c) : 0.0);
+      }
+      f_new[i][j][1] = M1 * (s1 / s0);
+      f_new[i][j][2] = M2 * (s1 / s0);
+    }
+  }
+}
+
+/*******************************/
+/*  End of friction_step(...)  */
+/*******************************/
+
+
+/***********************/
+/*                     */
+/*  wall_reflect(...)  */
+/*                     */
+/***********************/
+
+/** The flux (qh, qx, qy) from cell (i,j) towards a wall cell in direction
+   (di,dj) stays in (i,j), with the momentum component normal to the wall
+   face reversed (both components for a corner). */
+
+void wall_reflect(size_t i, size_t j, int di, int dj, double qh, double qx,
+                  double qy)
+
+{
+  f_new[i][j][0] += qh;
+  f_new[i][j][1] += (di != 0 ? -qx : qx);
+  f_new[i][j][2] += (dj != 0 ? -qy : qy);
+}
+
+/******************************/
+/*  End of wall_reflect(...)  */
+/******************************/
+
+
+/***********************/
+/*                     */
+/*  restore_step(...)  */
+/*                     */
+/***********************/
+
+/** Restores the conserved fields from f_old before a time step is repeated
+   with reduced dt. */
+
+void restore_step(void)
+
+{
+  size_t i, j;
+
+  for (i = i_min; i < i_max; i++)
+    for (j = j_min; j < j_max; j++)
+      if (!SKIP_CELL(i, j))
+        memcpy(f_new[i][j], f_old[i][j], 3*sizeof(double));
+}
+
+/******************************/
+/*  End of restore_step(...)  */
+/******************************/
+
+
+/***********************/
+/*                     */
+/*  arrest_cells(...)  */
+/*                     */
+/***********************/
+
+/** If the momentum vector in a cell reverses direction, the cell is arrested
+   unless the new direction is downhill. Next to a wall, the old momentum is
+   first reflected like the flux towards the wall (see wall_reflect()), so
+   that flow bouncing off the wall is not taken for flow that has stopped
+   and turned back. The cells [i0, i1) × [j0, j1) are tested against f_old
+   from the start of their step; returns the volume deposited in the own
+   rows. */
+
+double arrest_cells(size_t i0, size_t i1, size_t j0, size_t j1)
+
+{
+  size_t i, j, ie, je;
+  double M1, M2;                        /* Old momentum, reflected at walls */
+  double dv = 0.0;                      /* Volume deposited by arrest */
+
+  for (i = i0; i < i1; i++)
+    for (j = j0; j < j1; j++) {
+      if (SKIP_CELL(i, j) || SLEEPING(i, j))
+        continue;
+      M1 = f_old[i][j][1];
+      M2 = f_old[i][j][2];
+      if (cmask != NULL) {
+        /* Neighbors the fluxes went to; indices below 0 wrap around: */
+        ie = (u[i][j] >= 0.0 ? i+1 : i-1);
+        je = (v[i][j] >= 0.0 ? j+1 : j-1);
+        if (u[i][j] != 0.0 && ie < m && WALL(ie, j))
+          M1 = -M1;
+        if (v[i][j] != 0.0 && je < n && WALL(i, je))
+          M2 = -M2;
+      }
+      if (M1*f_new[i][j][1] + M2*f_new[i][j][2] < 0.0
+          && f_new[i][j][1]*gx[i][j] + f_new[i][j][2]*gy[i][j] < 0.0) {
+        if (dep == 1) {
+          d[i][j] += f_new[i][j][0] / dA[i][j];
+          if (OWN_ROW(j))
+            dv += f_new[i][j][0];
+          f_new[i][j][0] = 0.0;
+          if (dyn_surf)
+            mark_dirty(i, j);
+        }
+        f_new[i][j][1] = 0.0;
+        f_new[i][j][2] = 0.0;
+      }
+    }
+  return dv;
+}
+
+/******************************/
+/*  End of arrest_cells(...)  */
+/******************************/
+
+
+/***************************************/
+/*                                     */
+/*  Tangent-linear sensitivity mode    */
+/*                                     */
+/***************************************/
+
+/** The functions tl_source_terms(), tl_flux(), tl_primivar() and tl_maxima()
+   propagate the derivatives of the flow fields with respect to up to
+   N_SENS_MAX scalar parameters (forward-mode differentiation of the discrete
+   scheme). They are called from main() right after their primal
+   counterparts and use the primal fields of the same time step, so that the
+   gradient is obtained in a single run at roughly (1 + 1.6·n_sens) times
+   its cost. The derivative with respect to mu (k) is that with respect to a
+   uniform additive shift of the friction coefficient, i.e., with respect to
+   mu_g (k_g) if the parameters are constant.
+
+   Non-smooth operations are differentiated along the branch taken by the
+   primal computation, i.e., the one-sided derivative is used:
+   - MIN/MAX limiters (erosion and deposition rate limits, gz >= 0, h_min in
+     the drag-height and velocity computations, the TJEM bed-stress cap)
+     pass on the derivative of the active argument;
+   - threshold tests (friction activation of cells at rest, erosion
+     thresholds in speed and depth, arrest of cells with reversed momentum,
+     the upwind direction of the fluxes) are treated as frozen switches that
+     contribute no derivative of their own;
+   - the time step, the active-domain boundaries, the terrain geometry (also
+     with evolving geometry) and the forest density are considered
+     parameter-independent. As the CFL-limited time step does depend on the
+     parameters, sensitivities require a fixed time step (dt_min = dt_max).
+   Between switching events, these are the derivatives of the discrete
+   solution. Where the flow decelerates under Coulomb friction, however, they
+   grow exponentially, and at the front they are dominated by the delay of
+   the arrival; in both cases a parameter change of less than a per mille
+   switches the branch. The derivatives are not bounded there; instead,
+   tl_event() counts the switching events of every cell (its speed passing
+   u_min, which switches static friction, an arrest, its flow depth passing
+   h_min), which are written to the _sw_map raster and summed up by
+   tl_report(). Derivatives in cells with events are one-sided and describe
+   only the branch taken. The jump in h_max where a cell is just reached or
+   not reached is not captured. */
+
+
+/*******************/
+/*                 */
+/*  tl_gz(...)     */
+/*                 */
+/*******************/
+
+/** Derivative of the curvature-corrected bed-normal gravity in main(). */
+
+double tl_gz(int p, size_t i, size_t j)
+
+{
+  double U = u[i][j], V = v[i][j];
+  double dU = tl_u[p][i][j], dV = tl_v[p][i][j];
+
+  if (curve == 0 || gz[i][j] <= 0.0)    /* No curvature or gz limited at 0 */
+    return 0.0;
+  return 2.0 * (kxx[i][j]*U*dU + kyy[i][j]*V*dV + kxy[i][j]*(U*dV + V*dU));
+}
+
+
+/*********************/
+/*                   */
+/*  tl_press(...)    */
+/*                   */
+/*********************/
+
+/** Earth-pressure force P across the face between cells a and b (b being
+   the eastern or northern cell, len the oblique face length taken from b)
+   as in the flux loop of main(), and its derivative, which is returned. */
+
+double tl_press(int p, size_t ia, size_t ja, size_t ib, size_t jb,
+                double len, double *P)
+
+{
+  double gsum, hprod, dP;
+
+  gsum  = gz[ia][ja] + gz[ib][jb];
+  hprod = h[ia][ja] * h[ib][jb];
+  *P = 0.25 * kp * len * gsum * hprod;
+  dP = 0.25 * kp * len * ((tl_gz(p, ia, ja) + tl_gz(p, ib, jb)) * hprod
+                          + gsum * (tl_h[p][ia][ja]*h[ib][jb]
+                                    + h[ia][ja]*tl_h[p][ib][jb]));
+  if (sens_par[p] == SENS_KP)
+    dP += 0.25 * len * gsum * hprod;
+  return dP;
+}
+
+
+/**************************/
+/*                        */
+/*  tl_source_terms(...)  */
+/*                        */
+/**************************/
+
+/** Derivatives of the source terms computed by source_terms(), before the
+   erosion and deposition rates are limited in main(). The unlimited mass
+   source is saved in src_raw so that tl_flux() can tell which limit was
+   active. */
+
+void tl_source_terms(void)
+
+{
+  size_t i, j;
+  int    p, f;
+  double speed, U, V, gxy, hh, gzz, cos_th;
+  double dspeed, dU, dV, dhh, dgzz;
+  double mu_loc, k_loc, dmu_loc, dk_loc, dmu0, dk0, dke;
+  double E, F, dF;                      /* Drag-height correction factor */
+  double tau_b, dtau_b, tau_c_loc, dtau_c_loc, mus, aux, daux;
+  double dbdx, dbdy, ddbdx, ddbdy, S, dS;
+  double talpha, dtalpha, calpha, dcalpha, salpha, dsalpha, dp, ddp;
+  double dir_cos, dir_sin, ddir_cos, ddir_sin;
+  double dr[3];                         /* Derivatives of the IsPa rate */
+
+  for (i = i_min; i < i_max; i++) {
     for (j = j_min; j < j_max; j++) {
-      vol_min = h_min * dA[i][j];
+
+      src_raw[i][j] = src[i][j][0];
       speed = s[i][j];
+      U = u[i][j];
+      V = v[i][j];
+      gxy = G_xy[i][j];
+      hh = h[i][j];
+      gzz = gz[i][j];
+      cos_th = SQ(cellsize) / dA[i][j];
+
+      for (p = 0; p < n_sens; p++) {
+        dspeed = tl_s[p][i][j];
+        dU = tl_u[p][i][j];
+        dV = tl_v[p][i][j];
+        dhh = tl_h[p][i][j];
+        dgzz = tl_gz(p, i, j);
+        dmu0 = (sens_par[p] == SENS_MU   ? 1.0 : 0.0);
+        dk0  = (sens_par[p] == SENS_K    ? 1.0 : 0.0);
+        dke  = (sens_par[p] == SENS_KERO ? 1.0 : 0.0);
+
+        /* Friction parameters incl. forest, cf. 'variant' in source_terms().
+           With constant parameters, mu and k hold mu_g and k_g. */
+        mu_loc = MU_AT(i, j);
+        k_loc  = K_AT(i, j);
+        dmu_loc = dmu0;
+        dk_loc  = dk0;
+        if (forest == 1 && (f = FC_AT(i, j)) >= 0) {
+          mu_loc  += 1.25 * cos_th * fc[f].nD*hh;
+          dmu_loc += 1.25 * cos_th * fc[f].nD*dhh;
+          k_loc   += 0.5*cD*cos_th*fc[f].nD*hh;
+          dk_loc  += 0.5*cD*cos_th*fc[f].nD*dhh;
+        }
+        if (h_drag > 0.0) {
+          E = exp(-h_drag / MAX(hh, h_min));
+          F = 1.0 - E;
+          dF = (hh > h_min ? -E * h_drag / SQ(hh) * dhh : 0.0);
+          k_loc /= F;
+          dk_loc = (dk_loc - k_loc*dF) / F;
+        }
+        tau_b  = mu_loc*gzz*hh + k_loc*SQ(speed);
+        dtau_b = dmu_loc*gzz*hh + mu_loc*(dgzz*hh + gzz*dhh)
+                 + dk_loc*SQ(speed) + 2.0*k_loc*speed*dspeed;
+
+        /* Erosion term: */
+        switch(eromod) {
+
+          case 1 :                      /* RAMMS */
+            tl_src[p][i][j][0] = (hh > h_min && speed > 1.0 ?
+                                  (dke*speed + k_erod*dspeed) * dA[i][j] :
+                                  0.0);
+            break;
+
+          case 2 :                      /* TJEM */
+            mus = (grad < 2 ? mu_s0 : MU_S_AT(i, j));
+            tau_c_loc = TAU_C_AT(i, j) + mus*gzz*hh;
+            dtau_c_loc = mus * (dgzz*hh + gzz*dhh);
+            if (speed > 10.0*u_min && hh > 10.0*h_min && tau_b > tau_c_loc) {
+              tl_src[p][i][j][0] = ((dtau_b - dtau_c_loc) / speed
+                                    - (tau_b - tau_c_loc) * dspeed/SQ(speed))
+                                   * dA[i][j];
+              if (b[i][j] > 0.0) {      /* Bed shear stress capped at τ_c */
+                tau_b = tau_c_loc;
+                dtau_b = dtau_c_loc;
+              }
+            }
+            else
+              tl_src[p][i][j][0] = 0.0;
+            break;
+
+          case 3 :                      /* com1DFA (AvaFrame) */
+            if (hh > h_min && speed > 1.0) {
+              aux  = MU_AT(i, j)*gzz*hh + K_AT(i, j)*SQ(speed);
+              daux = dmu0*gzz*hh + MU_AT(i, j)*(dgzz*hh + gzz*dhh)
+                     + dk0*SQ(speed) + 2.0*K_AT(i, j)*speed*dspeed;
+              tl_src[p][i][j][0] = (dspeed*aux + speed*daux)
+                                   * dA[i][j] / TAU_C_AT(i, j);
+            }
+            else
+              tl_src[p][i][j][0] = 0.0;
+            break;
+
+          case 4 :                      /* GOEM */
+            dbdx = bed_grad_x(b, i, j);
+            dbdy = bed_grad_y(b, i, j);
+            ddbdx = bed_grad_x(tl_b[p], i, j);
+            ddbdy = bed_grad_y(tl_b[p], i, j);
+            S  = MAX(0.01, speed);
+            dS = (speed > 0.01 ? dspeed : 0.0);
+            talpha = ((U + V*gxy)*dbdx + (V + U*gxy)*dbdy) / S;
+            dtalpha = ((dU + dV*gxy)*dbdx + (dV + dU*gxy)*dbdy
+                       + (U + V*gxy)*ddbdx + (V + U*gxy)*ddbdy - talpha*dS) / S;
+            calpha = 1.0 / sqrt(1.0 + SQ(talpha));
+            dcalpha = -talpha * calpha*calpha*calpha * dtalpha;
+            salpha = talpha * calpha;
+            dsalpha = dtalpha*calpha + talpha*dcalpha;
+            dp = gzz*hh*calpha + k_erod*SQ(speed)*salpha - TAU_C_AT(i, j);
+            if (dp > 0.0) {
+              ddp = (dgzz*hh + gzz*dhh)*calpha + gzz*hh*dcalpha
+                    + (dke*SQ(speed) + 2.0*k_erod*speed*dspeed)*salpha
+                    + k_erod*SQ(speed)*dsalpha;
+              tl_src[p][i][j][0] = sigma * dA[i][j]
+                                   * (0.5*ddp/sqrt(MAX(dp, TL_DP_MIN))*calpha
+                                      + sqrt(dp)*dcalpha);
+            }
+            else
+              tl_src[p][i][j][0] = 0.0;
+            break;
+
+          case 5 :                      /* Tabulated (IsPa) */
+            mus = (grad < 2 ? mu_s0 : MU_S_AT(i, j));
+            tau_c_loc = TAU_C_AT(i, j) + mus*gzz*hh;
+            dtau_c_loc = mus * (dgzz*hh + gzz*dhh);
+            if (speed > u_min && hh > h_min) {
+              erod_rate(speed, hh, tau_c_loc, dr);
+              tl_src[p][i][j][0] = (dr[0]*dspeed + dr[1]*dhh
+                                    + dr[2]*dtau_c_loc) * dA[i][j];
+            }
+            else
+              tl_src[p][i][j][0] = 0.0;
+            break;
+
+          default :                     /* No erosion */
+            tl_src[p][i][j][0] = 0.0;
+        }
+
+        /* Momentum sources (gravity and friction): */
+        if (speed > u_min) {
+          dir_cos = U / speed;
+          dir_sin = V / speed;
+          ddir_cos = (dU - dir_cos*dspeed) / speed;
+          ddir_sin = (dV - dir_sin*dspeed) / speed;
+          tl_src[p][i][j][1] = (gx[i][j]*dhh - ddir_cos*tau_b
+                                - dir_cos*dtau_b) * dA[i][j];
+          tl_src[p][i][j][2] = (gy[i][j]*dhh - ddir_sin*tau_b
+                                - dir_sin*dtau_b) * dA[i][j];
+        }
+      }
+    }
+  }
+}
+
+/*********************************/
+/*  End of tl_source_terms(...)  */
+/*********************************/
+
+
+/******************/
+/*                */
+/*  tl_flux(...)  */
+/*                */
+/******************/
+
+/** Derivative of the flux update in main() for the accepted time step,
+   followed by the derivative of the arrest of cells whose momentum has
+   reversed. Must be called before the primal arrest loop and before
+   primivar(), i.e., while f_new is not yet arrested and h, u, v, s still
+   hold the values from the beginning of the time step. */
+
+void tl_flux(void)
+
+{
+  size_t i, j, ie, jn;
+  int    di, dj, p, c;
+  double aux, auy, dAx, dAy, dAd, qhx, qhy, qhd, U, V, hh, f0;
+  double daux, dauy, ddAx, ddAy, ddAd, dqhx, dqhy, dqhd;
+  double dqxx, dqxy, dqxd, dqyx, dqyy, dqyd, dsrc0;
+  double pWx, pEx, pSy, pNy, dpWx, dpEx, dpSy, dpNy;
+  double Fx, Fy, F2, R, dFx, dFy, dD, dR, D;
+
+  for (p = 0; p < n_sens; p++)
+    for (i = i_min; i < i_max; i++)
+      for (j = j_min; j < j_max; j++)
+        memcpy(tl_f_old[p][i][j], tl_f_new[p][i][j], 3*sizeof(double));
+
+  for (i = i_min; i < i_max; i++) {
+    for (j = j_min; j < j_max; j++) {
+
+      /* Primal quantities as in main(): */
+      U = u[i][j];
+      V = v[i][j];
+      hh = h[i][j];
+      f0 = f_old[i][j][0];
+      di = (U >= 0.0 ? 1 : -1);
+      dj = (V >= 0.0 ? 1 : -1);
+      aux = fabs(U) * dt;
+      auy = fabs(V) * dt;
+      dAx = aux * (dy[i][j] - auy);
+      dAy = auy * (dx[i][j] - aux);
+      dAd = aux * auy;
+      qhx = hh * dAx;
+      qhy = hh * dAy;
+      qhd = hh * dAd;
+
+      for (p = 0; p < n_sens; p++) {
+        daux = (double) di * tl_u[p][i][j] * dt;
+        dauy = (double) dj * tl_v[p][i][j] * dt;
+        ddAx = daux*(dy[i][j] - auy) - aux*dauy;
+        ddAy = dauy*(dx[i][j] - aux) - auy*daux;
+        ddAd = daux*auy + aux*dauy;
+
+        /* Mass source with the rate limit that was active in main(): */
+        if (eromod > 0 && src_raw[i][j] > 0.0) {          /* Erosion */
+          dsrc0 = (src[i][j][0] < src_raw[i][j] ?
+                   tl_b[p][i][j] * dA[i][j] / (rrb*dt) : tl_src[p][i][j][0]);
+          tl_b[p][i][j] = (b[i][j] > 0.0 ?
+                           tl_b[p][i][j] - dsrc0*rrb*dt/dA[i][j] : 0.0);
+        }
+        else if (dep > 0 && src_raw[i][j] < 0.0) {        /* Deposition */
+          dsrc0 = (src[i][j][0] > src_raw[i][j] ?
+                   -tl_f_old[p][i][j][0] / dt : tl_src[p][i][j][0]);
+          tl_d[p][i][j] -= dsrc0 * rrd * dt / dA[i][j];
+        }
+        else
+          dsrc0 = 0.0;
+
+        /* Advective fluxes: */
+        dqhx = tl_h[p][i][j]*dAx + hh*ddAx;
+        dqhy = tl_h[p][i][j]*dAy + hh*ddAy;
+        dqhd = tl_h[p][i][j]*dAd + hh*ddAd;
+        dqxx = dqhx*U + qhx*tl_u[p][i][j];
+        dqxy = dqhy*U + qhy*tl_u[p][i][j];
+        dqxd = dqhd*U + qhd*tl_u[p][i][j];
+        dqyx = dqhx*V + qhx*tl_v[p][i][j];
+        dqyy = dqhy*V + qhy*tl_v[p][i][j];
+        dqyd = dqhd*V + qhd*tl_v[p][i][j];
+
+        tl_f_new[p][i][j][0] -= (dqhx + dqhy + dqhd - dsrc0*dt);
+        tl_f_new[p][i][j][1] -= dqxx + dqxy + dqxd;
+        tl_f_new[p][i][j][2] -= dqyx + dqyy + dqyd;
+
+        if ((int) i + di >= 0 && (int) i + di < (int) m) {
+          ie = (size_t) ((int)i+di);
+          tl_f_new[p][ie][j][0] += dqhx;
+          tl_f_new[p][ie][j][1] += dqxx;
+          tl_f_new[p][ie][j][2] += dqyx;
+        }
+        if ((int) j + dj >= 0 && (int) j + dj < (int) n) {
+          jn = (size_t) ((int)j+dj);
+          tl_f_new[p][i][jn][0] += dqhy;
+          tl_f_new[p][i][jn][1] += dqxy;
+          tl_f_new[p][i][jn][2] += dqyy;
+        }
+        if ((int) i + di >= 0 && (int) i + di < (int) m
+            && (int) j + dj >= 0 && (int) j + dj < (int) n) {
+          ie = (size_t) ((int)i+di);
+          jn = (size_t) ((int)j+dj);
+          tl_f_new[p][ie][jn][0] += dqhd;
+          tl_f_new[p][ie][jn][1] += dqxd;
+          tl_f_new[p][ie][jn][2] += dqyd;
+        }
+
+        /* Pressure forces with the same boundary treatment as in main(): */
+        if (i > i_min && i < i_max-1) {
+          dpEx = tl_press(p, i, j, i+1, j, dy[i+1][j], &pEx);
+          dpWx = tl_press(p, i-1, j, i, j, dy[i][j], &pWx);
+        }
+        else if (i == i_min) {
+          dpWx = dpEx = tl_press(p, i, j, i+1, j, dy[i+1][j], &pEx);
+          pWx = pEx;
+        }
+        else {
+          dpEx = dpWx = tl_press(p, i-1, j, i, j, dy[i][j], &pWx);
+          pEx = pWx;
+        }
+        if (j > j_min && j < j_max-1) {
+          dpNy = tl_press(p, i, j, i, j+1, dx[i][j+1], &pNy);
+          dpSy = tl_press(p, i, j-1, i, j, dx[i][j], &pSy);
+        }
+        else if (j == j_min) {
+          dpSy = dpNy = tl_press(p, i, j, i, j+1, dx[i][j+1], &pNy);
+          pSy = pNy;
+        }
+        else {
+          dpNy = dpSy = tl_press(p, i, j-1, i, j, dx[i][j], &pSy);
+          pNy = pSy;
+        }
+
+        if (s[i][j] <= u_min) {         /* Cell at rest: static friction */
+          Fx = gx[i][j] * f0 + pWx - pEx;
+          Fy = gy[i][j] * f0 + pSy - pNy;
+          F2 = SQ(Fx) + SQ(Fy) + 2.0 * G_xy[i][j] * Fx * Fy;
+          R = fabs(MU_AT(i, j) * gz[i][j] * f0);
+          if (F2 > SQ(R)) {             /* Same switch as in main() */
+            D = sqrt(F2);
+            dFx = gx[i][j]*tl_f_old[p][i][j][0] + dpWx - dpEx;
+            dFy = gy[i][j]*tl_f_old[p][i][j][0] + dpSy - dpNy;
+            dD = (Fx*dFx + Fy*dFy + G_xy[i][j]*(dFx*Fy + Fx*dFy)) / D;
+            dR = ((sens_par[p] == SENS_MU ? 1.0 : 0.0) * gz[i][j] * f0
+                  + MU_AT(i, j) * tl_gz(p, i, j) * f0
+                  + MU_AT(i, j) * gz[i][j] * tl_f_old[p][i][j][0]);
+            tl_f_new[p][i][j][1] += (dFx*(1.0 - R/D)
+                                     - Fx*(dR - R*dD/D)/D) * dt;
+            tl_f_new[p][i][j][2] += (dFy*(1.0 - R/D)
+                                     - Fy*(dR - R*dD/D)/D) * dt;
+          }
+        }
+        else {
+          tl_f_new[p][i][j][1] += (dpWx - dpEx + tl_src[p][i][j][1]) * dt;
+          tl_f_new[p][i][j][2] += (dpSy - dpNy + tl_src[p][i][j][2]) * dt;
+        }
+      }
+    }
+  }
+
+  /* Arrest of cells whose momentum has reversed (same test as in main()): */
+  for (i = i_min; i < i_max; i++)
+    for (j = j_min; j < j_max; j++)
+      if (f_old[i][j][1]*f_new[i][j][1] + f_old[i][j][2]*f_new[i][j][2] < 0.0
+          && f_new[i][j][1]*gx[i][j] + f_new[i][j][2]*gy[i][j] < 0.0) {
+        tl_event(TL_SW_STOP, i, j);
+        for (p = 0; p < n_sens; p++) {
+          if (dep == 1) {
+            tl_d[p][i][j] += tl_f_new[p][i][j][0] / dA[i][j];
+            tl_f_new[p][i][j][0] = 0.0;
+          }
+          for (c = 1; c < 3; c++)
+            tl_f_new[p][i][j][c] = 0.0;
+        }
+      }
+}
+
+/*************************/
+/*  End of tl_flux(...)  */
+/*************************/
+
+
+/**********************/
+/*                    */
+/*  tl_primivar(...)  */
+/*                    */
+/**********************/
+
+/** Derivatives of the primitive variables computed by primivar(), which
+   must have been called before. Like primivar(), the velocity is divided by
+   the mass, but by h_min dA below h_min, where the derivative of the mass
+   therefore no longer enters. A cell whose flow depth passes h_min or whose
+   speed passes u_min in the step, compared with the speed primivar()
+   obtained from f_old, is a switching event. */
+
+void tl_primivar(void)
+
+{
+  size_t i, j;
+  int    p;
+  double aux, aux1, aux2, daux2, f0, U, V, dU, dV, U0, V0, s0;
+
+  for (i = i_min; i < i_max; i++) {
+    for (j = j_min; j < j_max; j++) {
+      aux1 = 1.0 / dA[i][j];
+      f0 = f_new[i][j][0];
+      aux2 = (f0 > 0.0 ? 1.0 / MAX(f0, h_min*dA[i][j]) : 0.0);
+      U = u[i][j];
+      V = v[i][j];
+      aux = (f_old[i][j][0] > 0.0 ?
+             1.0 / MAX(f_old[i][j][0], h_min*dA[i][j]) : 0.0);
+      U0 = f_old[i][j][1] * aux;
+      V0 = f_old[i][j][2] * aux;
+      s0 = SQ(U0) + SQ(V0) + 2.0*G_xy[i][j]*U0*V0;
+      if ((f0 > h_min*dA[i][j]) != (f_old[i][j][0] > h_min*dA[i][j]))
+        tl_event(TL_SW_HMIN, i, j);
+      if ((s[i][j] > u_min) != (s0 > SQ(u_min)))
+        tl_event(TL_SW_UMIN, i, j);
+      for (p = 0; p < n_sens; p++) {
+        daux2 = (f0 > h_min*dA[i][j] ?
+                 -tl_f_new[p][i][j][0] * SQ(aux2) : 0.0);
+        tl_h[p][i][j] = tl_f_new[p][i][j][0] * aux1;
+        tl_u[p][i][j] = dU = tl_f_new[p][i][j][1]*aux2 + f_new[i][j][1]*daux2;
+        tl_v[p][i][j] = dV = tl_f_new[p][i][j][2]*aux2 + f_new[i][j][2]*daux2;
+        tl_s[p][i][j] = (s[i][j] > 0.0 ?
+                         (U*dU + V*dV + G_xy[i][j]*(U*dV + V*dU)) / s[i][j] :
+                         0.0);
+      }
+    }
+  }
+}
+
+/*****************************/
+/*  End of tl_primivar(...)  */
+/*****************************/
+
+
+/********************/
+/*                  */
+/*  tl_maxima(...)  */
+/*                  */
+/********************/
+
+/** Derivatives of h_max and s_max, to be called after tl_primivar() and
+   before update_boundaries() updates the maximum fields themselves. */
+
+void tl_maxima(void)
+
+{
+  size_t i, j;
+  int    p;
+
+  for (i = i_min; i < i_max; i++) {
+    for (j = j_min; j < j_max; j++) {
+      for (p = 0; p < n_sens; p++) {
+        if (h[i][j] > h_max[i][j])
+          tl_h_max[p][i][j] = tl_h[p][i][j];
+        if (s[i][j] > s_max[i][j])
+          tl_s_max[p][i][j] = tl_s[p][i][j];
+      }
+    }
+  }
+}
+
+/***************************/
+/*  End of tl_maxima(...)  */
+/***************************/
+
+
+/*****************************/
+/*                           */
+/*  tl_event(), tl_report()  */
+/*                           */
+/*****************************/
+
+/** tl_event(kind, i, j) counts a switching event of the given kind in cell
+   (i,j), whose derivatives are one-sided from then on. tl_report() prints
+   the events of the run; the events of each cell are written to the
+   _sw_map raster by write_data(). */
+
+void tl_event(int kind, size_t i, size_t j)
+
+{
+  tl_sw[i][j] += 1.0;
+  tl_n_sw[kind] += 1.0;
+}
+
+void tl_report(void)
+
+{
+  size_t i, j, cells = 0;
+
+  if (n_sens == 0)
+    return;
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (tl_sw[i][j] > 0.0)
+        cells++;
+  printf("\n   tl_report:  %.0f switching events in %lu cells (speed passing"
+         " u_min %.0f,\n               arrest %.0f, depth passing h_min %.0f"
+         " times), whose\n               derivatives are one-sided.\n",
+         tl_n_sw[TL_SW_UMIN] + tl_n_sw[TL_SW_STOP] + tl_n_sw[TL_SW_HMIN],
+         (unsigned long) cells, tl_n_sw[TL_SW_UMIN], tl_n_sw[TL_SW_STOP],
+         tl_n_sw[TL_SW_HMIN]);
+}
+
+/************************************/
+/*  End of tl_event(), tl_report()  */
+/************************************/
+
+
+/***************************************/
+/*                                     */
+/*  Adaptive mesh refinement (AMR)     */
+/*                                     */
+/***************************************/
+
+/** With amr_levels > 1, the domain is covered by the leaves of a quadtree
+   whose levels are the input grid (level 0) and grids coarsened by factors
+   2, 4, 8 (levels 1, 2, 3). The DEM and the friction parameters of a coarse
+   cell are the averages over its children, so each level has its own slope
+   and curvature fields computed by update_surface(). Leaves of neighboring
+   cells differ by at most one level (2:1 balance).
+
+   All kernels work on one level at a time and skip the cells that are not
+   leaves. Mass and momentum fluxes into a non-leaf cell are passed to the
+   coarser leaf containing it or split equally among the finer leaves that
+   adjoin the face or corner through which they enter, so that the scheme
+   remains conservative. For the earth-pressure terms, the flow depth and gz
+   of such neighbors are taken from the other level (amr_ghosts()). The time
+   step is the smallest one over all levels.
+
+   Every amr_interval steps, the tree is adapted: cells where the flow depth
+   jumps across h_min (the front and lateral margins of the moving flow) or
+   by more than the fraction amr_tol of the larger value are flagged on the
+   input grid, the flags are widened by amr_interval+2 cells, so that the
+   front cannot leave the fine region before the next regridding, and these
+   cells are put on level 0. Everything else is made as coarse as the 2:1
+   balance permits. Mass and momentum are transferred conservatively: a
+   coarse cell receives the sum of its children, children receive shares of
+   the parent proportional to their areas. Only a neighborhood of the active
+   region is regridded; farther away, the tree remains as it is. */
+
+
+/*********************/
+/*                   */
+/*  amr_switch(...)  */
+/*                   */
+/*********************/
+
+/** Stores the grid description and field pointers of the current level in
+   amr[lev] and loads those of level l into the global variables. Calling it
+   with l = lev just updates amr[lev]. */
+
+void amr_switch(int l)
+
+{
+  struct amr_level *A = &amr[lev], *B = &amr[l];
+
+  if (amr_levels == 1)
+    return;
+
+#define AMR_SWAP(X)     A->X = X; X = B->X
+  AMR_SWAP(m);      AMR_SWAP(n);      AMR_SWAP(cellsize);
+  AMR_SWAP(i_min);  AMR_SWAP(i_max);  AMR_SWAP(j_min);  AMR_SWAP(j_max);
+  AMR_SWAP(dx);     AMR_SWAP(dy);     AMR_SWAP(dA);
+  AMR_SWAP(gx);     AMR_SWAP(gy);     AMR_SWAP(gz0);    AMR_SWAP(gz);
+  AMR_SWAP(kxx);    AMR_SWAP(kxy);    AMR_SWAP(kyy);    AMR_SWAP(G_xy);
+  AMR_SWAP(px);     AMR_SWAP(py);
+  AMR_SWAP(h);      AMR_SWAP(u);      AMR_SWAP(v);      AMR_SWAP(s);
+  AMR_SWAP(p_imp);  AMR_SWAP(d);      AMR_SWAP(z0);
+  AMR_SWAP(mu);     AMR_SWAP(k);
+  AMR_SWAP(h_max);  AMR_SWAP(s_max);  AMR_SWAP(p_max);
+  AMR_SWAP(u_max);  AMR_SWAP(v_max);
+  AMR_SWAP(f_old);  AMR_SWAP(f_new);  AMR_SWAP(src);
+  AMR_SWAP(data);   AMR_SWAP(cmask);
+#undef AMR_SWAP
+
+  lev = l;
+}
+
+/****************************/
+/*  End of amr_switch(...)  */
+/****************************/
+
+
+/*******************/
+/*                 */
+/*  amr_init(...)  */
+/*                 */
+/*******************/
+
+/** Creates the coarse levels from the input grid after read_init_file()
+   and builds the initial quadtree around the margins of the release area.
+   Returns with level 0 loaded. */
+
+void amr_init(void)
+
+{
+  size_t i, j, a, e, na, nl;
+  int    l, c;
+  struct amr_level *F;                  /* Next finer level */
+
+  if (cmask != NULL) {
+    printf("   amr_init:  Mesh refinement is not available with NODATA");
+    printf(" or obstacle cells. STOP!\n\n");
+    exit(122);
+  }
+
+  /* Level 0 is the input grid, at first all cells are leaves: */
+  cmask = allocate2c(m, n);
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++) {
+      cmask[i][j] = CELL_ON;
+      h_max[i][j] = s_max[i][j] = u_max[i][j] = v_max[i][j] = 0.0;
+      p_max[i][j] = 0.0;
+    }
+  amr_want = allocate2c(m, n);
+  amr_lam  = allocate2c(m, n);
+  amr_switch(0);
+
+  for (l = 1; l < amr_levels; l++) {
+    F = &amr[l-1];
+    m = (F->m + 1) / 2;
+    n = (F->n + 1) / 2;
+    cellsize = 2.0 * F->cellsize;
+    allocate();
+    cmask = allocate2c(m, n);
+    amr_minw[l] = allocate2c(m, n);
+
+    /* Average the DEM and the friction parameters over the children, sum
+       the conserved quantities: */
+    for (i = 0; i < m; i++) {
+      for (j = 0; j < n; j++) {
+        z0[i][j] = mu[i][j] = k[i][j] = 0.0;
+        for (c = 0; c < 3; c++)
+          f_new[i][j][c] = src[i][j][c] = 0.0;
+        for (a = 2*i, na = 0; a < 2*i+2 && a < F->m; a++)
+          for (e = 2*j; e < 2*j+2 && e < F->n; e++, na++) {
+            z0[i][j] += F->z0[a][e];
+            mu[i][j] += F->mu[a][e];
+            k[i][j]  += F->k[a][e];
+            for (c = 0; c < 3; c++)
+              f_new[i][j][c] += F->f_new[a][e][c];
+          }
+        z0[i][j] /= (double) na;
+        mu[i][j] = (real_s) (mu[i][j] / (double) na);
+        k[i][j]  = (real_s) (k[i][j] / (double) na);
+        h_max[i][j] = s_max[i][j] = u_max[i][j] = v_max[i][j] = 0.0;
+        d[i][j] = p_max[i][j] = 0.0;
+        cmask[i][j] = AMR_REFINED;
+      }
+    }
+    update_surface(z0);
+    i_min = j_min = 0;
+    i_max = m;
+    j_max = n;
+    lev = l;
+    amr_switch(l);                      /* Store the new level */
+  }
+
+  amr_regrid(1);
+
+  for (l = 0; l < amr_levels; l++) {
+    for (i = 0, nl = 0; i < amr[l].m; i++)
+      for (j = 0; j < amr[l].n; j++)
+        nl += (amr[l].cmask[i][j] & CELL_ON);
+    printf("   amr_init:  Level %d (%6.2f m cells):  "ST" leaves\n",
+           l, amr[l].cellsize, nl);
+  }
+}
+
+/**************************/
+/*  End of amr_init(...)  */
+/**************************/
+
+
+/*********************/
+/*                   */
+/*  amr_regrid(...)  */
+/*                   */
+/*********************/
+
+/** Adapts the quadtree to the current flow, either in a neighborhood of
+   the active region or, if init = 1, on the whole domain (where all cells
+   containing flow are then regarded as moving). Returns with level 0
+   loaded. */
+
+void amr_regrid(int init)
+
+{
+  struct amr_level *A, *P;
+  size_t I0, I1, J0, J1;                /* Region R on the input grid */
+  size_t i0, i1, j0, j1;                /* Region R on level l */
+  size_t i, j, a, e, ia, ja, last = 0, bs, mg;
+  size_t rb;                            /* Width of the refined buffer */
+  int    na, nb, l, L = amr_levels, c, iter, changed, have, ln;
+  unsigned char st, lw;
+  double sA, ha, hb;
+  bool   fa, fb, ma, mb;
+
+  amr_switch(lev);                      /* Store the current level */
+  A = &amr[0];
+
+  /* The front advances less than cfl cells per step: */
+  rb = MIN(250, (size_t) ceil(cfl * (double) amr_interval) + 2);
+  bs = (size_t) 1 << (L-1);             /* Size of a coarsest cell */
+  if (init) {
+    I0 = J0 = 0;
+    I1 = A->m;
+    J1 = A->n;
+  }
+  else {
+    if (A->i_min >= A->i_max || A->j_min >= A->j_max)
+      return;
+    mg = rb + 2*bs;                     /* Room for the transition zone */
+    I0 = (A->i_min > mg ? A->i_min - mg : 0) / bs * bs;
+    J0 = (A->j_min > mg ? A->j_min - mg : 0) / bs * bs;
+    I1 = MIN(A->m, (A->i_max + mg + bs - 1) / bs * bs);
+    J1 = MIN(A->n, (A->j_max + mg + bs - 1) / bs * bs);
+  }
+
+#define AMR_REGION(l)   i0 = I0 >> (l); j0 = J0 >> (l); \
+  i1 = MIN(amr[l].m, (I1 + ((size_t) 1 << (l)) - 1) >> (l)); \
+  j1 = MIN(amr[l].n, (J1 + ((size_t) 1 << (l)) - 1) >> (l))
+
+  /* Complete the conserved fields on all levels in R: refined cells get
+     the sum over their children, covered cells an area-weighted share of
+     their parent. */
+  for (l = 1; l < L; l++) {
+    A = &amr[l];
+    P = &amr[l-1];
+    AMR_REGION(l);
+    for (i = i0; i < i1; i++)
+      for (j = j0; j < j1; j++)
+        if (A->cmask[i][j] & AMR_REFINED)
+          for (c = 0; c < 3; c++) {
+            A->f_new[i][j][c] = 0.0;
+            for (a = 2*i; a < 2*i+2 && a < P->m; a++)
+              for (e = 2*j; e < 2*j+2 && e < P->n; e++)
+                A->f_new[i][j][c] += P->f_new[a][e][c];
+          }
+  }
+  for (l = L-2; l >= 0; l--) {
+    A = &amr[l];
+    P = &amr[l+1];
+    AMR_REGION(l);
+    for (i = i0; i < i1; i++)
+      for (j = j0; j < j1; j++)
+        if (A->cmask[i][j] & AMR_COVERED) {
+          ia = i / 2;
+          ja = j / 2;
+          for (a = 2*ia, sA = 0.0; a < 2*ia+2 && a < A->m; a++)
+            for (e = 2*ja; e < 2*ja+2 && e < A->n; e++)
+              sA += A->dA[a][e];
+          for (c = 0; c < 3; c++)
+            A->f_new[i][j][c] = P->f_new[ia][ja][c] * A->dA[i][j] / sA;
+        }
+  }
+
+  /* Flag the cell pairs on the input grid that straddle the flow margin or
+     a large depth jump, if at least one of the two cells is moving: */
+  A = &amr[0];
+  for (i = I0; i < I1; i++)
+    for (j = J0; j < J1; j++)
+      amr_want[i][j] = 0;
+  for (i = I0; i < I1; i++) {
+    for (j = J0; j < J1; j++) {
+      ha = A->f_new[i][j][0] / A->dA[i][j];
+      fa = (ha > h_min);
+      ma = init || fabs(A->f_new[i][j][1]) + fabs(A->f_new[i][j][2])
+                   > u_min * A->f_new[i][j][0];
+      for (c = 0; c < 2; c++) {
+        a = i + (c == 0);
+        e = j + (c == 1);
+        if (a >= I1 || e >= J1)
+          continue;
+        hb = A->f_new[a][e][0] / A->dA[a][e];
+        fb = (hb > h_min);
+        mb = init || fabs(A->f_new[a][e][1]) + fabs(A->f_new[a][e][2])
+                     > u_min * A->f_new[a][e][0];
+        if ((fa || fb) && (ma || mb)
+            && (fa != fb || fabs(ha - hb) > amr_tol * MAX(ha, hb)))
+          amr_want[i][j] = amr_want[a][e] = 1;
+      }
+    }
+  }
+
+  /* Widen the flagged zone by rb cells, first in x-, then in y-direction.
+     Flagged cells go to level 0, all others to the coarsest level. */
+  for (i = I0; i < I1; i++)             /* Distance in x from a flag, */
+    for (j = J0; j < J1; j++)           /* saturating at 255 */
+      amr_lam[i][j] = (unsigned char) (amr_want[i][j] ? 0
+                         : (i > I0 && amr_lam[i-1][j] < 255
+                            ? amr_lam[i-1][j] + 1 : 255));
+  for (i = I1-1; i-- > I0; )
+    for (j = J0; j < J1; j++)
+      if (amr_lam[i+1][j] + 1 < amr_lam[i][j])
+        amr_lam[i][j] = (unsigned char) (amr_lam[i+1][j] + 1);
+  for (i = I0; i < I1; i++) {
+    for (j = J0; j < J1; j++)
+      amr_lam[i][j] = (amr_lam[i][j] <= rb);
+    for (j = J0, have = 0; j < J1; j++) {
+      if (amr_lam[i][j]) {
+        have = 1;
+        last = j;
+      }
+      amr_want[i][j] = (have && j - last <= rb);
+    }
+    for (j = J1, have = 0; j-- > J0; ) {
+      if (amr_lam[i][j]) {
+        have = 1;
+        last = j;
+      }
+      if (have && last - j <= rb)
+        amr_want[i][j] = 1;
+    }
+    for (j = J0; j < J1; j++)
+      amr_want[i][j] = (amr_want[i][j] ? 0 : (unsigned char) (L-1));
+  }
+
+  /* Leaf levels: a block of level l can be a leaf only if all its cells
+     want level l or coarser. Then enforce the 2:1 balance, also against the
+     unchanged tree outside R, by refining the coarser side. */
+  for (iter = 0; iter < 100; iter++) {
+    for (l = 1; l < L; l++) {
+      AMR_REGION(l);
+      for (i = i0; i < i1; i++)
+        for (j = j0; j < j1; j++) {
+          lw = (unsigned char) (L-1);
+          for (a = 2*i; a < 2*i+2 && a < amr[l-1].m; a++)
+            for (e = 2*j; e < 2*j+2 && e < amr[l-1].n; e++)
+              lw = (unsigned char) MIN(lw, (l == 1 ? amr_want[a][e]
+                                                 : amr_minw[l-1][a][e]));
+          amr_minw[l][i][j] = lw;
+        }
+    }
+    for (i = I0; i < I1; i++)
+      for (j = J0; j < J1; j++) {
+        for (l = L-1; l > 0 && amr_minw[l][i>>l][j>>l] < l; l--)
+          ;
+        amr_lam[i][j] = (unsigned char) l;
+      }
 
-      /* Boundaries of active domain */
-      if (f[i][j][0] > vol_min && speed > u_min) {
-        west  = MIN(west, ( int) i-1);
-        east  = MAX(east,  (int) i+1);
-        south = MIN(south, (int) j-1);
-        north = MAX(north, (int) j+1);
-        mov_vol += f[i][j][0];
+    changed = 0;
+    for (i = I0; i < I1; i++)
+      for (j = J0; j < J1; j++)
+        for (na = (int) i - 1; na <= (int) i + 1 && amr_lam[i][j] > 1; na++)
+          for (nb = (int) j - 1; nb <= (int) j + 1; nb++) {
+            if (na < 0 || na >= (int) amr[0].m
+                || nb < 0 || nb >= (int) amr[0].n)
+              continue;
+            a = (size_t) na;
+            e = (size_t) nb;
+            if (a >= I0 && a < I1 && e >= J0 && e < J1)
+              ln = amr_lam[a][e];
+            else                        /* Leaf level of the old tree */
+              for (ln = 0; !(amr[ln].cmask[a>>ln][e>>ln] & CELL_ON); ln++)
+                ;
+            if (amr_lam[i][j] > ln + 1) {
+              amr_want[i][j] = (unsigned char) (ln + 1);
+              changed = 1;
+            }
+          }
+    if (!changed)
+      break;
+  }
+
+  /* Install the new tree; only leaves keep their conserved quantities: */
+  for (l = 0; l < L; l++) {
+    A = &amr[l];
+    AMR_REGION(l);
+    for (i = i0; i < i1; i++)
+      for (j = j0; j < j1; j++) {
+        lw = amr_lam[i<<l][j<<l];
+        if (l > 0 && amr_minw[l][i][j] < l)
+          st = AMR_REFINED;
+        else
+          st = (lw == l ? CELL_ON : AMR_COVERED);
+        A->cmask[i][j] = st;
+        if (st != CELL_ON)
+          for (c = 0; c < 3; c++)
+            A->f_new[i][j][c] = 0.0;
       }
+  }
 
-      /* Maximum fields, written to file(s) at end of run. Note u_max, v_max
-         are components of max. speed and not actual max(u) and max(v). */
-      h_max[i][j] = MAX(h_max[i][j], h[i][j]);
-      if (speed > s_max[i][j]) {
-        s_max[i][j] = speed;
-        u_max[i][j] = u[i][j];
-        v_max[i][j] = v[i][j];
-        p_max[i][j] = 0.001 * rho * SQ(speed);
+  /* Mark the leaves next to another level for amr_ghosts(): */
+  for (l = 0; l < L; l++) {
+    A = &amr[l];
+    AMR_REGION(l);
+    for (i = (i0 > 0 ? i0 - 1 : 0); i < i1 + 1 && i < A->m; i++)
+      for (j = (j0 > 0 ? j0 - 1 : 0); j < j1 + 1 && j < A->n; j++) {
+        A->cmask[i][j] &= (unsigned char) ~AMR_EDGE;
+        if ((A->cmask[i][j] & CELL_ON)
+            && ((i > 0      && !(A->cmask[i-1][j] & CELL_ON))
+                || (i < A->m-1 && !(A->cmask[i+1][j] & CELL_ON))
+                || (j > 0      && !(A->cmask[i][j-1] & CELL_ON))
+                || (j < A->n-1 && !(A->cmask[i][j+1] & CELL_ON))))
+          A->cmask[i][j] |= AMR_EDGE;
       }
-      mom += speed * f[i][j][0];
+  }
 
-      if (eromod > 0)                   /* Update erodible snow depth */
-        b_min[i][j] = MIN(b[i][j], b_min[i][j]);
-      if (dep > 0)
-        d_max[i][j] = MAX(d[i][j], d_max[i][j]);
+  /* Primitive variables of the new leaves: */
+  for (l = L-1; l >= 0; l--) {
+    amr_switch(l);
+    AMR_REGION(l);
+    i_min = i0;
+    i_max = i1;
+    j_min = j0;
+    j_max = j1;
+    run_primivar(f_new);
+    i_min = amr[l].i_min;               /* Restore active region */
+    i_max = amr[l].i_max;
+    j_min = amr[l].j_min;
+    j_max = amr[l].j_max;
+  }
+#undef AMR_REGION
+}
+
+/****************************/
+/*  End of amr_regrid(...)  */
+/****************************/
+
+
+/***********************/
+/*                     */
+/*  amr_transfer(...)  */
+/*                     */
+/***********************/
+
+/** Adds the fluxes qh, qx, qy leaving a cell of the current level in the
+   direction (di, dj) to the leaves covering the non-leaf target (ti, tj):
+   the containing leaf one level up or the one or two leaves one level down
+   that adjoin the entry face or corner. */
+
+void amr_transfer(size_t ti, size_t tj, int di, int dj,
+                  double qh, double qx, double qy)
+
+{
+  struct amr_level *A;
+  size_t ci[2], cj[2], a, e;
+  size_t nci = 0, ncj = 0, p, q;
+  double w;
+
+  if (cmask[ti][tj] & AMR_COVERED) {    /* Coarser leaf */
+    A = &amr[lev+1];
+    A->f_new[ti/2][tj/2][0] += qh;
+    A->f_new[ti/2][tj/2][1] += qx;
+    A->f_new[ti/2][tj/2][2] += qy;
+    return;
+  }
+
+  A = &amr[lev-1];                      /* Finer leaves */
+  for (a = 2*ti; a < 2*ti+2 && a < A->m; a++)
+    if (di == 0 || a == 2*ti + (di > 0 ? 0 : 1))
+      ci[nci++] = a;
+  for (e = 2*tj; e < 2*tj+2 && e < A->n; e++)
+    if (dj == 0 || e == 2*tj + (dj > 0 ? 0 : 1))
+      cj[ncj++] = e;
+  if (nci == 0)                         /* Only at an odd grid edge */
+    ci[nci++] = 2*ti;
+  if (ncj == 0)
+    cj[ncj++] = 2*tj;
+
+  w = 1.0 / (double) (nci * ncj);
+  for (p = 0; p < nci; p++)
+    for (q = 0; q < ncj; q++) {
+      A->f_new[ci[p]][cj[q]][0] += w * qh;
+      A->f_new[ci[p]][cj[q]][1] += w * qx;
+      A->f_new[ci[p]][cj[q]][2] += w * qy;
+    }
+}
+
+/******************************/
+/*  End of amr_transfer(...)  */
+/******************************/
+
+
+/*********************/
+/*                   */
+/*  amr_ghosts(...)  */
+/*                   */
+/*********************/
+
+/** Sets h and gz of the non-leaf W, E, S and N neighbors of leaves to the
+   values of the coarser leaf containing them or to the average over their
+   children, for use in the earth-pressure terms. */
+
+void amr_ghosts(void)
+
+{
+  struct amr_level *A, *P;
+  size_t i, j, ni, nj, a, e;
+  int    l, q, na;
+  int    off[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+  amr_switch(lev);                      /* Store the current level */
+
+  for (l = 0; l < amr_levels; l++) {
+    A = &amr[l];
+    for (i = A->i_min; i < A->i_max; i++) {
+      for (j = A->j_min; j < A->j_max; j++) {
+        if (!(A->cmask[i][j] & AMR_EDGE))
+          continue;
+        for (q = 0; q < 4; q++) {
+          if ((int) i + off[q][0] < 0 || (int) i + off[q][0] >= (int) A->m
+              || (int) j + off[q][1] < 0 || (int) j + off[q][1] >= (int) A->n)
+            continue;
+          ni = (size_t) ((int) i + off[q][0]);
+          nj = (size_t) ((int) j + off[q][1]);
+          if (A->cmask[ni][nj] & CELL_ON)
+            continue;
+          if (A->cmask[ni][nj] & AMR_COVERED) {
+            P = &amr[l+1];
+            A->h[ni][nj]  = P->h[ni/2][nj/2];
+            A->gz[ni][nj] = P->gz[ni/2][nj/2];
+          }
+          else {
+            P = &amr[l-1];
+            A->h[ni][nj] = A->gz[ni][nj] = 0.0;
+            for (a = 2*ni, na = 0; a < 2*ni+2 && a < P->m; a++)
+              for (e = 2*nj; e < 2*nj+2 && e < P->n; e++, na++) {
+                A->h[ni][nj]  += P->h[a][e];
+                A->gz[ni][nj] += P->gz[a][e];
+              }
+            A->h[ni][nj]  /= (double) na;
+            A->gz[ni][nj] /= (double) na;
+          }
+        }
+      }
     }
   }
+}
 
-  i_min = (size_t) MAX(0, west);
-  i_max = MIN(m, (size_t) east + 1);    /* m×n nodes, (m−1)×(n−1) cells */
-  j_min = (size_t) MAX(0, south);
-  j_max = MIN(n, (size_t) north + 1);
+/****************************/
+/*  End of amr_ghosts(...)  */
+/****************************/
 
-  for (i = 0; i < m; i++)
-    for (j = 0; j < n; j++)
-      tot_vol += f[i][j][0];
-  printf("      V_tot = %7.0f m³  V_mov = %7.0f m³  J_tot = %6.0f t m/s\n",
-         tot_vol, mov_vol, 0.001*rho*mom);
 
-  return(mom);
+/********************/
+/*                  */
+/*  amr_boxes(...)  */
+/*                  */
+/********************/
+
+/** Replaces the active regions found by update_boundaries() on each level
+   by their union, expressed on each level with a margin of one cell, so
+   that fluxes between levels always reach an active cell. */
+
+void amr_boxes(void)
+
+{
+  struct amr_level *A;
+  size_t I0, I1, J0, J1, sc;
+  int    l;
+
+  amr_switch(lev);                      /* Store the current level */
+
+  I0 = amr[0].m;
+  J0 = amr[0].n;
+  I1 = J1 = 0;
+  for (l = 0; l < amr_levels; l++) {
+    A = &amr[l];
+    if (A->i_min < A->i_max && A->j_min < A->j_max) {
+      I0 = MIN(I0, A->i_min << l);
+      J0 = MIN(J0, A->j_min << l);
+      I1 = MAX(I1, A->i_max << l);
+      J1 = MAX(J1, A->j_max << l);
+    }
+  }
+
+  for (l = 0; l < amr_levels; l++) {
+    A = &amr[l];
+    sc = (size_t) 1 << l;
+    if (I0 >= I1 || J0 >= J1)           /* Nothing moves any more */
+      A->i_min = A->i_max = A->j_min = A->j_max = 0;
+    else {
+      A->i_min = ((I0 >> l) > 0 ? (I0 >> l) - 1 : 0);
+      A->j_min = ((J0 >> l) > 0 ? (J0 >> l) - 1 : 0);
+      A->i_max = MIN(A->m, (I1 + sc - 1) / sc + 1);
+      A->j_max = MIN(A->n, (J1 + sc - 1) / sc + 1);
+    }
+  }
+
+  i_min = amr[lev].i_min;
+  i_max = amr[lev].i_max;
+  j_min = amr[lev].j_min;
+  j_max = amr[lev].j_max;
 }
 
-/***********************************/
-/*  End of update_boundaries(...)  */
-/***********************************/
+/***************************/
+/*  End of amr_boxes(...)  */
+/***************************/
 
 
-/*************************/
-/*                       */
-/*  read_grid_file(...)  */
-/*                       */
-/*************************/
+/************************/
+/*                      */
+/*  amr_composite(...)  */
+/*                      */
+/************************/
 
-/** Reads the grid file and computes the needed geometrical information. */
+/** Copies the primitive variables of the leaves to the covered cells of the
+   input grid for output, in the active region or, if final = 1, on the
+   whole grid. In the latter case, the maximum fields of the coarse levels
+   are merged into those of the input grid as well. */
 
-void read_grid_file(void)
+void amr_composite(int final)
+
+{
+  struct amr_level *A = &amr[0], *P;
+  size_t i, j, ia, ja, imin, imax, jmin, jmax;
+  int    l;
+
+  amr_switch(lev);                      /* Store the current level */
+
+  imin = (final ? 0 : A->i_min);
+  imax = (final ? A->m : A->i_max);
+  jmin = (final ? 0 : A->j_min);
+  jmax = (final ? A->n : A->j_max);
+
+  for (i = imin; i < imax; i++) {
+    for (j = jmin; j < jmax; j++) {
+      if (A->cmask[i][j] & AMR_COVERED) {
+        for (l = 1; !(amr[l].cmask[i>>l][j>>l] & CELL_ON); l++)
+          ;
+        P = &amr[l];
+        ia = i >> l;
+        ja = j >> l;
+        A->h[i][j] = P->h[ia][ja];
+        A->s[i][j] = P->s[ia][ja];
+        A->u[i][j] = P->u[ia][ja];
+        A->v[i][j] = P->v[ia][ja];
+        A->p_imp[i][j] = P->p_imp[ia][ja];
+      }
+
+      if (final) {
+        for (l = 1; l < amr_levels; l++) {
+          P = &amr[l];
+          ia = i >> l;
+          ja = j >> l;
+          A->h_max[i][j] = MAX(A->h_max[i][j], P->h_max[ia][ja]);
+          if (P->s_max[ia][ja] > A->s_max[i][j]) {
+            A->s_max[i][j] = P->s_max[ia][ja];
+            A->u_max[i][j] = P->u_max[ia][ja];
+            A->v_max[i][j] = P->v_max[ia][ja];
+            A->p_max[i][j] = P->p_max[ia][ja];
+          }
+        }
+      }
+    }
+  }
+}
+
+/*******************************/
+/*  End of amr_composite(...)  */
+/*******************************/
+
+
+/*********************/
+/*                   */
+/*  amr_finish(...)  */
+/*                   */
+/*********************/
+
+/** Reports the final number of leaves per level and frees the coarse levels
+   and the quadtree. Returns with level 0 loaded, which is freed by
+   deallocate(). */
+
+void amr_finish(void)
+
+{
+  size_t i, j, nl;
+  int    l;
+
+  for (l = amr_levels-1; l >= 0; l--) {
+    amr_switch(l);
+    for (i = 0, nl = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        nl += (cmask[i][j] & CELL_ON);
+    printf("   amr_finish:  Level %d:  "ST" leaves at the end\n", l, nl);
+    if (l > 0) {
+      deallocate2c(amr_minw[l], m);
+      deallocate();                     /* Also frees cmask */
+    }
+  }
+
+  deallocate2c(amr_lam, m);
+  deallocate2c(amr_want, m);
+}
+
+/****************************/
+/*  End of amr_finish(...)  */
+/****************************/
+
+
+/***************************/
+/*                         */
+/*  read_grid_header(...)  */
+/*                         */
+/***************************/
+
+/** Reads the header of the grid file, which defines the raster geometry
+    and is used in the output files. */
+
+void read_grid_header(void)
 
 {
   char   nodeline[256], xll[10], yll[10];
@@ -971,6 +4512,16 @@ void read_grid_file(void)
   if (!strcmp(yll, "yllcenter"))            /* coordinates */
     yllcorner -= (0.5*cellsize);
 
+  /* Output rasters of the entire domain are coarsened like the grid: */
+  m_all = m;
+  n_all = n;
+  xll_all = xllcorner;
+  yll_all = yllcorner;
+  cs_all = cellsize;
+  m /= rfac;
+  n /= rfac;
+  cellsize *= (double) rfac;
+
   if (!strncmp(fmt, "wb", 2)) {         /* BinaryTerrain */
     strncpy(header, "binterr1.3", 11);
     memcpy(header+10, &m, 4);               /* bth.xdim */
@@ -1008,105 +4559,397 @@ void read_grid_file(void)
     strcat(header, nodeline);
 
     if (forest > 0)                     /* Forest needs special handling */
-      strcat(header_nD, header);        /* on output */
+      strcpy(header_nD, header);        /* on output */
   }
 
   fclose(gfp);
+}
+
+/*****************************/
+/* End of read_grid_header() */
+/*****************************/
+
+
+/*************************/
+/*                       */
+/*  read_grid_file(...)  */
+/*                       */
+/*************************/
+
+/** Reads the grid file and computes the needed geometrical information. */
+
+void read_grid_file(void)
+
+{
+  read_grid_header();
+
+  /* The computational grid is the window of the rasters set by energy_line()
+     and footprint() or the entire rasters, possibly coarsened by rfac in the
+     pre-run: */
+  if (wi1 == 0) {
+    wi1 = m_all;
+    wj1 = n_all;
+  }
+  m = (wi1 - wi0) / rfac;
+  n = (wj1 - wj0) / rfac;
+  if (m < 2 || n < 2) {
+    printf("\n   read_grid_file:  Grid too small for coarsening. STOP!\n\n");
+    exit(32);
+  }
+  xllcorner = xll_all + (double) wi0 * cs_all;
+  yllcorner = yll_all + (double) wj0 * cs_all;
+  cellsize = (double) rfac * cs_all;
+
+  /* Allocate all dynamic arrays and read the z-coordinates: */
+  allocate();
+
+  read_raster(grid_fn, z0, xll_all, yll_all, cs_all, -9998.9, 0);
+  fill_nodata();
+
+  update_surface(z0);
+
+  printf("   read_grid_file:     Completed.\n");
+
+}
+
+/***************************/
+/* End of read_grid_file() */
+/***************************/
+
+
+/*******************/
+/*                 */
+/*  set_wall(...)  */
+/*                 */
+/*******************/
+
+/** Marks cell (i,j) as a wall, which is skipped by all kernels and reflects
+    the flow. The cell mask is created on first use. */
+
+void set_wall(size_t i, size_t j)
+
+{
+  size_t a, e;
+
+  if (cmask == NULL) {
+    if (n_sens > 0) {
+      printf("   set_wall:  Sensitivities are not available with NODATA");
+      printf(" or obstacle cells. STOP!\n\n");
+      exit(123);
+    }
+    cmask = allocate2c(m, n);
+    for (a = 0; a < m; a++)
+      for (e = 0; e < n; e++)
+        cmask[a][e] = CELL_ON;
+  }
+  cmask[i][j] = CELL_WALL;
+}
+
+/**************************/
+/*  End of set_wall(...)  */
+/**************************/
+
+
+/**********************/
+/*                    */
+/*  fill_nodata(...)  */
+/*                    */
+/**********************/
+
+/** Turns the cells without data in the DEM (marked −∞ by read_raster())
+    into walls. Their elevation is filled with the mean of their already
+    filled neighbors, in order of distance from the valid cells, so that
+    slopes and curvatures next to the walls remain finite. */
+
+void fill_nodata(void)
+
+{
+  size_t i, j, a, e, nq = 0, q, n_wall = 0;
+  size_t *queue;
+  int    c, na;
+  double sum;
+
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (z0[i][j] == -HUGE_VAL) {
+        set_wall(i, j);
+        n_wall++;
+      }
+  if (n_wall == 0)
+    return;
+  if (n_wall == m*n) {
+    printf("   fill_nodata:  The DEM contains no data. STOP!\n\n");
+    exit(33);
+  }
+  if ((queue = (size_t*) malloc(n_wall * sizeof(size_t))) == NULL) {
+    printf("   fill_nodata:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+
+  /* Breadth-first sweep from the valid cells; queued cells are set to +∞,
+     indices below 0 wrap around and are caught by the tests a < m, e < n: */
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      if (z0[i][j] == -HUGE_VAL)
+        for (c = 0; c < 4; c++) {
+          a = i + (c == 0) - (c == 1);
+          e = j + (c == 2) - (c == 3);
+          if (a < m && e < n && fabs(z0[a][e]) < HUGE_VAL) {
+            z0[i][j] = HUGE_VAL;
+            queue[nq++] = i*n + j;
+            break;
+          }
+        }
+  for (q = 0; q < nq; q++) {
+    i = queue[q] / n;
+    j = queue[q] % n;
+    for (c = 0, na = 0, sum = 0.0; c < 4; c++) {
+      a = i + (c == 0) - (c == 1);
+      e = j + (c == 2) - (c == 3);
+      if (a >= m || e >= n)
+        continue;
+      if (fabs(z0[a][e]) < HUGE_VAL) {
+        sum += z0[a][e];
+        na++;
+      }
+      else if (z0[a][e] == -HUGE_VAL) {
+        z0[a][e] = HUGE_VAL;
+        queue[nq++] = a*n + e;
+      }
+    }
+    z0[i][j] = sum / (double) na;
+  }
+  free(queue);
+  printf("   fill_nodata:  "ST" cells without data are walls.\n", n_wall);
+}
+
+/*****************************/
+/*  End of fill_nodata(...)  */
+/*****************************/
+
+
+/*************************/
+/*                       */
+/*  update_surface(...)  */
+/*                       */
+/*************************/
+
+/** Compute slope and curvature components for given surface. */
+
+void update_surface(double **Z)
+
+{
+  size_t i, j;
+  double gsq;							/* For testing */
+
+  /* Calculate the quantities that are used in the simulation: */
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++) {
+      surface_cell(Z, i, j);
+
+      /* Test whether this gives back the correct magnitude of g: */
+      if (fabs((gsq = SQ(gz[i][j]) + SQ(gx[i][j]) + SQ(gy[i][j])
+                      + 2.0*G_xy[i][j]*gx[i][j]*gy[i][j]) - SQ(g)) > 0.0001)
+        printf("   "ST3", "ST3":  |g| = %5.3f m/s²\n", i, j, sqrt(gsq));
+    }
+}
+
+/***************************/
+/* End of update_surface() */
+/***************************/
+
+
+/***********************/
+/*                     */
+/*  surface_cell(...)  */
+/*                     */
+/***********************/
+
+/** Slope angles, metric, gravity components and curvature tensor of cell
+    (i,j) of surface Z, from centered differences over its 3×3 stencil. */
+
+void surface_cell(double **Z, size_t i, size_t j)
+
+{
+  double aux, auy, auz, auzsq, dZdX, dZdY;
+  double d2ZdX2, d2ZdY2, d2ZdXY;
+  double cs2 = SQ(cellsize);
+
+  /* Slope angles and cell sizes */
+  if (i == 0)
+    dZdX = (Z[1][j] - Z[0][j]) / cellsize;    /* ∂Z/∂X */
+  else if (i == m-1)
+    dZdX = (Z[m-1][j] - Z[m-2][j]) / cellsize;
+  else
+    dZdX = 0.5 * (Z[i+1][j]-Z[i-1][j]) / cellsize;
+  if (j == 0)
+    dZdY = (Z[i][1] - Z[i][0]) / cellsize;    /* ∂Z/∂Y */
+  else if (j == n-1)
+    dZdY = (Z[i][n-1] - Z[i][n-2]) / cellsize;
+  else
+    dZdY = 0.5 * (Z[i][j+1] - Z[i][j-1]) / cellsize;
+  auzsq = 1.0 + SQ(dZdX) + SQ(dZdY);
+  auz = sqrt(auzsq);
+  aux = sqrt(1.0 + SQ(dZdX));
+  auy = sqrt(1.0 + SQ(dZdY));
+  dx[i][j] = cellsize * aux;
+  dy[i][j] = cellsize * auy;
+  gx[i][j] = -g * dZdX * aux / auzsq;
+  gy[i][j] = -g * dZdY * auy / auzsq;
+  gz0[i][j] = g / auz;          /* Count normal component of gravity positive */
+  gz[i][j] = gz0[i][j];         /* Will be modified for centripetal acceler. */
+  dA[i][j] = cs2 * auz;
+
+  /* Off-diagonal element of metric tensor (normalized for use with
+     physical instead of contravariant velocity components) – thus this
+     is actually the cosine between x- and y-directions and not Gxy. */
+  G_xy[i][j] = dZdX * dZdY / (aux*auy);
+
+  /* Curvature tensor */
+  if ((i == 0) || (i == m-1))
+    d2ZdX2 = 0.0;                       /* ∂²Z/∂X² */
+  else
+    d2ZdX2 = (Z[i+1][j] + Z[i-1][j] - 2.0*Z[i][j]) / SQ(cellsize);
+  if ((j == 0) || (j == n-1))
+    d2ZdY2 = 0;                         /* ∂²Z/∂Y² */
+  else
+    d2ZdY2 = (Z[i][j+1] + Z[i][j-1] - 2.0*Z[i][j]) / SQ(cellsize);
+  if ((i == 0) || (i == m-1) || (j == 0) || (j == n-1))
+    d2ZdXY = 0.0;                       /* ∂²Z/∂X∂Y */
+  else
+    d2ZdXY = (Z[i+1][j+1] + Z[i-1][j-1] - Z[i+1][j-1] - Z[i-1][j+1])
+             / (4.0 * SQ(cellsize));
+  kxx[i][j] = (real_s) (d2ZdX2 / (SQ(aux)*auz));
+  kyy[i][j] = (real_s) (d2ZdY2 / (SQ(auy)*auz));
+  kxy[i][j] = (real_s) (d2ZdXY / (aux*auy*auz));
+}
+
+/******************************/
+/*  End of surface_cell(...)  */
+/******************************/
+
 
-  /* Allocate all dynamic arrays and read the z-coordinates: */
-  allocate();
+/*********************/
+/*                   */
+/*  mark_dirty(...)  */
+/*                   */
+/*********************/
 
-  read_raster(grid_fn, z0, xllcorner, yllcorner, cellsize, -9998.9, 0);
+/** Called by the erosion and deposition code when b or d of cell (i,j) has
+    changed. The cell is put on the dirty list once b + d differs by more
+    than geo_tol from its value at the last geometry update. */
 
-  update_surface(z0);
+void mark_dirty(size_t i, size_t j)
 
-  printf("   read_grid_file:     Completed.\n");
+{
+  size_t c;
 
+  if (!geo_flag[i][j] && fabs(b[i][j] + d[i][j] - bd_geo[i][j]) > geo_tol) {
+    geo_flag[i][j] = 1;
+#ifdef _OPENMP
+    #pragma omp atomic capture          /* Tiles of other threads */
+#endif
+    c = n_dirty++;
+    geo_dirty[c] = i*n + j;
+  }
 }
 
-/***************************/
-/* End of read_grid_file() */
-/***************************/
+/****************************/
+/*  End of mark_dirty(...)  */
+/****************************/
 
 
-/*************************/
-/*                       */
-/*  update_surface(...)  */
-/*                       */
-/*************************/
+/************************/
+/*                      */
+/*  mark_bed_grad(...)  */
+/*                      */
+/************************/
 
-/** Compute slope and curvature components for given surface. */
+/** Called when b or the cell sizes of cell (i,j) have changed. The stored
+    bed gradients of the cell and its four neighbors, which are the only
+    ones whose differences involve cell (i,j), are flagged for recomputation
+    in source_terms(). */
 
-void update_surface(double **Z)
+void mark_bed_grad(size_t i, size_t j)
 
 {
-  size_t i, j;
-  double aux, auy, auz, auzsq, dZdX, dZdY;
-  double d2ZdX2, d2ZdY2, d2ZdXY;
-  double cs2 = SQ(cellsize);
-  double gsq;							/* For testing */
+  bg_stale[i][j] = 1;
+  if (i > 0)
+    bg_stale[i-1][j] = 1;
+  if (i < m-1)
+    bg_stale[i+1][j] = 1;
+  if (j > 0)
+    bg_stale[i][j-1] = 1;
+  if (j < n-1)
+    bg_stale[i][j+1] = 1;
+}
 
-  /* Calculate the quantities that are used in the simulation: */
-  for (i = 0; i < m; i++)
-    for (j = 0; j < n; j++) {
-      /* Slope angles and cell sizes */
-      if (i == 0)
-        dZdX = (Z[1][j] - Z[0][j]) / cellsize;    /* ∂Z/∂X */
-      else if (i == m-1)
-        dZdX = (Z[m-1][j] - Z[m-2][j]) / cellsize;
-      else
-        dZdX = 0.5 * (Z[i+1][j]-Z[i-1][j]) / cellsize;
-      if (j == 0)
-        dZdY = (Z[i][1] - Z[i][0]) / cellsize;    /* ∂Z/∂Y */
-      else if (j == n-1)
-        dZdY = (Z[i][n-1] - Z[i][n-2]) / cellsize;
-      else
-        dZdY = 0.5 * (Z[i][j+1] - Z[i][j-1]) / cellsize;
-      auzsq = 1.0 + SQ(dZdX) + SQ(dZdY);
-      auz = sqrt(auzsq);
-      aux = sqrt(1.0 + SQ(dZdX));
-      auy = sqrt(1.0 + SQ(dZdY));
-      dx[i][j] = cellsize * aux;
-      dy[i][j] = cellsize * auy;
-      gx[i][j] = -g * dZdX * aux / auzsq;
-      gy[i][j] = -g * dZdY * auy / auzsq;
-      gz0[i][j] = g / auz;      /* Count normal component of gravity positive */
-      gz[i][j] = gz0[i][j];     /* Will be modified for centripetal acceler. */
-      dA[i][j] = cs2 * auz;
-
-      /* Off-diagonal element of metric tensor (normalized for use with
-         physical instead of contravariant velocity components) – thus this
-         is actually the cosine between x- and y-directions and not Gxy. */
-      G_xy[i][j] = dZdX * dZdY / (aux*auy);
+/*******************************/
+/*  End of mark_bed_grad(...)  */
+/*******************************/
 
-      /* Test whether this gives back the correct magnitude of g: */
-      if (fabs((gsq = SQ(gz[i][j]) + SQ(gx[i][j]) + SQ(gy[i][j])
-                      + 2.0*G_xy[i][j]*gx[i][j]*gy[i][j]) - SQ(g)) > 0.0001)
-        printf("   "ST3", "ST3":  |g| = %5.3f m/s²\n", i, j, sqrt(gsq));
 
-      /* Curvature tensor */
-      if ((i == 0) || (i == m-1))
-        d2ZdX2 = 0.0;                   /* ∂²Z/∂X² */
-      else
-        d2ZdX2 = (Z[i+1][j] + Z[i-1][j] - 2.0*Z[i][j]) / SQ(cellsize);
-      if ((j == 0) || (j == n-1))
-        d2ZdY2 = 0;                     /* ∂²Z/∂Y² */
-      else
-        d2ZdY2 = (Z[i][j+1] + Z[i][j-1] - 2.0*Z[i][j]) / SQ(cellsize);
-      if ((i == 0) || (i == m-1) || (j == 0) || (j == n-1))
-        d2ZdXY = 0.0;                   /* ∂²Z/∂X∂Y */
-      else
-        d2ZdXY = (Z[i+1][j+1] + Z[i-1][j-1] - Z[i+1][j-1] - Z[i-1][j+1])
-                 / (4.0 * SQ(cellsize));
-      kxx[i][j] = d2ZdX2 / (SQ(aux)*auz);
-      kyy[i][j] = d2ZdY2 / (SQ(auy)*auz);
-      kxy[i][j] = d2ZdXY / (aux*auy*auz);
-    }
+/**************************/
+/*                        */
+/*  update_geometry(...)  */
+/*                        */
+/**************************/
+
+/** Raises the surface z of the dirty cells by their bed and deposit depths
+    and recomputes the geometry of these cells and their 3×3 neighbors,
+    which are the only ones whose differences involve the changed z. Cells
+    recomputed once are flagged with bit 2 of geo_flag; sleeping cells among
+    them are woken. As z is raised along the old bed normal (g / gz0), a
+    recomputed cell with bed or deposit whose gz0 changed must also have its
+    z raised anew; like in a recomputation of the entire grid, this happens
+    in the next update, for which it is kept on the dirty list. */
+
+void update_geometry(void)
+
+{
+  size_t c, i, j, a, e, n0 = n_dirty;
+  double gz_old;
+
+  for (c = 0; c < n0; c++) {
+    i = geo_dirty[c] / n;
+    j = geo_dirty[c] % n;
+    bd_geo[i][j] = b[i][j] + d[i][j];
+    z[i][j] = z0[i][j] + bd_geo[i][j] * g / gz0[i][j];
+  }
+  for (c = 0; c < n0; c++) {
+    i = geo_dirty[c] / n;
+    j = geo_dirty[c] % n;
+    for (a = (i > 0 ? i-1 : 0); a <= i+1 && a < m; a++)
+      for (e = (j > 0 ? j-1 : 0); e <= j+1 && e < n; e++)
+        if (!(geo_flag[a][e] & 2)) {
+          geo_flag[a][e] |= 2;
+          gz_old = gz0[a][e];
+          surface_cell(z, a, e);
+          if (gz0[a][e] != gz_old && bd_geo[a][e] != 0.0)
+            geo_dirty[n_dirty++] = a*n + e;     /* z along the new normal */
+          if (eromod == 4)              /* dx, dy enter the bed gradient */
+            mark_bed_grad(a, e);
+          if (slp != NULL)              /* Wakes a sleeping cell */
+            slp[a][e] = (unsigned char) ((slp[a][e] & ~SLP_SLEEP) | SLP_GEO);
+        }
+  }
+  for (c = 0; c < n0; c++) {
+    i = geo_dirty[c] / n;
+    j = geo_dirty[c] % n;
+    for (a = (i > 0 ? i-1 : 0); a <= i+1 && a < m; a++)
+      for (e = (j > 0 ? j-1 : 0); e <= j+1 && e < n; e++)
+        geo_flag[a][e] = 0;
+  }
+  for (c = n0; c < n_dirty; c++) {      /* Dirty for the next update */
+    geo_dirty[c-n0] = geo_dirty[c];
+    geo_flag[geo_dirty[c] / n][geo_dirty[c] % n] = 1;
+  }
+  n_dirty -= n0;
 }
 
-/***************************/
-/* End of update_surface() */
-/***************************/
+/*********************************/
+/*  End of update_geometry(...)  */
+/*********************************/
 
 
 /*************************/
@@ -1121,28 +4964,37 @@ void read_init_file(void)
 
 {
   size_t i, j;
-  int    ec;
-  double cs2 = SQ(cellsize), g_inv = 1.0 / g;
+  int    ec, p, c;
+  double cs2 = SQ(cellsize), g_inv = 1.0 / g, **X;
+  real_s **nD, **tD;
 
 
   /* Release area and release depth (compulsory file) */
-  ec = read_raster(h_fn, h, xllcorner, yllcorner, cellsize, 0.0, 1);
+  ec = read_raster(h_fn, h, xll_all, yll_all, cs_all, 0.0, 2);
   if (ec == 1) {
     printf("   read_init_file:     No file for release depth. STOP!\n");
     exit(40);
   }
 
   /* Initial velocities in x and y-direction (assume 0 if file not present). */
-  ec =  read_raster(u_fn, u, xllcorner, yllcorner, cellsize, -9999, 1);
-  if (ec > 0)
+  ec =  read_raster(u_fn, u, xll_all, yll_all, cs_all, -9999, 1);
+  if (ec > 0) {
     printf("   read_init_file:     Could not read initial u velocity.\n");
+    for (i = 0; i < m; i++)             /* The arrays may reuse memory */
+      for (j = 0; j < n; j++)           /* freed after a pre-run */
+        u[i][j] = 0.0;
+  }
   else if (ec < 0) {
     printf("   read_init_file:     Value out of bound in %s. STOP!\n", u_fn);
     exit(41);
   }
-  ec += read_raster(v_fn, v, xllcorner, yllcorner, cellsize, -9999, 1);
-  if (ec > 0)
+  ec = read_raster(v_fn, v, xll_all, yll_all, cs_all, -9999, 1);
+  if (ec > 0) {
     printf("   read_init_file:     Could not read initial v velocity.\n");
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        v[i][j] = 0.0;
+  }
   else if (ec < 0) {
     printf("   read_init_file:     Value out of bound in %s. STOP!\n", v_fn);
     exit(41);
@@ -1150,7 +5002,7 @@ void read_init_file(void)
 
   /* Erodible snow depth and erodibility */
   if (eromod > 0) {
-    ec = read_raster(b_fn, b, xllcorner, yllcorner, cellsize, 0.0, 1);
+    ec = read_raster(b_fn, b, xll_all, yll_all, cs_all, 0.0, 2);
     if (ec == 1) {
       printf("   read_init_file:     No file for erodible snow depth. STOP!\n");
       exit(42);
@@ -1165,18 +5017,16 @@ void read_init_file(void)
           b[i][j] = 0.0;
   }
 
-  if (dep > 0) {
-    for (i = i_min; i < i_max; i++)
-      for (j = j_min; j < j_max; j++)
-        d[i][j] = 0.0;          /* Initially, deposition is zero but previous
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      d[i][j] = 0.0;            /* Initially, deposition is zero but previous
                                    avalanches could be read from file. */
-  }
 
-  if (eromod > 1) {             /* Read τ_c for all erosion models except RAMMS.
-                                   AVAFRAME: this is specific erosion energy. */
+  /* Read τ_c for all erosion models except RAMMS, unless the zone table
+     gives it. AVAFRAME: this is specific erosion energy. */
+  if (eromod > 1 && zone == NULL) {
     printf("   read_init_file:     About to read tau_c file...  ");
-    ec = read_raster(tauc_fn, tau_c, xllcorner, yllcorner, \
-                     cellsize, 0.0, 1);
+    ec = read_raster_s(tauc_fn, tau_c, 0.0);
     printf("done.\n");
     if (ec == 1) {
       printf("   read_init_file:     No file for bed shear strength. STOP!\n");
@@ -1189,10 +5039,10 @@ void read_init_file(void)
     }
     for (i = 0; i < m; i++)             /* Scale tau_c by flow density and */
       for (j = 0; j < n; j++)           /* prevent too small values */
-        tau_c[i][j] = MAX(tau_c[i][j]/rho, 0.1);    /* Units m²/s² */
+        tau_c[i][j] = (real_s) MAX(tau_c[i][j]/rho, 0.1);  /* Units m²/s² */
     if (grad == 2) {                    /* Local bed friction angle from file */
       printf("   read_init_file:     About to read μ_s file...  ");
-      ec = read_raster(mu_s_fn, mu_s,  xllcorner, yllcorner, cellsize, 0.0, 1);
+      ec = read_raster_s(mu_s_fn, mu_s, 0.0);
       if (ec == 1) {
         printf("   read_init_file:     No file for bed friction coeff. STOP!\n");
         exit(44);
@@ -1206,9 +5056,11 @@ void read_init_file(void)
     else {                             /* Constant friction angle of bed */
       for (i = 0; i < m; i++)
         for (j = 0; j < n; j++)
-          mu_s[i][j] = mu_s0;
+          mu_s[i][j] = (real_s) mu_s0;
     }
   }
+  if (eromod == 5)                      /* Tabulated erosion law */
+    read_erod_table();
 
   /* Embed the release area in the snowcover if avalanche starts from rest: */
   if (!restart) {
@@ -1226,8 +5078,10 @@ void read_init_file(void)
   }
 
   /* Friction parameters */
-  if (!strcmp(params, "variable")) {    /* Variable coefficients from file */
-    ec = read_raster(mu_fn, mu, xllcorner, yllcorner, cellsize, 0.0, 1);
+  if (zone != NULL)                     /* Zone raster and parameter table */
+    read_zones();
+  else if (!strcmp(params, "variable")) { /* Variable coefficients from file */
+    ec = read_raster_s(mu_fn, mu, 0.0);
     if (ec > 0) {
       printf("   read_init_file:     Missing file for mu. STOP!\n");
       exit(45);
@@ -1236,7 +5090,7 @@ void read_init_file(void)
       printf("   read_init_file:     Out-of-bound value in %s. STOP!\n", mu_fn);
       exit(41);
     }
-    ec += read_raster(k_fn, k, xllcorner, yllcorner, cellsize, 0.0, 1);
+    ec += read_raster_s(k_fn, k, 0.0);
     if (ec > 0) {
       printf("   read_init_file:     Missing file for k. STOP!\n");
       exit(46);
@@ -1249,15 +5103,18 @@ void read_init_file(void)
   else {                                /* Constant friction parameters */
     for (i = 0; i < m; i++)
       for (j = 0; j < n; j++) {
-        mu[i][j] = mu_g;
-        k[i][j] = k_g;
+        mu[i][j] = (real_s) mu_g;
+        k[i][j] = (real_s) k_g;
       }
   }
 
   /* Forest parameters: tree density times diameter, diameter.
-     Note that the input file refers to horizontally projected area. */
+     Note that the input file refers to horizontally projected area.
+     The rasters are only needed to build the list of forested cells. */
   if (forest > 0) {
-    ec = read_raster(nD_fn, nD, xllcorner, yllcorner, cellsize, 0.0, 1);
+    nD = allocate2s(m, n);
+    tD = allocate2s(m, n);
+    ec = read_raster_s(nD_fn, nD, 0.0);
     if (ec > 0) {
       printf("   read_init_file:     Missing file for nD. STOP!\n");
       exit(47);
@@ -1268,8 +5125,8 @@ void read_init_file(void)
     }
     for (i = 0; i < m; i++)
       for (j = 0; j < n; j++)
-        nD[i][j] *= (cs2 / dA[i][j]);
-    ec = read_raster(tD_fn, tD, xllcorner, yllcorner, cellsize, 0.0, 1);
+        nD[i][j] = (real_s) (nD[i][j] * (cs2 / dA[i][j]));
+    ec = read_raster_s(tD_fn, tD, 0.0);
     if (ec > 0) {
       printf("   read_init_file:     Missing file for tD. STOP!\n");
       exit(47);
@@ -1278,10 +5135,66 @@ void read_init_file(void)
       printf("   read_init_file:     Out-of-bound value in %s. STOP!\n", tD_fn);
       exit(41);
     }
+    n_fc = 0;
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        if (nD[i][j] > 0.0)
+          n_fc++;
+    if (n_fc >= INT_MAX) {
+      printf("   read_init_file:     Too many forested cells. STOP!\n");
+      exit(8);
+    }
+    if ((fc = (struct forest_cell*) malloc((n_fc > 0 ? n_fc : 1)
+                                           * sizeof(struct forest_cell)))
+        == NULL) {
+      printf("   read_init_file:     Memory allocation failed. STOP!\n");
+      exit(8);
+    }
+    n_fc = 0;
+    for (i = 0; i < m; i++) {
+      fc_row[i] = n_fc;
+      for (j = 0; j < n; j++) {
+        if (nD[i][j] > 0.0) {
+          fc[n_fc].j = j;
+          fc[n_fc].nD = nD[i][j];
+          fc[n_fc].tD = tD[i][j];
+          fc[n_fc].decay_const = 0.0;
+          FC_AT(i, j) = (int) n_fc++;
+        }
+        else
+          FC_AT(i, j) = -1;
+      }
+    }
+    fc_row[m] = n_fc;
+    deallocate2s(tD, m);
+    deallocate2s(nD, m);
+    printf("   read_init_file:     "ST" forested cells (%.1f%%).\n",
+           n_fc, 100.0 * (double) n_fc / (double) (m*n));
   }
 
-  /* Impenetrable areas */
-  /* Not implemented yet! */
+  /* Impenetrable areas: cells with obstacle height > 0 become walls like
+     the cells without data in the DEM; walls carry no mass. */
+  if (strlen(obst_fn) > 0) {
+    X = allocate2(m, n);
+    ec = read_raster(obst_fn, X, xll_all, yll_all, cs_all, -9999, 1);
+    if (ec > 0) {
+      printf("   read_init_file:     Missing obstacle file. STOP!\n");
+      exit(48);
+    }
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        if (X[i][j] > 0.0)
+          set_wall(i, j);
+    deallocate2(X, m);
+  }
+  if (cmask != NULL)
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        if (cmask[i][j] & CELL_WALL) {
+          h[i][j] = u[i][j] = v[i][j] = 0.0;
+          if (eromod > 0)
+            b[i][j] = 0.0;
+        }
 
   /* Initialize the conservative field variables: */
   mov_vol = 0.0;
@@ -1291,8 +5204,12 @@ void read_init_file(void)
       f_new[i][j][1] = f_new[i][j][0] * u[i][j];
       f_new[i][j][2] = f_new[i][j][0] * v[i][j];
       if (eromod > 0)
-        b_min[i][j] = b[i][j];
-      mov_vol += f_new[i][j][0];
+        b_min[i][j] = (real_s) b[i][j];
+      if (OWN_ROW(j))
+        mov_vol += f_new[i][j][0];
+      h_max[i][j] = s_max[i][j] = u_max[i][j] = v_max[i][j] = p_max[i][j]
+                  = 0.0;
+      s[i][j] = p_imp[i][j] = 0.0;      /* Set by primivar() from step 1 */
       /* Initialize erosion rate to 0 here so that it need not be computed
          again in each timestep when running without erosion. */
       src[i][j][0] = 0.0;
@@ -1300,6 +5217,33 @@ void read_init_file(void)
         d_max[i][j] = 0.0;
     }
   }
+  all_sum(&mov_vol, 1);
+  tot_vol = vol_rel = mov_vol;
+  vol_ero = vol_dep = vol_out = 0.0;
+
+  /* The initial conditions do not depend on the sensitivity parameters: */
+  for (p = 0; p < n_sens; p++) {
+    for (i = 0; i < m; i++) {
+      for (j = 0; j < n; j++) {
+        for (c = 0; c < 3; c++)
+          tl_f_new[p][i][j][c] = tl_f_old[p][i][j][c] = tl_src[p][i][j][c]
+                               = 0.0;
+        tl_h[p][i][j] = tl_u[p][i][j] = tl_v[p][i][j] = tl_s[p][i][j] = 0.0;
+        tl_h_max[p][i][j] = tl_s_max[p][i][j] = 0.0;
+        if (eromod > 0)
+          tl_b[p][i][j] = 0.0;
+        if (dep > 0)
+          tl_d[p][i][j] = 0.0;
+      }
+    }
+  }
+  if (n_sens > 0) {                     /* No switching events yet */
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        tl_sw[i][j] = 0.0;
+    for (c = 0; c < TL_SW_KINDS; c++)
+      tl_n_sw[c] = 0.0;
+  }
 
   printf("   read_init_file:     Completed.\n\n");
 }
@@ -1316,16 +5260,23 @@ void read_init_file(void)
 /********************/
 
 /** Opens an AAIGrid raster file and reads its content into an array, doing
-    some consistency checks and eliminating values below a threshold. */
+    some consistency checks and eliminating values below a threshold. Only
+    the computational window is stored, averaged over rfac × rfac cells.
+    Rasters with a geometry different from the DEM are resampled onto the
+    grid; pass == 2 marks depth fields, whose volume is conserved. On a
+    coarsened grid, a depth field is averaged weighted by the inclined areas
+    of the DEM cells at full resolution, so that each cell holds the volume
+    of its fine cells. */
 
 int read_raster(char *raster_fn, double** X, double xll, double yll,
                 double cs, double min_val, int pass)
 {
   FILE   *ifp;
   char   xstr[10], ystr[10];            /* Check xllcorner or xllcenter? */
-  size_t mr, nr;
+  size_t mr, nr, a, e;
   int    i, j;
-  double xll_read, yll_read, cs_read, nan, fval;
+  double xll_read, yll_read, cs_read, nan, fval, w = 1.0 / SQ((double) rfac);
+  double **J = NULL;                    /* Fine inclination factors */
 
   /* Open raster file for reading. */
   if ((ifp = fopen(raster_fn, "r")) == NULL) {
@@ -1342,25 +5293,30 @@ int read_raster(char *raster_fn, double** X, double xll, double yll,
   }
 
   if (!strcmp(xstr, "xllcenter")) {      /* If necessary, convert cell */
-    xll_read -= (0.5*cellsize);          /* center to cell corner coordinates */
-    yll_read -= (0.5*cellsize);
+    xll_read -= (0.5*cs_read);           /* center to cell corner coordinates */
+    yll_read -= (0.5*cs_read);
   }
 
-  if (pass > 0 && (mr != m || nr != n || fabs(cs_read - cs) > 0.0001
+  if (pass > 0 && (mr != m_all || nr != n_all || fabs(cs_read - cs) > 0.0001
                    || fabs(xll_read - xll) > 0.001
                    || fabs(yll_read - yll) > 0.001)) {
-    printf("   read_raster:  Contradiction in header data of %s. STOP!\n",
-           raster_fn);
-    printf("      m="ST", mr="ST";  n="ST", nr="ST";  cs=%.4f, csr=%.4f\n",
-           m, mr, n, nr, cs, cs_read);
-    printf("      xll = %.4f,  xllr = %.4f;  yll = %.4f,  yllr = %.4f\n",
-           xll, xll_read, yll, yll_read);
-    exit(51);
+    printf("   read_raster:  Resampling %s (cellsize %.2f m).\n",
+           raster_fn, cs_read);
+    resample_raster(ifp, raster_fn, X, mr, nr, xll_read, yll_read, cs_read,
+                    min_val, pass);
+    fclose(ifp);
+    return 0;
   }
 
   /* Read data one by one. */
-  for (j = (int) n-1; j >= 0; j--) {
-    for (i = 0; i < (int) m; i++) {
+  if (rfac > 1)
+    for (a = 0; a < m; a++)
+      for (e = 0; e < n; e++)
+        X[a][e] = 0.0;
+  if (pass == 2 && rfac > 1)
+    J = fine_area_factor();
+  for (j = (int) n_all-1; j >= 0; j--) {
+    for (i = 0; i < (int) m_all; i++) {
       /* lest = fscanf(ifp, "%lf", &fval);
       if (lest == 0) { */
       if (fscanf(ifp, "%lf", &fval) != 1) {
@@ -1368,8 +5324,22 @@ int read_raster(char *raster_fn, double** X, double xll, double yll,
                raster_fn, i, j);
         exit(52);
       }
-      if (fval >= min_val)
-        X[i][j] = fval;
+      if (pass == 0 && fval == nan)     /* No data in the DEM, see */
+        fval = -HUGE_VAL;               /* fill_nodata() */
+      if (fval >= min_val || fval == -HUGE_VAL) {
+        if ((size_t) i < wi0 || (size_t) j < wj0)
+          continue;                     /* Outside of the window */
+        a = ((size_t) i - wi0) / rfac;
+        e = ((size_t) j - wj0) / rfac;
+        if (a >= m || e >= n)
+          continue;
+        if (J != NULL)
+          X[a][e] += w * fval * J[(size_t) i - wi0][(size_t) j - wj0];
+        else if (rfac > 1)
+          X[a][e] += w * fval;
+        else
+          X[a][e] = fval;
+      }
       else {
         printf("   read_raster:  Reading %s.\n", raster_fn);
         printf("                 Value at (%d,%d) is %.5f < %.5f. STOP!\n",
@@ -1379,6 +5349,12 @@ int read_raster(char *raster_fn, double** X, double xll, double yll,
     }
   }
   fclose(ifp);
+  if (J != NULL) {                      /* Volume over the inclined area */
+    for (a = 0; a < m; a++)
+      for (e = 0; e < n; e++)
+        X[a][e] *= SQ(cellsize) / dA[a][e];
+    deallocate2(J, m*rfac);
+  }
   return 0;
 }
 
@@ -1387,6 +5363,452 @@ int read_raster(char *raster_fn, double** X, double xll, double yll,
 /***************************/
 
 
+/**********************/
+/*                    */
+/* fine_area_factor() */
+/*                    */
+/**********************/
+
+/** Reads the DEM at full resolution in the window of the coarsened grid,
+    with one cell more on each side where the DEM has it, and returns the
+    inclination factors dA/cs² of the fine cells of the window, computed
+    as in surface_cell(). Next to cells without data, the differences are
+    one-sided; cells without data count as horizontal. */
+
+double **fine_area_factor(void)
+
+{
+  size_t mf = m*rfac, nf = n*rfac, mc = m, nc = n, r = rfac;
+  size_t hi = (wi0 > 0), hj = (wj0 > 0), i, j, a, e, a0, a1, e0, e1;
+  double **Z, **J, dZdX, dZdY;
+
+  /* Read the window plus its margin like the DEM of an uncoarsened grid: */
+  m = mf + hi + (wi0 + mf < m_all);
+  n = nf + hj + (wj0 + nf < n_all);
+  wi0 -= hi;
+  wj0 -= hj;
+  rfac = 1;
+  Z = allocate2(m, n);
+  read_raster(grid_fn, Z, xll_all, yll_all, cs_all, -9998.9, 0);
+
+  J = allocate2(mf, nf);
+  for (i = 0; i < mf; i++) {
+    for (j = 0; j < nf; j++) {
+      a = i + hi;
+      e = j + hj;
+      if (Z[a][e] == -HUGE_VAL) {
+        J[i][j] = 1.0;
+        continue;
+      }
+      a0 = (a > 0 && Z[a-1][e] > -HUGE_VAL ? a-1 : a);
+      a1 = (a+1 < m && Z[a+1][e] > -HUGE_VAL ? a+1 : a);
+      e0 = (e > 0 && Z[a][e-1] > -HUGE_VAL ? e-1 : e);
+      e1 = (e+1 < n && Z[a][e+1] > -HUGE_VAL ? e+1 : e);
+      dZdX = (a1 - a0 == 2 ? 0.5 * (Z[a1][e] - Z[a0][e]) / cs_all
+                           : (Z[a1][e] - Z[a0][e]) / cs_all);
+      dZdY = (e1 - e0 == 2 ? 0.5 * (Z[a][e1] - Z[a][e0]) / cs_all
+                           : (Z[a][e1] - Z[a][e0]) / cs_all);
+      J[i][j] = sqrt(1.0 + SQ(dZdX) + SQ(dZdY));
+    }
+  }
+  deallocate2(Z, m);
+
+  m = mc;
+  n = nc;
+  wi0 += hi;
+  wj0 += hj;
+  rfac = r;
+  return J;
+}
+
+/*****************************/
+/* End of fine_area_factor() */
+/*****************************/
+
+
+/**********************/
+/*                    */
+/* read_raster_s(...) */
+/*                    */
+/**********************/
+
+/** Reads a parameter raster into a field of type real_s. In single
+    precision, the data pass through a temporary double array. */
+
+int read_raster_s(char *raster_fn, real_s **X, double min_val)
+{
+#ifdef FLOAT_FIELDS
+  size_t i, j;
+  int    ec;
+  double **T = allocate2(m, n);
+
+  ec = read_raster(raster_fn, T, xll_all, yll_all, cs_all, min_val, 1);
+  if (ec == 0)
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++)
+        X[i][j] = (real_s) T[i][j];
+  deallocate2(T, m);
+  return ec;
+#else
+  return read_raster(raster_fn, X, xll_all, yll_all, cs_all, min_val, 1);
+#endif
+}
+
+/*****************************/
+/* End of read_raster_s(...) */
+/*****************************/
+
+
+/*********************/
+/*                   */
+/*  read_zones(...)  */
+/*                   */
+/*********************/
+
+/** Reads the parameter table, one zone per line in the form
+    "<zone> <mu> <k> <tau_c> <mu_s>", and the zone raster, which must have the
+    geometry of the DEM. Zone codes are integers 0, ..., ZONES_MAX-1, cells
+    without data are assigned zone 0. If the rasters are coarsened, a cell
+    takes the zone of the input cell at its centre. */
+
+void read_zones(void)
+
+{
+  FILE   *ifp;
+  char   line[512], xstr[10], ystr[10];
+  size_t mr, nr, a, e, c2 = rfac / 2;
+  int    i, j, c;
+  double xll_read, yll_read, cs_read, nan, fval, par[4];
+
+  /* Parameter table: */
+  if ((ifp = fopen(zone_tab_fn, "r")) == NULL) {
+    printf("   read_zones:  Could not open file %s. STOP!\n\n", zone_tab_fn);
+    exit(49);
+  }
+  for (c = 0; c < ZONES_MAX; c++)
+    zone_tab[c].defined = 0;
+  while (fgets(line, 512, ifp) != NULL) {
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+      continue;                         /* Skip comments and empty lines */
+    if (sscanf(line, "%d %lf %lf %lf %lf", &c, par, par+1, par+2, par+3) != 5
+        || c < 0 || c >= ZONES_MAX || par[0] < 0.0 || par[1] < 0.0
+        || par[2] < 0.0 || par[3] < 0.0) {
+      printf("   read_zones:  Invalid line in %s:\n   %s   STOP!\n\n",
+             zone_tab_fn, line);
+      exit(49);
+    }
+    zone_tab[c].mu = par[0];
+    zone_tab[c].k = par[1];
+    zone_tab[c].tau_c = MAX(par[2]/rho, 0.1);   /* As in read_init_file() */
+    zone_tab[c].mu_s = (grad == 2 ? par[3] : mu_s0);
+    zone_tab[c].defined = 1;
+  }
+  fclose(ifp);
+
+  /* Zone raster: */
+  if ((ifp = fopen(zone_fn, "r")) == NULL) {
+    printf("   read_zones:  Could not open file %s. STOP!\n\n", zone_fn);
+    exit(49);
+  }
+  if (fscanf(ifp, "ncols "ST" nrows "ST" %s %lf %s %lf \
+             cellsize %lf NODATA_value %lf\n",
+             &mr, &nr, xstr, &xll_read, ystr, &yll_read, &cs_read, &nan) != 8) {
+    printf("   Error reading header of file %s. STOP!\n\n", zone_fn);
+    exit(50);
+  }
+  if (!strcmp(xstr, "xllcenter")) {
+    xll_read -= (0.5*cs_read);
+    yll_read -= (0.5*cs_read);
+  }
+  if (mr != m_all || nr != n_all || fabs(cs_read - cs_all) > 0.0001
+      || fabs(xll_read - xll_all) > 0.001 || fabs(yll_read - yll_all) > 0.001) {
+    printf("   read_zones:  %s does not match the DEM. STOP!\n\n", zone_fn);
+    exit(49);
+  }
+  for (j = (int) n_all-1; j >= 0; j--) {
+    for (i = 0; i < (int) m_all; i++) {
+      if (fscanf(ifp, "%lf", &fval) != 1) {
+        printf("   Error reading data from file %s at (%d,%d). STOP!\n\n",
+               zone_fn, i, j);
+        exit(52);
+      }
+      if ((size_t) i < wi0 || (size_t) j < wj0
+          || ((size_t) i - wi0) % rfac != c2 || ((size_t) j - wj0) % rfac != c2)
+        continue;                       /* Not the centre of a grid cell */
+      a = ((size_t) i - wi0) / rfac;
+      e = ((size_t) j - wj0) / rfac;
+      if (a >= m || e >= n)
+        continue;
+      if (fval == nan)
+        fval = 0.0;
+      if (fval < 0.0 || fval >= ZONES_MAX || fval != floor(fval)
+          || !zone_tab[(int) fval].defined) {
+        printf("   read_zones:  Zone %g at (%d,%d) is not in %s. STOP!\n\n",
+               fval, i, j, zone_tab_fn);
+        exit(49);
+      }
+      zone[a][e] = (unsigned char) fval;
+    }
+  }
+  fclose(ifp);
+  printf("   read_zones:  Read %s and %s.\n", zone_fn, zone_tab_fn);
+}
+
+/****************************/
+/*  End of read_zones(...)  */
+/****************************/
+
+
+/**************************/
+/*                        */
+/*  read_erod_table(...)  */
+/*                        */
+/**************************/
+
+/** Reads the IsPa erosion table, one node per line in the form
+    "<speed (m/s)> <depth (m)> <bed strength (Pa)> <rate (kg/m²/s)>". The
+    nodes must form a complete rectilinear grid with at least two values per
+    axis, but may be listed in any order and spaced unevenly. The table is
+    interpolated trilinearly onto a uniform lookup grid whose spacing is the
+    smallest spacing of the table, with at most ETAB_N_MAX nodes per axis.
+    Bed strength and rate are scaled by rho on input. */
+
+void read_erod_table(void)
+
+{
+  FILE   *ifp;
+  char   line[512];
+  size_t n_row = 0, n_max = 256, na[3], l[3], r, q, s1;
+  int    a;
+  double *row, *ax[3], *tab, val[4], x, dx_min, w[3];
+  double c00, c01, c10, c11;
+
+  if ((ifp = fopen(erod_tab_fn, "r")) == NULL) {
+    printf("   read_erod_table:  Could not open file %s. STOP!\n\n",
+           erod_tab_fn);
+    exit(54);
+  }
+  if ((row = (double*) malloc(4*n_max * sizeof(double))) == NULL) {
+    printf("   read_erod_table:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  while (fgets(line, 512, ifp) != NULL) {
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+      continue;                         /* Skip comments and empty lines */
+    if (sscanf(line, "%lf %lf %lf %lf", val, val+1, val+2, val+3) != 4
+        || val[0] < 0.0 || val[1] < 0.0 || val[2] < 0.0 || val[3] < 0.0) {
+      printf("   read_erod_table:  Invalid line in %s:\n   %s   STOP!\n\n",
+             erod_tab_fn, line);
+      exit(54);
+    }
+    if (n_row == n_max) {
+      n_max *= 2;
+      if ((row = (double*) realloc(row, 4*n_max * sizeof(double))) == NULL) {
+        printf("   read_erod_table:  Memory allocation failed. STOP!\n\n");
+        exit(8);
+      }
+    }
+    val[2] /= rho;                      /* Scaled like tau_c, m²/s² */
+    val[3] /= rho;                      /* Rate over flow density, m/s */
+    memcpy(row + 4*n_row++, val, 4*sizeof(double));
+  }
+  fclose(ifp);
+
+  /* Distinct node values along each axis, in ascending order: */
+  for (a = 0; a < 3; a++) {
+    if ((ax[a] = (double*) malloc((n_row > 0 ? n_row : 1) * sizeof(double)))
+        == NULL) {
+      printf("   read_erod_table:  Memory allocation failed. STOP!\n\n");
+      exit(8);
+    }
+    na[a] = 0;
+    for (r = 0; r < n_row; r++) {
+      x = row[4*r + (size_t) a];
+      for (q = 0; q < na[a] && ax[a][q] < x; q++)
+        ;
+      if (q < na[a] && ax[a][q] == x)
+        continue;
+      memmove(ax[a] + q + 1, ax[a] + q, (na[a] - q) * sizeof(double));
+      ax[a][q] = x;
+      na[a]++;
+    }
+  }
+  if (na[0] < 2 || na[1] < 2 || na[2] < 2 || n_row != na[0]*na[1]*na[2]) {
+    printf("   read_erod_table:  %s is not a complete grid with at least",
+           erod_tab_fn);
+    printf(" two values\n   of speed, depth and bed strength. STOP!\n\n");
+    exit(54);
+  }
+
+  /* Table values on their grid; duplicates leave other nodes empty: */
+  if ((tab = (double*) malloc(n_row * sizeof(double))) == NULL) {
+    printf("   read_erod_table:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  for (q = 0; q < n_row; q++)
+    tab[q] = -1.0;
+  for (r = 0; r < n_row; r++) {
+    for (a = 0; a < 3; a++)
+      for (l[a] = 0; ax[a][l[a]] != row[4*r + (size_t) a]; l[a]++)
+        ;
+    q = (l[0]*na[1] + l[1])*na[2] + l[2];
+    if (tab[q] >= 0.0) {
+      printf("   read_erod_table:  Node (%g, %g, %g) appears twice in %s.",
+             row[4*r], row[4*r+1], row[4*r+2]*rho, erod_tab_fn);
+      printf(" STOP!\n\n");
+      exit(54);
+    }
+    tab[q] = row[4*r + 3];
+  }
+  free(row);
+
+  /* Uniform lookup grid: */
+  for (a = 0; a < 3; a++) {
+    for (q = 1, dx_min = ax[a][1] - ax[a][0]; q < na[a]-1; q++)
+      dx_min = MIN(dx_min, ax[a][q+1] - ax[a][q]);
+    x = (ax[a][na[a]-1] - ax[a][0]) / dx_min;
+    etab_n[a] = (x < ETAB_N_MAX - 1 ? (size_t) (x + 0.5) + 1 : ETAB_N_MAX);
+    etab_x0[a] = ax[a][0];
+    etab_idx[a] = (double) (etab_n[a]-1) / (ax[a][na[a]-1] - ax[a][0]);
+  }
+  if ((etab = (double*) malloc(etab_n[0]*etab_n[1]*etab_n[2]
+                               * sizeof(double))) == NULL) {
+    printf("   read_erod_table:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  s1 = na[2];
+  for (r = 0; r < etab_n[0]*etab_n[1]*etab_n[2]; r++) {
+    q = r;
+    for (a = 2; a >= 0; a--) {          /* Enclosing table interval */
+      x = etab_x0[a] + (double) (q % etab_n[a]) / etab_idx[a];
+      q /= etab_n[a];
+      for (l[a] = 0; l[a] < na[a]-2 && ax[a][l[a]+1] < x; l[a]++)
+        ;
+      w[a] = MIN(1.0, MAX(0.0, (x - ax[a][l[a]])
+                               / (ax[a][l[a]+1] - ax[a][l[a]])));
+    }
+    q = (l[0]*na[1] + l[1])*s1 + l[2];
+    c00 = tab[q] + w[2]*(tab[q+1] - tab[q]);
+    c01 = tab[q+s1] + w[2]*(tab[q+s1+1] - tab[q+s1]);
+    q += na[1]*s1;
+    c10 = tab[q] + w[2]*(tab[q+1] - tab[q]);
+    c11 = tab[q+s1] + w[2]*(tab[q+s1+1] - tab[q+s1]);
+    c00 += w[1]*(c01 - c00);
+    c10 += w[1]*(c11 - c10);
+    etab[r] = c00 + w[0]*(c10 - c00);
+  }
+  for (a = 0; a < 3; a++)
+    free(ax[a]);
+  free(tab);
+
+  printf("   read_erod_table:  Read "ST" nodes from %s, lookup grid "ST"x"ST"x"
+         ST".\n", n_row, erod_tab_fn, etab_n[0], etab_n[1], etab_n[2]);
+}
+
+/*********************************/
+/*  End of read_erod_table(...)  */
+/*********************************/
+
+
+/************************/
+/*                      */
+/* resample_raster(...) */
+/*                      */
+/************************/
+
+/** Reads the data of a raster whose geometry differs from the DEM and
+    resamples them onto the computational grid. Depth fields (pass == 2) are
+    averaged over the overlap of the raster cells with each grid cell, which
+    conserves their volume; they are 0 outside of the raster. Other fields
+    are averaged in the same way if the raster is finer than the grid and
+    interpolated bilinearly between the cell centres otherwise; there, the
+    values at the raster boundary are continued outwards. */
+
+void resample_raster(FILE *ifp, char *raster_fn, double **X, size_t mr,
+                     size_t nr, double xll_r, double yll_r, double cs_r,
+                     double min_val, int pass)
+{
+  size_t a, e, i, j, i0, i1, j0, j1;
+  double *R, fval, x0, x1, y0, y1, ox, oy, sum, wsum, tx, ty, rc;
+
+  if (xll_r > xllcorner + (double) m * cellsize
+      || xll_r + (double) mr * cs_r < xllcorner
+      || yll_r > yllcorner + (double) n * cellsize
+      || yll_r + (double) nr * cs_r < yllcorner) {
+    printf("   read_raster:  %s does not overlap the grid. STOP!\n",
+           raster_fn);
+    exit(51);
+  }
+  if ((R = (double*) malloc(mr*nr * sizeof(double))) == NULL) {
+    printf("   read_raster:  Memory allocation failed. STOP!\n\n");
+    exit(8);
+  }
+  for (j = nr; j-- > 0; ) {
+    for (i = 0; i < mr; i++) {
+      if (fscanf(ifp, "%lf", &fval) != 1) {
+        printf("   Error reading data from file %s at ("ST","ST"). STOP!\n\n",
+               raster_fn, i, j);
+        exit(52);
+      }
+      if (fval < min_val) {
+        printf("   read_raster:  Reading %s.\n", raster_fn);
+        printf("                 Value at ("ST","ST") is %.5f < %.5f. STOP!\n",
+               i, j, fval, min_val);
+        exit(53);
+      }
+      R[i*nr + j] = fval;
+    }
+  }
+
+  rc = cellsize / cs_r;                 /* Grid cell in raster cells */
+  for (a = 0; a < m; a++) {
+    for (e = 0; e < n; e++) {
+      x0 = (xllcorner + (double) a * cellsize - xll_r) / cs_r;
+      y0 = (yllcorner + (double) e * cellsize - yll_r) / cs_r;
+      x1 = x0 + rc;
+      y1 = y0 + rc;
+      sum = wsum = 0.0;
+      if (pass == 2 || rc > 1.0) {      /* Overlap-weighted mean */
+        i0 = (x0 > 0.0 ? (size_t) x0 : 0);
+        j0 = (y0 > 0.0 ? (size_t) y0 : 0);
+        i1 = (x1 > 0.0 ? MIN(mr, (size_t) ceil(x1)) : 0);
+        j1 = (y1 > 0.0 ? MIN(nr, (size_t) ceil(y1)) : 0);
+        for (i = i0; i < i1; i++)
+          for (j = j0; j < j1; j++) {
+            ox = MIN(x1, (double) i + 1.0) - MAX(x0, (double) i);
+            oy = MIN(y1, (double) j + 1.0) - MAX(y0, (double) j);
+            if (ox > 0.0 && oy > 0.0) {
+              sum += ox * oy * R[i*nr + j];
+              wsum += ox * oy;
+            }
+          }
+      }
+      if (pass == 2)
+        X[a][e] = sum / SQ(rc);
+      else if (wsum > 0.0)
+        X[a][e] = sum / wsum;
+      else {                            /* Bilinear interpolation */
+        tx = MIN(MAX(0.5*(x0 + x1) - 0.5, 0.0), (double) (mr-1));
+        ty = MIN(MAX(0.5*(y0 + y1) - 0.5, 0.0), (double) (nr-1));
+        i0 = (size_t) tx;
+        j0 = (size_t) ty;
+        i1 = MIN(i0+1, mr-1);
+        j1 = MIN(j0+1, nr-1);
+        tx -= (double) i0;
+        ty -= (double) j0;
+        X[a][e] = (1.0-tx) * ((1.0-ty) * R[i0*nr + j0] + ty * R[i0*nr + j1])
+                  + tx * ((1.0-ty) * R[i1*nr + j0] + ty * R[i1*nr + j1]);
+      }
+    }
+  }
+  free(R);
+}
+
+/*******************************/
+/* End of resample_raster(...) */
+/*******************************/
+
+
 /*********************/
 /*                   */
 /*  write_data(...)  */
@@ -1402,26 +5824,78 @@ int read_raster(char *raster_fn, double** X, double xll, double yll,
 
 void write_data(double tid, double **h_dep, double **hf, double **bs,
                 double **dp, double **speed, double **uvel, double **vvel,
-                double **p_shk, double **nDt, size_t imin, size_t imax,
-                size_t jmin, size_t jmax, int pass, char *formt)
+                double **p_shk, size_t imin, size_t imax, size_t jmin,
+                size_t jmax, int pass, char *formt)
 
 {
-  int    i, j, di, dj;
+  int    i, j, di, dj, p, full;
+  size_t mo = m_all / rfac;     /* Size of the output rasters */
+  size_t no = n_all / rfac;
+  size_t ic, c;
+#ifdef USE_MPI
+  int    box[5];
+#endif
+  real_s **nDt = NULL;          /* Forest opacity spread over the grid */
   float  tempus;
   double westend, eastend, southend, northend;
-  char   line[256], suf[10];    /* Temporary variable for ASCII format */
+  char   line[256], suf[24];    /* Temporary variable for ASCII format */
+  char   descr[32];             /* Field description for sensitivities */
   time_t now;                   /* Date and time of run */
 
+  /* From here on, indices refer to the output rasters, which cover the
+     input rasters with the grid's cell size. The entire computational
+     window is written with their full extent. With domain decomposition,
+     the box is that of all subdomains, empty ones do not count. */
+  full = (imin == 0 && imax == m && jmin == 0 && jmax == n);
+  imin += wi0 / rfac;
+  imax += wi0 / rfac;
+  jmin += wj0 / rfac;
+  jmax += wj0 / rfac;
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    if (imin >= imax || jmin >= jmax) {
+      imin = mo;
+      jmin = no;
+      imax = jmax = 0;
+    }
+    box[0] = (int) imin;                /* Maxima as minima of negatives */
+    box[1] = -(int) imax;
+    box[2] = (int) jmin;
+    box[3] = -(int) jmax;
+    box[4] = full;
+    MPI_Allreduce(MPI_IN_PLACE, box, 5, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    imin = (size_t) box[0];
+    imax = (size_t) -box[1];
+    jmin = (size_t) box[2];
+    jmax = (size_t) -box[3];
+    full = box[4];
+  }
+#endif
+  if (full) {
+    imin = jmin = 0;
+    imax = mo;
+    jmax = no;
+  }
+
   di = (int) imax - (int) imin; /* Number of cells in x-direction */
   dj = (int) jmax - (int) jmin; /* Number of cells in y-direction */
   if (di < 1 || dj < 1) {
     printf("   write_data:  Nothing to print.\n");
     return;
   }
-  westend  = xllcorner + (double) imin * cellsize;
-  eastend  = xllcorner + ((double) imin + (double) di) * cellsize;
-  southend = yllcorner + (double) jmin * cellsize;
-  northend = yllcorner + ((double) jmin + (double) dj) * cellsize;
+  if (forest > 0) {
+    nDt = allocate2s(m, n);
+    for (i = 0; i < (int) m; i++)
+      for (j = 0; j < (int) n; j++)
+        nDt[i][j] = 0.0;
+    for (ic = 0; ic < m; ic++)
+      for (c = fc_row[ic]; c < fc_row[ic+1]; c++)
+        nDt[ic][fc[c].j] = fc[c].nD;
+  }
+  westend  = xll_all + (double) imin * cellsize;
+  eastend  = xll_all + ((double) imin + (double) di) * cellsize;
+  southend = yll_all + (double) jmin * cellsize;
+  northend = yll_all + ((double) jmin + (double) dj) * cellsize;
 
   tempus = (float) tid;
 
@@ -1454,7 +5928,7 @@ void write_data(double tid, double **h_dep, double **hf, double **bs,
     printf("   write_data:  Output "ST04" at time %7.2f...   ", n_dump, tempus);
     /* Flow depth */
     sprintf(suf, "_h_"ST04, n_dump);
-    writeout(h, suf, formt, imin, imax, jmin, jmax, header,
+    writeout(hf, suf, formt, imin, imax, jmin, jmax, header,
              "h -- Flow depth (m)            ", "5.2");
     /* Speed */
     sprintf(suf, "_s_"ST04, n_dump);
@@ -1469,7 +5943,7 @@ void write_data(double tid, double **h_dep, double **hf, double **bs,
     /* Write deposition only if it is activated */
     if (dep > 0) {
       sprintf(suf, "_d_"ST04, n_dump);
-      writeout(dp, suf, formt, 0, m, 0, n, header,
+      writeout(dp, suf, formt, 0, mo, 0, no, header,
                "d -- Deposit depth (m)         ", "6.3");
     }
     /* Write files for u, v only if requested */
@@ -1491,8 +5965,8 @@ void write_data(double tid, double **h_dep, double **hf, double **bs,
        Need to write nD over entire DEM area to see remaining forest. */
     if (forest > 0) {
       sprintf(suf, "_n_"ST04, n_dump);
-      writeout(nDt, suf, formt, 0, m, 0, n, header_nD,
-               "nD -- braking effect (1/m)     ", "7.4");
+      writeout_s(nDt, suf, formt, 0, mo, 0, no, header_nD,
+                 "nD -- braking effect (1/m)     ", "7.4");
     }
   }
 
@@ -1507,41 +5981,55 @@ void write_data(double tid, double **h_dep, double **hf, double **bs,
     if (dep == 0) {
       for (i = 0; i < (int) m; i++)
         for (j = 0; j < (int) n; j++)
-          h_dep[i][j] = rrd * hf[i][j];
+          h_dep[i][j] = rrd * h_max[i][j];
     }
-    writeout(h_dep, "_h_dep", formt, 0, m, 0, n, header,
+    writeout(h_dep, "_h_dep", formt, 0, mo, 0, no, header,
              "h_dep -- Deposit depth (m)     ", "5.2");
     /* Maximum flow depth */
-    writeout(h_max, "_h_max", formt, 0, m, 0, n, header,
-             "h_max -- Max. flow depth (m)   ", "5.2");
+    writeout_s(h_max, "_h_max", formt, 0, mo, 0, no, header,
+               "h_max -- Max. flow depth (m)   ", "5.2");
     /* Maximum speed */
-    writeout(s_max, "_s_max", formt, 0, m, 0, n, header,
-             "s_max -- Max. speed (m/s)      ", "6.2");
+    writeout_s(s_max, "_s_max", formt, 0, mo, 0, no, header,
+               "s_max -- Max. speed (m/s)      ", "6.2");
     /* Write min. snow cover depth only if erosion was specified: */
     if (eromod > 0)
-      writeout(b_min, "_b_min", formt, 0, m, 0, n, header,
-               "b -- Min. snowpack depth (m)   ", "5.3");
+      writeout_s(b_min, "_b_min", formt, 0, mo, 0, no, header,
+                 "b -- Min. snowpack depth (m)   ", "5.3");
     /* Write deposition only if it is activated */
     if (dep > 0)
-      writeout(d_max, "_d_max", formt, 0, m, 0, n, header,
-               "d_max -- Max. deposit (m)      ", "6.3");
+      writeout_s(d_max, "_d_max", formt, 0, mo, 0, no, header,
+                 "d_max -- Max. deposit (m)      ", "6.3");
     /* Write files for u, v only if requested: */
     if (!strncmp(write_vectors, "yes", 4)) {
-      writeout(u_max, "_u_max", formt, 0, m, 0, n, header,
-               "u_max -- Max. x-velocity (m/s) ", "7.2");
-      writeout(v_max, "_v_max", formt, 0, m, 0, n, header,
-               "v_max -- Max. y-velocity (m/s) ", "7.2");
+      writeout_s(u_max, "_u_max", formt, 0, mo, 0, no, header,
+                 "u_max -- Max. x-velocity (m/s) ", "7.2");
+      writeout_s(v_max, "_v_max", formt, 0, mo, 0, no, header,
+                 "v_max -- Max. y-velocity (m/s) ", "7.2");
     }
     /* Write maximum pressure only if requested: */
     if (!strncmp(write_max_press, "yes", 4))
-      writeout(p_max, "_p_max", formt, 0, m, 0, n, header,
-               "p_max -- Max. pressure (kPa)   ", "7.2");
+      writeout_s(p_max, "_p_max", formt, 0, mo, 0, no, header,
+                 "p_max -- Max. pressure (kPa)   ", "7.2");
     /* Write forest density nD only if forest can be destroyed */
     if (forest > 0)
-      writeout(nDt, "_nD_min", formt, 0, m, 0, n, header_nD,
-               "nD_min -- braking effect (1/m) ", "7.4");
+      writeout_s(nDt, "_nD_min", formt, 0, mo, 0, no, header_nD,
+                 "nD_min -- braking effect (1/m) ", "7.4");
+    /* Sensitivities of maximum depth and speed, if requested: */
+    for (p = 0; p < n_sens; p++) {
+      sprintf(suf, "_h_max_d%s", sens_names[sens_par[p]]);
+      sprintf(descr, "dh_max/d%-6s (m)", sens_names[sens_par[p]]);
+      writeout(tl_h_max[p], suf, formt, 0, mo, 0, no, header, descr, "7.4");
+      sprintf(suf, "_s_max_d%s", sens_names[sens_par[p]]);
+      sprintf(descr, "ds_max/d%-6s (m/s)", sens_names[sens_par[p]]);
+      writeout(tl_s_max[p], suf, formt, 0, mo, 0, no, header, descr, "7.4");
+    }
+    if (n_sens > 0)
+      writeout(tl_sw, "_sw_map", formt, 0, mo, 0, no, header,
+               "Switching events (-)", "7.0");
   }
 
+  if (nDt != NULL)
+    deallocate2s(nDt, m);
   printf(" done.\n");
 }
 
@@ -1558,16 +6046,34 @@ void write_data(double tid, double **h_dep, double **hf, double **bs,
 
 /** Called by write_data repeatedly to create output files in AAIGrid or
     Binaryterrain 1.3 format either for time slice or max. values at the
-    end of a run. */
+    end of a run. With domain decomposition, the processes write the rows
+    of their strips in turn, starting with the northernmost one, which also
+    writes the header. */
 
 void writeout(double **F, char* suffix, char* formt, size_t imin, size_t imax,
               size_t jmin, size_t jmax, char* headr, char* descr, char* ascfmt)
 
 {
   size_t nitems, length;
+  size_t ja = jmin, jb = jmax;          /* Rows written by this process */
   int    i, j, l;
   char   fn[1024], bn[511], dn[511], *addr, fmtstr[10], fmtstrn[11];
+  char   *mode = fmt;
   FILE * ofp;                           /* Pointer to output file handle */
+#ifdef USE_MPI
+  int    token = 0;
+
+  if (mpi_size > 1) {
+    if (mpi_rank > 0)
+      ja = MAX(jmin, wj0 / rfac + sub_j0);
+    if (mpi_rank < mpi_size-1) {
+      jb = MIN(jmax, wj0 / rfac + sub_j1);
+      mode = (!strncmp(fmt, "wb", 2) ? "r+b" : "a");
+      MPI_Recv(&token, 1, MPI_INT, mpi_rank+1, 0, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+    }
+  }
+#endif
 
   /* For time slices, reconstruct the directory where to write the file:
      All files for maximum (minimum) values go into the folder contained in
@@ -1581,13 +6087,13 @@ void writeout(double **F, char* suffix, char* formt, size_t imin, size_t imax,
     strncpy(dn, dirname(fn), 510);      /* go into specific subfolders. */
     sprintf(fn, "%s%s%c%s%s", dn, DIRSEP, suffix[1], DIRSEP, bn);
   }
-  strncat(fn, suffix, 7);               /* Common to time-slice and max files */
+  strncat(fn, suffix, 16);              /* Common to time-slice and max files */
   if (!strncmp(fmt, "wb", 2))           /* BinaryTerrain format */
     strncat(fn, ".bt", 4);
   else                                  /* ESRI ASCII Grid format */
     strncat(fn, ".asc", 5);
 
-  if ((ofp = fopen(fn, fmt)) == NULL) {
+  if ((ofp = fopen(fn, mode)) == NULL) {
     printf("\n   writeout:  Failed to open output file %s. STOP!\n\n", fn);
     exit(60);
   }
@@ -1606,36 +6112,55 @@ void writeout(double **F, char* suffix, char* formt, size_t imin, size_t imax,
       strncpy(headr+152, addr+1, length+1);
     else
       strcpy(headr+152, "TRUNCATED");
-    if (fwrite(headr, 1, 256, ofp) != 256) {
+    if (mode == fmt && fwrite(headr, 1, 256, ofp) != 256) {
       printf("\n   writeout:  Could not write file header. STOP!\n\n");
       exit(61);
     }
-    for (i = (int) imin, l = 0; i < (int) imax; i++)
-      for (j = (int) jmin; j < (int) jmax; j++, l++)
-        *(data+l) = (float) F[i][j];
-    nitems = (size_t) ((imax-imin) * (jmax-jmin));
-    if (fwrite(data, sizeof(float), nitems, ofp) != nitems) {
-      printf("\n   writeout:  Failed to write data to file. STOP!\n\n");
-      exit(62);
+    if (mpi_size == 1) {
+      for (i = (int) imin, l = 0; i < (int) imax; i++)
+        for (j = (int) jmin; j < (int) jmax; j++, l++)
+          *(data+l) = (float) WINDOW(F, i, j);
+      nitems = (size_t) ((imax-imin) * (jmax-jmin));
+      if (fwrite(data, sizeof(float), nitems, ofp) != nitems) {
+        printf("\n   writeout:  Failed to write data to file. STOP!\n\n");
+        exit(62);
+      }
     }
+    else                                /* The strip is a section of */
+      for (i = (int) imin; i < (int) imax && ja < jb; i++) {  /* each column */
+        for (j = (int) ja, l = 0; j < (int) jb; j++, l++)
+          *(data+l) = (float) WINDOW(F, i, j);
+        nitems = jb - ja;
+        if (fseek(ofp, (long) (256 + sizeof(float) * ((size_t) i - imin)
+                               * (jmax-jmin) + sizeof(float) * (ja-jmin)),
+                  SEEK_SET) != 0
+            || fwrite(data, sizeof(float), nitems, ofp) != nitems) {
+          printf("\n   writeout:  Failed to write data to file. STOP!\n\n");
+          exit(62);
+        }
+      }
   }
 
   else {                                /* ESRI ASCII Grid format */
     sprintf(fmtstr,  "\"%%%s \"",   ascfmt);
     sprintf(fmtstrn, "\"%%%s\\n\"", ascfmt);
-    if (fprintf(ofp, "%s", header) < 0) {
+    if (mode == fmt && fprintf(ofp, "%s", header) < 0) {
       printf("\n   writeout:  Could not write file header. STOP!\n\n");
       exit(61);
     }
 
-    for (j = (int) jmax-1; j >= (int) jmin; j--) {
+    for (j = (int) jb-1; j >= (int) ja; j--) {
       for (i = (int) imin; i < (int) imax-1; i++)
-        fprintf(ofp, "%.3f ", F[i][j]);
-      fprintf(ofp, "%.3f\n", F[imax-1][j]);
+        fprintf(ofp, "%.3f ", WINDOW(F, i, j));
+      fprintf(ofp, "%.3f\n", WINDOW(F, imax-1, j));
     }
   }
 
   fclose(ofp);
+#ifdef USE_MPI
+  if (mpi_size > 1 && mpi_rank > 0)     /* Next strip to the S */
+    MPI_Send(&token, 1, MPI_INT, mpi_rank-1, 0, MPI_COMM_WORLD);
+#endif
 }
 
 /*********************/
@@ -1643,13 +6168,50 @@ void writeout(double **F, char* suffix, char* formt, size_t imin, size_t imax,
 /*********************/
 
 
+/*********************/
+/*                   */
+/*  writeout_s(...)  */
+/*                   */
+/*********************/
+
+/** Writes a field of type real_s via writeout(). In single precision, the
+    field is first copied into a temporary double array. */
+
+void writeout_s(real_s **F, char* suffix, char* formt, size_t imin,
+                size_t imax, size_t jmin, size_t jmax, char* headr,
+                char* descr, char* ascfmt)
+
+{
+#ifdef FLOAT_FIELDS
+  size_t i, j;
+  double **T = allocate2(m, n);
+
+  for (i = 0; i < m; i++)
+    for (j = 0; j < n; j++)
+      T[i][j] = F[i][j];
+  writeout(T, suffix, formt, imin, imax, jmin, jmax, headr, descr, ascfmt);
+  deallocate2(T, m);
+#else
+  writeout(F, suffix, formt, imin, imax, jmin, jmax, headr, descr, ascfmt);
+#endif
+}
+
+/****************************/
+/*  End of writeout_s(...)  */
+/****************************/
+
+
 /********************/
 /*                  */
 /*  allocate2(...)  */
 /*                  */
 /********************/
 
-/*  Allocation of a two-dimensional double array using pointers to pointers. */
+/*  Allocation of a two-dimensional double array using pointers to pointers.
+    The rows are zeroed. With OpenMP, each row is allocated and zeroed by the
+    thread owning its tiles (static schedule with ROW_CHUNK rows per chunk,
+    cf. TILE_OWNER), which places it in the memory of that thread's socket
+    (first touch). */
 
 double **allocate2(size_t rows, size_t cols)
 
@@ -1672,7 +6234,11 @@ double **allocate2(size_t rows, size_t cols)
   }
 
   /* Now allocate space for each of the 1D subarrays  */
-  for (i = 0; i < m; i++) {
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static, ROW_CHUNK) private(tries) \
+          if (n_threads > 1)
+#endif
+  for (i = 0; i < rows; i++) {
     tries = 0;
     while (tries < TRIES_MAX
            && (p[i] = (double*) malloc(cols * sizeof(double))) == NULL) {
@@ -1683,6 +6249,7 @@ double **allocate2(size_t rows, size_t cols)
       printf("   allocate2:  Memory allocation failed. STOP!\n\n");
       exit(6);
     }
+    memset(p[i], 0, cols * sizeof(double));
   }
 
   return p;
@@ -1700,7 +6267,7 @@ double **allocate2(size_t rows, size_t cols)
 /********************/
 
 /* Allocation of a three-dimensional double array using pointers to pointers
-   to pointers. */
+   to pointers, zeroed and placed row by row like in allocate2(). */
 
 double*** allocate3(size_t rows, size_t cols, size_t stacks)
 
@@ -1721,6 +6288,10 @@ double*** allocate3(size_t rows, size_t cols, size_t stacks)
   }
 
   /* Now allocate space for each of the 1D subarrays  */
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static, ROW_CHUNK) private(j, tries) \
+          if (n_threads > 1)
+#endif
   for (i = 0; i < rows; i++) {
     tries = 0;
     while (tries < TRIES_MAX
@@ -1745,6 +6316,7 @@ double*** allocate3(size_t rows, size_t cols, size_t stacks)
         printf("   allocate3:  Memory allocation failed. STOP!\n\n");
         exit(7);
       }
+      memset(p[i][j], 0, stacks * sizeof(double));
     }
   }
 
@@ -1809,6 +6381,159 @@ void deallocate3(double ***p, size_t rows, size_t cols)
 /*****************************/
 
 
+/*********************/
+/*                   */
+/*  allocate2c(...)  */
+/*                   */
+/*********************/
+
+/* Allocation of a two-dimensional array of flag bytes, zeroed and placed
+   row by row like in allocate2(). */
+
+unsigned char **allocate2c(size_t rows, size_t cols)
+
+{
+  size_t i;
+  int    tries;
+  unsigned char **p;
+
+  tries = 0;
+  while (tries < TRIES_MAX
+         && (p = (unsigned char**) malloc(rows * sizeof(unsigned char*)))
+            == NULL) {
+    tries++;
+    sleep(TRY_WAIT);
+  }
+  if (tries >= TRIES_MAX) {
+    printf("   allocate2c:  Memory allocation failed. STOP!\n\n");
+    exit(6);
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static, ROW_CHUNK) private(tries) \
+          if (n_threads > 1)
+#endif
+  for (i = 0; i < rows; i++) {
+    tries = 0;
+    while (tries < TRIES_MAX
+           && (p[i] = (unsigned char*) malloc(cols)) == NULL) {
+      tries++;
+      sleep(TRY_WAIT);
+    }
+    if (tries >= TRIES_MAX) {
+      printf("   allocate2c:  Memory allocation failed. STOP!\n\n");
+      exit(6);
+    }
+    memset(p[i], 0, cols);
+  }
+
+  return p;
+}
+
+/****************************/
+/*  End of allocate2c(...)  */
+/****************************/
+
+
+/***********************/
+/*                     */
+/*  deallocate2c(...)  */
+/*                     */
+/***********************/
+
+/* Frees a two-dimensional array of flag bytes. */
+
+void deallocate2c(unsigned char **p, size_t rows)
+
+{
+  size_t i;
+
+  for (i = 0; i < rows; i++)
+    free(p[i]);
+  free(p);
+}
+
+/******************************/
+/*  End of deallocate2c(...)  */
+/******************************/
+
+
+/*********************/
+/*                   */
+/*  allocate2s(...)  */
+/*                   */
+/*********************/
+
+/* Allocation of a two-dimensional array of type real_s, zeroed and placed
+   row by row like in allocate2(). */
+
+real_s **allocate2s(size_t rows, size_t cols)
+
+{
+  size_t i;
+  int    tries;
+  real_s **p;
+
+  tries = 0;
+  while (tries < TRIES_MAX
+         && (p = (real_s**) malloc(rows * sizeof(real_s*))) == NULL) {
+    tries++;
+    sleep(TRY_WAIT);
+  }
+  if (tries >= TRIES_MAX) {
+    printf("   allocate2s:  Memory allocation failed. STOP!\n\n");
+    exit(6);
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static, ROW_CHUNK) private(tries) \
+          if (n_threads > 1)
+#endif
+  for (i = 0; i < rows; i++) {
+    tries = 0;
+    while (tries < TRIES_MAX
+           && (p[i] = (real_s*) malloc(cols * sizeof(real_s))) == NULL) {
+      tries++;
+      sleep(TRY_WAIT);
+    }
+    if (tries >= TRIES_MAX) {
+      printf("   allocate2s:  Memory allocation failed. STOP!\n\n");
+      exit(6);
+    }
+    memset(p[i], 0, cols * sizeof(real_s));
+  }
+
+  return p;
+}
+
+/****************************/
+/*  End of allocate2s(...)  */
+/****************************/
+
+
+/***********************/
+/*                     */
+/*  deallocate2s(...)  */
+/*                     */
+/***********************/
+
+/* Frees a two-dimensional array of type real_s. */
+
+void deallocate2s(real_s **p, size_t rows)
+
+{
+  size_t i;
+
+  for (i = 0; i < rows; i++)
+    free(p[i]);
+  free(p);
+}
+
+/******************************/
+/*  End of deallocate2s(...)  */
+/******************************/
+
+
 /****************/
 /*              */
 /*  allocate()  */
@@ -1821,10 +6546,12 @@ void allocate(void)
 
 {
   int     tries;                /* # failed memory allocation attempts */
+  int     p;
+  size_t  i;
 
   f_old   = allocate3(m, n, 3);
   f_new   = allocate3(m, n, 3);
-  src     = allocate3(m, n, 3);
+  src     = allocate3(m, n, (fric_exact ? 5 : 3));
 
   dx      = allocate2(m, n);
   dy      = allocate2(m, n);
@@ -1834,28 +6561,34 @@ void allocate(void)
   gz      = allocate2(m, n);
   gz0     = allocate2(m, n);
   G_xy    = allocate2(m, n);
-  kxx     = allocate2(m, n);
-  kyy     = allocate2(m, n);
-  kxy     = allocate2(m, n);
+  kxx     = allocate2s(m, n);
+  kyy     = allocate2s(m, n);
+  kxy     = allocate2s(m, n);
+  px      = allocate2(m+1, n);
+  py      = allocate2(m, n+1);
   h       = allocate2(m, n);
   s       = allocate2(m, n);
   u       = allocate2(m, n);
   v       = allocate2(m, n);
   d       = allocate2(m, n);
   p_imp   = allocate2(m, n);
-  h_max   = allocate2(m, n);
-  s_max   = allocate2(m, n);
-  u_max   = allocate2(m, n);
-  v_max   = allocate2(m, n);
-  p_max   = allocate2(m, n);
-  mu      = allocate2(m, n);
-  k       = allocate2(m, n);
+  h_max   = allocate2s(m, n);
+  s_max   = allocate2s(m, n);
+  u_max   = allocate2s(m, n);
+  v_max   = allocate2s(m, n);
+  p_max   = allocate2s(m, n);
   z0      = allocate2(m, n);
+  if (strlen(zone_fn) > 0)              /* Parameters from the zone table */
+    zone  = allocate2c(m, n);
+  else {
+    mu    = allocate2s(m, n);
+    k     = allocate2s(m, n);
+  }
 
   if (!strncmp(fmt, "wb", 2)) {
     tries = 0;
     while (tries < TRIES_MAX
-           && (data = (float*) malloc(m*n * sizeof(float))) == NULL) {
+           && (data = (float*) malloc(m_all*n_all * sizeof(float))) == NULL) {
       tries++;
       sleep(TRY_WAIT);
     }
@@ -1867,26 +6600,77 @@ void allocate(void)
 
   if (eromod > 0) {                     /* All erosion models */
     b     = allocate2(m, n);
-    b_min = allocate2(m, n);
-    if (eromod > 1) {                   /* TJEM, AvaFrame or GOEM */
-      tau_c = allocate2(m, n);
-      mu_s  = allocate2(m, n);
+    b_min = allocate2s(m, n);
+    if (eromod > 1 && zone == NULL) {   /* TJEM, AvaFrame, GOEM or IsPa */
+      tau_c = allocate2s(m, n);
+      mu_s  = allocate2s(m, n);
+    }
+    if (eromod == 4) {                  /* GOEM: stored bed gradient */
+      bgx = allocate2(m, n);
+      bgy = allocate2(m, n);
+      bg_stale = allocate2c(m, n);
+      for (i = 0; i < m; i++)
+        memset(bg_stale[i], 1, n);      /* Computed on first use */
     }
   }
 
   if (forest > 0) {                     /* Account for braking by forest */
-    nD = allocate2(m, n);
-    tD = allocate2(m, n);
-    decay_const = allocate2(m, n);
+    if ((fc_row = (size_t*) malloc((m+1) * sizeof(size_t))) == NULL
+        || (fc_idx = (int*) malloc(m*n * sizeof(int))) == NULL) {
+      printf("   allocate:  Memory allocation failed. STOP!\n\n");
+      exit(8);
+    }
   }
 
-  if (dep > 0) {
-    d     = allocate2(m, n);
-    d_max = allocate2(m, n);
+  if (dep > 0)
+    d_max = allocate2s(m, n);
+
+#ifdef USE_MPI
+  if (mpi_size > 1                      /* Halo rows of up to 5 fields */
+      && (halo_buf = (double*) malloc(2*HALO_ROWS*m*5 * sizeof(double)))
+         == NULL) {
+    printf("   allocate:  Memory allocation failed. STOP!\n\n");
+    exit(8);
   }
+#endif
 
-  if (dyn_surf > 0)
+  if (dyn_surf > 0) {
     z      = allocate2(m, n);
+    bd_geo = allocate2(m, n);
+    geo_flag = allocate2c(m, n);
+    if ((geo_dirty = (size_t*) malloc(2*m*n * sizeof(size_t))) == NULL) {
+      printf("   allocate:  Memory allocation failed. STOP!\n\n");
+      exit(8);
+    }
+  }
+
+  if (slp_on) {                         /* Sleeping cells */
+    slp = allocate2c(m, n);
+    if ((slp_line = (unsigned char*) malloc(m)) == NULL) {
+      printf("   allocate:  Memory allocation failed. STOP!\n\n");
+      exit(8);
+    }
+  }
+
+  if (n_sens > 0) {                     /* Tangent-linear sensitivities */
+    src_raw = allocate2(m, n);
+    tl_sw = allocate2(m, n);
+    for (p = 0; p < n_sens; p++) {
+      tl_f_old[p] = allocate3(m, n, 3);
+      tl_f_new[p] = allocate3(m, n, 3);
+      tl_src[p]   = allocate3(m, n, 3);
+      tl_h[p]     = allocate2(m, n);
+      tl_u[p]     = allocate2(m, n);
+      tl_v[p]     = allocate2(m, n);
+      tl_s[p]     = allocate2(m, n);
+      tl_h_max[p] = allocate2(m, n);
+      tl_s_max[p] = allocate2(m, n);
+      if (eromod > 0)
+        tl_b[p]   = allocate2(m, n);
+      if (dep > 0)
+        tl_d[p]   = allocate2(m, n);
+    }
+  }
 }
 
 /***********************/
@@ -1905,53 +6689,111 @@ void allocate(void)
 void deallocate(void)
 
 {
-  if (dyn_surf > 0)
+  int     p;
+
+  if (n_sens > 0) {
+    for (p = n_sens-1; p >= 0; p--) {
+      if (dep > 0)
+        deallocate2(tl_d[p], m);
+      if (eromod > 0)
+        deallocate2(tl_b[p], m);
+      deallocate2(tl_s_max[p], m);
+      deallocate2(tl_h_max[p], m);
+      deallocate2(tl_s[p], m);
+      deallocate2(tl_v[p], m);
+      deallocate2(tl_u[p], m);
+      deallocate2(tl_h[p], m);
+      deallocate3(tl_src[p], m, n);
+      deallocate3(tl_f_new[p], m, n);
+      deallocate3(tl_f_old[p], m, n);
+    }
+    deallocate2(tl_sw, m);
+    deallocate2(src_raw, m);
+  }
+
+  if (slp != NULL) {                    /* Sleeping cells */
+    free(slp_line);
+    deallocate2c(slp, m);
+    slp = NULL;
+  }
+
+  if (dyn_surf > 0) {
+    free(geo_dirty);
+    deallocate2c(geo_flag, m);
+    deallocate2(bd_geo, m);
     deallocate2(z, m);
+  }
 
-  if (dep > 0) {
-    deallocate2(d_max, m);
-    deallocate2(d, m);
+  if (cmask != NULL) {                  /* NODATA or obstacle cells */
+    deallocate2c(cmask, m);
+    cmask = NULL;
   }
 
+  if (dep > 0)
+    deallocate2s(d_max, m);
+
   if (forest > 0) {                     /* Account for braking by forest */
-    deallocate2(decay_const, m);
-    deallocate2(tD, m);
-    deallocate2(nD, m);
+    free(fc);                           /* Built in read_init_file() */
+    fc = NULL;
+    n_fc = 0;
+    free(fc_idx);
+    free(fc_row);
   }
 
   if (eromod > 0) {
-    if (eromod > 1) {                   /* TJEM, AvaFrame, GOEM only */
-      deallocate2(mu_s, m);
-      deallocate2(tau_c, m);
+    if (eromod == 4) {                  /* GOEM only */
+      deallocate2c(bg_stale, m);
+      deallocate2(bgy, m);
+      deallocate2(bgx, m);
+    }
+    if (eromod == 5) {                  /* IsPa only */
+      free(etab);
+      etab = NULL;
     }
-    deallocate2(b_min, m);              /* All erosion models */
+    if (eromod > 1 && zone == NULL) {   /* TJEM, AvaFrame, GOEM, IsPa only */
+      deallocate2s(mu_s, m);
+      deallocate2s(tau_c, m);
+    }
+    deallocate2s(b_min, m);             /* All erosion models */
     deallocate2(b, m);
   }
 
   if (!strncmp(fmt, "wb", 2))
     free(data);
+#ifdef USE_MPI
+  if (mpi_size > 1)
+    free(halo_buf);
+#endif
 
   deallocate3(src, m, n);
   deallocate3(f_new, m, n);
   deallocate3(f_old, m, n);
 
   deallocate2(z0, m);
-  deallocate2(k, m);
-  deallocate2(mu, m);
-  deallocate2(p_max, m);
-  deallocate2(v_max, m);
-  deallocate2(u_max, m);
-  deallocate2(s_max, m);
-  deallocate2(h_max, m);
+  if (zone != NULL) {
+    deallocate2c(zone, m);
+    zone = NULL;
+  }
+  else {
+    deallocate2s(k, m);
+    deallocate2s(mu, m);
+  }
+  deallocate2s(p_max, m);
+  deallocate2s(v_max, m);
+  deallocate2s(u_max, m);
+  deallocate2s(s_max, m);
+  deallocate2s(h_max, m);
   deallocate2(p_imp, m);
   deallocate2(d, m);
   deallocate2(v, m);
   deallocate2(u, m);
   deallocate2(s, m);
   deallocate2(h, m);
-  deallocate2(kxy, m);
-  deallocate2(kyy, m);
-  deallocate2(kxx, m);
+  deallocate2s(kxy, m);
+  deallocate2(py, m);
+  deallocate2(px, m+1);
+  deallocate2s(kyy, m);
+  deallocate2s(kxx, m);
   deallocate2(G_xy, m);
   deallocate2(gz0, m);
   deallocate2(gz, m);
@@ -1997,7 +6839,8 @@ void create_dir(char *main_folder, char *subfolder)
     #ifdef WINDOWS
       ec = mkdir(folder);
     #endif
-    if (ec != 0) {              /* Some error has occurred, exit. */
+    /* Another MPI process may have created the folder meanwhile: */
+    if (ec != 0 && errno != EEXIST) {   /* Some error has occurred, exit. */
       printf("\n   Failed to create missing target folder %s. STOP!\n", folder);
       printf("   mkdir error code:  %d.\n\n", ec);
       exit(70);
@@ -2044,6 +6887,9 @@ void read_command_file(char *ifn)
   int    n_items;                   /* # data lines in input file */
   int    lest = 0;                  /* Counts # variables read */
   int    dummy = 0;                 /* Counts # irrelevant chars read. */
+  int    i;
+  int    t_size;                    /* Tile size as read */
+  char   *word;                     /* Token in line with optional setting */
 
   if ((ifp = fopen(ifn, "r")) == NULL) {
     printf("   Failed to open %s. STOP!\n\n", ifn);
@@ -2250,6 +7096,8 @@ void read_command_file(char *ifn)
     eromod = 3;
   else if (!strncmp(erosion, "GOEM", 5))
     eromod = 4;
+  else if (!strncmp(erosion, "IsPa", 5))
+    eromod = 5;
   else {
     printf("   Entrainment model \"%s\" not implemented.\n", erosion);
     printf("   Calculation is carried out without entrainment.\n\n");
@@ -2257,7 +7105,7 @@ void read_command_file(char *ifn)
   }
   printf("%2d  eromod          = %1d\n", lest, eromod);
   lest += fscanf(ifp, "Erosion coefficient (-) %lf\n", &k_erod);
-  if (eromod == 0 || eromod == 2)
+  if (eromod == 0 || eromod == 2 || eromod == 5)
     k_erod = 0.0;                       /* No need for erosion coefficient */
   else if ((eromod == 1 || eromod == 3 || eromod == 4) && k_erod <= 0.0) {
     printf("   Warning:  You need k_erod > 0 to obtain erosion!\n");
@@ -2345,6 +7193,172 @@ void read_command_file(char *ifn)
   lest += fscanf(ifp, "Initial CFL number (-) %lf\n", &cfl);
   printf("%2d  CFL             = %5.3f\n", lest, cfl);
 
+  /* Optional settings may follow the mandatory items in any input file
+     version, one per line in the form "<keyword>  <value(s)>". They are not
+     counted in lest. */
+  while (fgets(line, 512, ifp) != NULL) {
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+      continue;                         /* Skip comments and empty lines */
+    if (!strncmp(line, "Sensitivity parameters", 22)) {
+      for (word = strtok(line+22, " \t\r\n"); word != NULL;
+           word = strtok(NULL, " \t\r\n")) {
+        for (i = 0; i < N_SENS_MAX && strcmp(word, sens_names[i]); i++)
+          ;
+        if (i == N_SENS_MAX) {
+          printf("   Unknown sensitivity parameter %s. STOP!\n\n", word);
+          exit(80);
+        }
+        if (n_sens == N_SENS_MAX) {
+          printf("   At most %d sensitivity parameters. STOP!\n\n",
+                 N_SENS_MAX);
+          exit(81);
+        }
+        sens_par[n_sens++] = i;
+        printf("    sensitivity     = d/d%s\n", word);
+      }
+    }
+    else if (!strncmp(line, "AMR levels", 10)) {
+      if (sscanf(line+10, "%d", &amr_levels) != 1
+          || amr_levels < 1 || amr_levels > AMR_LEVELS_MAX) {
+        printf("   AMR levels must be between 1 and %d. STOP!\n\n",
+               AMR_LEVELS_MAX);
+        exit(82);
+      }
+      printf("    amr_levels      = %d\n", amr_levels);
+    }
+    else if (!strncmp(line, "AMR regrid interval", 19)) {
+      if (sscanf(line+19, "%d", &amr_interval) != 1 || amr_interval < 1) {
+        printf("   AMR regrid interval must be >= 1. STOP!\n\n");
+        exit(83);
+      }
+      printf("    amr_interval    = %d\n", amr_interval);
+    }
+    else if (!strncmp(line, "AMR depth tolerance", 19)) {
+      if (sscanf(line+19, "%lf", &amr_tol) != 1 || amr_tol <= 0.0) {
+        printf("   AMR depth tolerance must be > 0. STOP!\n\n");
+        exit(84);
+      }
+      printf("    amr_tol         = %.3f\n", amr_tol);
+    }
+    else if (!strncmp(line, "Grid coarsening factor", 22)) {
+      if (sscanf(line+22, "%d", &grid_fac) != 1 || grid_fac < 1) {
+        printf("   Grid coarsening factor must be >= 1. STOP!\n\n");
+        exit(85);
+      }
+      rfac = (size_t) grid_fac;
+      printf("    grid_fac        = %d\n", grid_fac);
+    }
+    else if (!strncmp(line, "Energy-line pre-screen", 22)) {
+      if (sscanf(line+22, "%lf %lf", &el_alpha, &el_margin) != 2
+          || el_alpha <= 0.0 || el_alpha >= 90.0 || el_margin < 0.0) {
+        printf("   Energy-line pre-screen needs an angle between 0 and 90°");
+        printf(" and a margin >= 0 m. STOP!\n\n");
+        exit(86);
+      }
+      printf("    el_alpha        = %.1f\n", el_alpha);
+      printf("    el_margin       = %.1f\n", el_margin);
+    }
+    else if (!strncmp(line, "Footprint pre-run", 17)) {
+      if (sscanf(line+17, "%d %lf", &crop_fac, &crop_margin) != 2
+          || crop_fac < 2 || crop_margin < 0.0) {
+        printf("   Footprint pre-run needs a factor >= 2 and a margin");
+        printf(" >= 0 m. STOP!\n\n");
+        exit(87);
+      }
+      printf("    crop_fac        = %d\n", crop_fac);
+      printf("    crop_margin     = %.1f\n", crop_margin);
+    }
+    else if (!strncmp(line, "Mass recount interval", 21)) {
+      if (sscanf(line+21, "%d", &mass_interval) != 1 || mass_interval < 0) {
+        printf("   Mass recount interval must be >= 0. STOP!\n\n");
+        exit(88);
+      }
+      printf("    mass_interval   = %d\n", mass_interval);
+    }
+    else if (!strncmp(line, "Tile size", 9)) {
+      if (sscanf(line+9, "%d", &t_size) != 1 || t_size < 2) {
+        printf("   Tile size must be >= 2 cells. STOP!\n\n");
+        exit(89);
+      }
+      tile_size = (size_t) t_size;
+      printf("    tile_size       = "ST"\n", tile_size);
+    }
+    else if (!strncmp(line, "Friction scheme", 15)) {
+      word = strtok(line+15, " \t\r\n");
+      if (word == NULL || (strcmp(word, "explicit") && strcmp(word, "exact"))) {
+        printf("   Friction scheme must be explicit or exact. STOP!\n\n");
+        exit(90);
+      }
+      fric_exact = !strcmp(word, "exact");
+      printf("    fric_exact      = %d\n", fric_exact);
+    }
+    else if (!strncmp(line, "Sleeping cells", 14)) {
+      word = strtok(line+14, " \t\r\n");
+      if (word == NULL || (strcmp(word, "yes") && strcmp(word, "no"))) {
+        printf("   Sleeping cells must be yes or no. STOP!\n\n");
+        exit(94);
+      }
+      slp_on = !strcmp(word, "yes");
+      printf("    slp_on          = %d\n", slp_on);
+    }
+    else if (!strncmp(line, "Reductions", 10)) {
+      word = strtok(line+10, " \t\r\n");
+      if (word == NULL
+          || (strcmp(word, "deterministic") && strcmp(word, "fast"))) {
+        printf("   Reductions must be deterministic or fast. STOP!\n\n");
+        exit(95);
+      }
+      det_on = !strcmp(word, "deterministic");
+      printf("    det_on          = %d\n", det_on);
+    }
+    else if (!strncmp(line, "Reproducibility check", 21)) {
+      word = strtok(line+21, " \t\r\n");
+      if (word == NULL || (strcmp(word, "yes") && strcmp(word, "no"))) {
+        printf("   Reproducibility check must be yes or no. STOP!\n\n");
+        exit(96);
+      }
+      repro_on = !strcmp(word, "yes");
+      printf("    repro_on        = %d\n", repro_on);
+    }
+    else if (!strncmp(line, "Geometry update tolerance", 25)) {
+      if (sscanf(line+25, "%lf", &geo_tol) != 1 || geo_tol < 0.0) {
+        printf("   Geometry update tolerance must be >= 0 m. STOP!\n\n");
+        exit(97);
+      }
+      printf("    geo_tol         = %.3f\n", geo_tol);
+    }
+    else if (!strncmp(line, "Obstacle filename", 17)) {
+      if (sscanf(line+17, " %511[^\r\n]", obst_fn) != 1) {
+        printf("   Obstacle filename is missing. STOP!\n\n");
+        exit(98);
+      }
+      printf("    obst_fn         = %s\n", obst_fn);
+    }
+    else if (!strncmp(line, "Zone filename", 13)) {
+      if (sscanf(line+13, " %511[^\r\n]", zone_fn) != 1) {
+        printf("   Zone filename is missing. STOP!\n\n");
+        exit(99);
+      }
+      printf("    zone_fn         = %s\n", zone_fn);
+    }
+    else if (!strncmp(line, "Erosion table filename", 22)) {
+      if (sscanf(line+22, " %511[^\r\n]", erod_tab_fn) != 1) {
+        printf("   Erosion table filename is missing. STOP!\n\n");
+        exit(100);
+      }
+      printf("    erod_tab_fn     = %s\n", erod_tab_fn);
+    }
+    else if (!strncmp(line, "Zone table filename", 19)) {
+      if (sscanf(line+19, " %511[^\r\n]", zone_tab_fn) != 1) {
+        printf("   Zone table filename is missing. STOP!\n\n");
+        exit(101);
+      }
+      printf("    zone_tab_fn     = %s\n", zone_tab_fn);
+    }
+    else
+      printf("   read_command_file:  Unknown setting ignored: %s", line);
+  }
+
   n_items = (ifv == 0 ? 46 : (ifv == 1 ? 45 : 41));
   fclose(ifp);
   if (lest != n_items) {
@@ -2416,11 +7430,13 @@ void read_command_file(char *ifn)
     printf("   mu >= 0 and k >= 0 required. STOP!\n\n");
     exit(22);
   }
-  if (!strncmp(params, "variable", 9) && (strstr(mu_fn, "_mu.asc") == NULL)) {
+  if (!strncmp(params, "variable", 9) && strlen(zone_fn) == 0
+      && (strstr(mu_fn, "_mu.asc") == NULL)) {
     printf("   ! Dry-friction coefficient file does not end in '_mu.asc'.\n");
     printf("        %s\n", mu_fn);
   }
-  if (!strncmp(params, "variable", 9) && (strstr(k_fn, "_k.asc") == NULL)) {
+  if (!strncmp(params, "variable", 9) && strlen(zone_fn) == 0
+      && (strstr(k_fn, "_k.asc") == NULL)) {
     printf("   ! Turb.-friction parameter file does not end in '_k.asc'.\n");
     printf("             %s\n", k_fn);
   }
@@ -2431,6 +7447,60 @@ void read_command_file(char *ifn)
   if (h_drag < 0.0)                     /* Effective flow depth in drag term */
     h_drag = 0.0;                       /* must be non-negative. */
 
+  if (amr_levels > 1
+      && (eromod > 0 || dep > 0 || forest > 0 || dyn_surf > 0 || n_sens > 0)) {
+    printf("   Mesh refinement is not available with entrainment,");
+    printf(" deposition, forest,\n   evolving geometry or sensitivities.");
+    printf(" STOP!\n\n");
+    exit(110);
+  }
+  if (strlen(obst_fn) > 0 && (amr_levels > 1 || n_sens > 0)) {
+    printf("   Obstacles are not available with mesh refinement or");
+    printf(" sensitivities. STOP!\n\n");
+    exit(111);
+  }
+  if ((strlen(zone_fn) > 0) != (strlen(zone_tab_fn) > 0)) {
+    printf("   Parameter zones need both a zone raster and a zone");
+    printf(" table. STOP!\n\n");
+    exit(112);
+  }
+  if (strlen(zone_fn) > 0 && (strcmp(params, "variable") || amr_levels > 1)) {
+    printf("   Parameter zones require \"Parameters variable\" and are");
+    printf(" not available with\n   mesh refinement. STOP!\n\n");
+    exit(113);
+  }
+
+  if (fric_exact && n_sens > 0) {
+    printf("   Sensitivities are not available with the exact friction");
+    printf(" scheme. STOP!\n\n");
+    exit(115);
+  }
+  if (slp_on && (amr_levels > 1 || n_sens > 0)) {
+    printf("   Sleeping cells are not available with mesh refinement or");
+    printf(" sensitivities. STOP!\n\n");
+    exit(118);
+  }
+  if (repro_on && !det_on) {
+    printf("   The reproducibility check needs deterministic reductions."
+           " STOP!\n\n");
+    exit(119);
+  }
+#ifndef _OPENMP
+  if (repro_on)
+    printf("   Warning:  Without OpenMP, the reproducibility check compares two"
+           " runs on one thread.\n");
+#endif
+
+  if (eromod == 5 && strlen(erod_tab_fn) == 0) {
+    printf("   Entrainment IsPa requires an erosion table. STOP!\n\n");
+    exit(121);
+  }
+
+  for (i = 0; i < n_sens; i++)
+    if (sens_par[i] == SENS_KERO && eromod != 1 && eromod != 4)
+      printf("   Warning:  k_erod is not used by erosion model %d,"
+             " dh/dk_erod = 0.\n", eromod);
+
   if (t_max < 0.0) {
     printf("   t_max must be >= 0.0, input as %.1f s. STOP!\n\n", t_max);
     exit(23);
@@ -2439,6 +7509,11 @@ void read_command_file(char *ifn)
     printf("   0.0 < dt_min <= dt_max required. STOP!\n\n");
     exit(24);
   }
+  if (n_sens > 0 && dt_min < dt_max) {
+    printf("   Sensitivities need a fixed time step (dt_min = dt_max)."
+           " STOP!\n\n");
+    exit(126);
+  }
 
   if (strncmp(write_vectors, "yes", 4) && strncmp(write_vectors, "no", 3)) {
     printf("   Value of \'Write velocity vectors\' must be \'yes\'");
@@ -2509,3 +7584,88 @@ void read_command_file(char *ifn)
 /* End of read_command_file() */
 /******************************/
 
+
+/******************/
+/*                */
+/*  Tile drivers  */
+/*                */
+/******************/
+
+/** The drivers run the hot kernels (declared KERNEL, i.e., inlined here)
+   over the tiles and hold the parallel region. FOR_TILES runs BODY for
+   every tile of the phases [PH0, PH1) and stops before a phase if STOP is
+   true; all threads wait for each other at the end of a phase. */
+
+#define FOR_TILES(PH0, PH1, STOP, BODY)                                   \
+  tile_start();                                                           \
+  TILE_PARALLEL                                                           \
+  {                                                                       \
+    struct tile *tp;                                                      \
+    int ph;                                                               \
+    for (ph = (PH0); ph < (PH1) && !(STOP); ph++) {                       \
+      while ((tp = tile_next(ph)) != NULL) {                              \
+        BODY;                                                             \
+        tile_done();                                                      \
+      }                                                                   \
+      TILE_BARRIER                                                        \
+    }                                                                     \
+  }                                                                       \
+  tile_stop();
+
+/** Source terms into src */
+
+void run_source_terms(void)
+
+{
+  FOR_TILES(TILE_ALL, TILE_ALL+1, 0, source_terms(tp))
+}
+
+/** Transport step, returns 1 if h < 0 somewhere */
+
+int run_flux_sweep(void)
+
+{
+  FOR_TILES(TILE_ALL, TILE_PHASES, tile_failed(ph),
+            if (ph == TILE_ALL) face_pressure(tp);
+            else tp->neg = flux_sweep(tp))
+  return tile_sum();
+}
+
+/** Primitive variables from f */
+
+void run_primivar(double ***f)
+
+{
+  FOR_TILES(TILE_ALL, TILE_ALL+1, 0, primivar(f, tp))
+}
+
+/** Active region and movement of each tile */
+
+void run_bounds(double ***f)
+
+{
+  FOR_TILES(TILE_ALL, TILE_ALL+1, 0, tile_bounds(f, tp))
+}
+
+/** Time step, minimum over the tiles */
+
+double run_find_dt(void)
+
+{
+  FOR_TILES(TILE_ALL, TILE_ALL+1, 0, tp->dt = find_dt(tp))
+  return tile_min_dt();
+}
+
+/** Exact friction update */
+
+void run_friction_step(void)
+
+{
+  FOR_TILES(TILE_ALL, TILE_ALL+1, 0, friction_step(tp))
+}
+
+#undef FOR_TILES
+
+/*************************/
+/*  End of tile drivers  */
+/*************************/